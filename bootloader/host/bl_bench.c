@@ -0,0 +1,215 @@
+/*
+ * Times updates through the in-process UART pipe, with no serial port or
+ * emulator in the way:
+ *
+ *   ./bl_bench --size 65536 --frame-size 256 --runs 20 --erase-us 20000 --program-us 20
+ *
+ * Each run sends a plain update of --size random bytes and waits for every
+ * OK, like fw_update.py. The updates are version 0, so the bootloader takes
+ * any number of them in a row. UART2's debug output is thrown away unless
+ * --verbose is given.
+ */
+
+// Library Imports
+#include "uart.h"
+
+// Application Imports
+#include "hal_host.h"
+#include "crc32.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define OK 0x00
+#define REPLY_TIMEOUT_MS 2000
+#define FRAME_HEADER_LEN 4
+#define FRAME_CRC_LEN 4
+#define MAX_FRAME 1024
+
+static int verbose = 0;
+
+
+static double now_s(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+static void put_crc(unsigned char *dst, const unsigned char *buf, unsigned int len) {
+  uint32_t crc = crc32_update(0, buf, len);
+
+  dst[0] = crc >> 24;
+  dst[1] = crc >> 16;
+  dst[2] = crc >> 8;
+  dst[3] = crc;
+}
+
+
+/*
+ * Wait for the answer to what was just sent; anything but OK ends the run.
+ */
+static void expect_ok(const char *what, uint32_t seq) {
+  unsigned char reply;
+
+  if (host_uart_recv(UART1, &reply, 1, REPLY_TIMEOUT_MS) != 1 || reply != OK) {
+    fprintf(stderr, "No OK for the %s %u\n", what, seq);
+    exit(1);
+  }
+}
+
+
+static void send_frame(uint16_t seq, const unsigned char *data, uint32_t len) {
+  unsigned char frame[FRAME_HEADER_LEN + MAX_FRAME + FRAME_CRC_LEN];
+
+  frame[0] = len >> 8;
+  frame[1] = len;
+  frame[2] = seq >> 8;
+  frame[3] = seq;
+  memcpy(frame + FRAME_HEADER_LEN, data, len);
+  put_crc(frame + FRAME_HEADER_LEN + len, frame, FRAME_HEADER_LEN + len);
+  host_uart_send(UART1, frame, FRAME_HEADER_LEN + len + FRAME_CRC_LEN);
+  expect_ok("frame", seq);
+}
+
+
+/*
+ * Send one update, once the 'U' the caller queued has been answered.
+ */
+static void run_update(const unsigned char *body, uint32_t size, uint32_t frame_size) {
+  unsigned char metadata[8 + FRAME_CRC_LEN] = {0, 0, size & 0xFF, (size >> 8) & 0xFF, 0, 0, 0, 0};
+  unsigned char echo = 0;
+  uint16_t seq = 0;
+
+  while (echo != 'U') {
+    if (host_uart_recv(UART1, &echo, 1, REPLY_TIMEOUT_MS) != 1) {
+      fprintf(stderr, "Bootloader did not enter update mode\n");
+      exit(1);
+    }
+  }
+
+  put_crc(metadata + 8, metadata, 8);
+  host_uart_send(UART1, metadata, sizeof(metadata));
+  expect_ok("metadata", 0);
+
+  for (uint32_t offset = 0; offset < size; offset += frame_size) {
+    uint32_t len = size - offset < frame_size ? size - offset : frame_size;
+    send_frame(seq++, body + offset, len);
+  }
+  send_frame(seq, NULL, 0);
+}
+
+
+/*
+ * Keep UART2 drained, so the device never blocks on its debug output.
+ */
+static void *drain_debug(void *arg) {
+  char buf[256];
+
+  (void) arg;
+  while (1) {
+    size_t n = host_uart_recv(UART2, buf, sizeof(buf), 100);
+    if (verbose) {
+      fwrite(buf, 1, n, stderr);
+    }
+  }
+  return NULL;
+}
+
+
+static void *device(void *arg) {
+  (void) arg;
+  if (setjmp(host_reset)) {
+    fprintf(stderr, "Bootloader reset during the benchmark\n");
+    exit(1);
+  }
+  bootloader_main();
+  return NULL;
+}
+
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [--size BYTES] [--frame-size N] [--runs N] [--flash FILE] "
+          "[--erase-us N] [--program-us N] [--verbose]\n", name);
+  exit(2);
+}
+
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+    {"size", required_argument, NULL, 's'},
+    {"frame-size", required_argument, NULL, 'n'},
+    {"runs", required_argument, NULL, 'r'},
+    {"flash", required_argument, NULL, 'f'},
+    {"erase-us", required_argument, NULL, 'e'},
+    {"program-us", required_argument, NULL, 'p'},
+    {"verbose", no_argument, NULL, 'v'},
+    {NULL, 0, NULL, 0},
+  };
+  host_config_t config = {"bench-flash.bin", 0, 0};
+  uint32_t size = 32768;
+  uint32_t frame_size = 256;
+  int runs = 10;
+  pthread_t thread;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 's': size = strtoul(optarg, NULL, 0); break;
+    case 'n': frame_size = strtoul(optarg, NULL, 0); break;
+    case 'r': runs = atoi(optarg); break;
+    case 'f': config.flash_path = optarg; break;
+    case 'e': config.erase_us = strtoul(optarg, NULL, 0); break;
+    case 'p': config.program_us = strtoul(optarg, NULL, 0); break;
+    case 'v': verbose = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (frame_size == 0 || frame_size > MAX_FRAME || MAX_FRAME % frame_size || size > 0xFFFF || runs < 1) {
+    usage(argv[0]);
+  }
+
+  if (host_init(&config)) {
+    perror(config.flash_path);
+    return 1;
+  }
+
+  unsigned char *body = malloc(size ? size : 1);
+  srand(1);
+  for (uint32_t i = 0; i < size; i++) {
+    body[i] = rand();
+  }
+
+  // The first 'U' is queued before the device starts, so it is already
+  // waiting when the autoboot window opens and the device never autoboots.
+  host_uart_send(UART1, "U", 1);
+  pthread_create(&thread, NULL, drain_debug, NULL);
+  pthread_create(&thread, NULL, device, NULL);
+
+  double total = 0;
+  double best = 0;
+  for (int run = 0; run < runs; run++) {
+    if (run) {
+      host_uart_send(UART1, "U", 1);
+    }
+    double start = now_s();
+    run_update(body, size, frame_size);
+    double elapsed = now_s() - start;
+    total += elapsed;
+    if (run == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+
+  uint32_t frames = (size + frame_size - 1) / frame_size + 1;
+  printf("%d updates of %u bytes in %u frames of %u bytes\n", runs, size, frames, frame_size);
+  printf("mean %.3f ms, best %.3f ms, %.1f KB/s, %.0f frames/s\n", 1000 * total / runs, 1000 * best,
+         size * runs / total / 1024, frames * runs / total);
+  return 0;
+}
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+
+/*
+ * Runs the bootloader natively, with its three UARTs on pseudo-terminals, so
+ * tools/fw_update.py and the other tools can drive it like a board:
+ *
+ *   ./bl_host --flash flash.bin
+ *   python fw_update.py --reset-port /dev/pts/4 --port /dev/pts/5 ...
+ *
+ * A 0x20 on UART0 resets the device, as on the board. Whatever the device
+ * sends while no one has a terminal open is dropped, like on a UART with
+ * nothing connected.
+ */
+
+// Library Imports
+#include "uart.h"
+
+// Application Imports
+#include "hal_host.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+#define RESET_BYTE 0x20
+
+
+typedef struct {
+  uint32_t uart;
+  const char *name;
+  int master;
+  int slave;  // kept open, so the master does not see a hangup between users
+} link_t;
+
+static link_t links[] = {
+  {UART0, "UART0 (reset)", -1, -1},
+  {UART1, "UART1 (host) ", -1, -1},
+  {UART2, "UART2 (debug)", -1, -1},
+};
+#define LINK_COUNT (sizeof(links) / sizeof(links[0]))
+
+
+static int open_pty(link_t *link) {
+  struct termios tio;
+
+  link->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (link->master < 0 || grantpt(link->master) || unlockpt(link->master)) {
+    return -1;
+  }
+  link->slave = open(ptsname(link->master), O_RDWR | O_NOCTTY);
+  if (link->slave < 0 || tcgetattr(link->slave, &tio)) {
+    return -1;
+  }
+  cfmakeraw(&tio);
+  return tcsetattr(link->slave, TCSANOW, &tio);
+}
+
+
+/*
+ * Pass what the tools write to the device. UART0 only takes the reset byte.
+ */
+static void *to_device(void *arg) {
+  link_t *link = arg;
+  unsigned char buf[256];
+
+  while (1) {
+    struct pollfd pfd = {link->master, POLLIN, 0};
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+    ssize_t n = read(link->master, buf, sizeof(buf));
+    for (ssize_t i = 0; i < n; i++) {
+      if (link->uart == UART0 && buf[i] == RESET_BYTE) {
+        host_request_reset();
+      }
+    }
+    if (n > 0 && link->uart != UART0) {
+      host_uart_send(link->uart, buf, n);
+    }
+  }
+  return NULL;
+}
+
+
+static void *from_device(void *arg) {
+  link_t *link = arg;
+  unsigned char buf[256];
+
+  while (1) {
+    size_t n = host_uart_recv(link->uart, buf, sizeof(buf), 100);
+    if (n && write(link->master, buf, n) < 0) {
+      // Nobody listening and the terminal's buffer is full; drop it.
+    }
+  }
+  return NULL;
+}
+
+
+static void *device(void *arg) {
+  (void) arg;
+  setjmp(host_reset);
+  bootloader_main();
+  return NULL;
+}
+
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [--flash FILE] [--erase-us N] [--program-us N]\n", name);
+  exit(2);
+}
+
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+    {"flash", required_argument, NULL, 'f'},
+    {"erase-us", required_argument, NULL, 'e'},
+    {"program-us", required_argument, NULL, 'p'},
+    {NULL, 0, NULL, 0},
+  };
+  host_config_t config = {"flash.bin", 0, 0};
+  pthread_t thread;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 'f': config.flash_path = optarg; break;
+    case 'e': config.erase_us = strtoul(optarg, NULL, 0); break;
+    case 'p': config.program_us = strtoul(optarg, NULL, 0); break;
+    default: usage(argv[0]);
+    }
+  }
+
+  if (host_init(&config)) {
+    perror(config.flash_path);
+    return 1;
+  }
+
+  for (unsigned int i = 0; i < LINK_COUNT; i++) {
+    if (open_pty(&links[i])) {
+      perror("pseudo-terminal");
+      return 1;
+    }
+    printf("%s %s\n", links[i].name, ptsname(links[i].master));
+    pthread_create(&thread, NULL, to_device, &links[i]);
+    pthread_create(&thread, NULL, from_device, &links[i]);
+  }
+  fflush(stdout);
+
+  pthread_create(&thread, NULL, device, NULL);
+  pthread_join(thread, NULL);
+  return 0;
+}
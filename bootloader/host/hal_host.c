@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+
+// Hardware Imports
+#include "inc/hw_types.h" // Boolean type
+
+// Driver API Imports
+#include "driverlib/flash.h" // FLASH API
+#include "driverlib/sysctl.h" // System control API (clock/reset)
+#include "driverlib/interrupt.h" // Interrupt API
+#include "driverlib/systick.h" // SysTick API
+#include "driverlib/timer.h" // General purpose timer API
+#include "driverlib/uart.h" // UART status API
+
+// Library Imports
+#include "uart.h"
+
+// Application Imports
+#include "hal.h"
+#include "hal_host.h"
+#include "mem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// Simulation Constants
+#define HOST_UARTS 3
+#define PIPE_SIZE 65536  // per UART and direction; a full pipe blocks the writer
+#define FLASH_SIZE 0x40000
+#define FLASH_PAGESIZE 1024
+#define FLASH_WRITESIZE 4
+#define CLOCK_HZ 50000000  // what SysCtlClockGet() reports and the boot timer counts
+
+
+typedef struct {
+  unsigned char buf[PIPE_SIZE];
+  size_t head;  // next byte to read
+  size_t len;
+} pipe_t;
+
+// rx: host to device, tx: device to host. All guarded by lock; changed is
+// signalled whenever a pipe gets data or room, or a reset is requested.
+static pipe_t rx[HOST_UARTS];
+static pipe_t tx[HOST_UARTS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+static uint8_t *flash;
+static host_config_t config;
+static struct timespec start;
+static volatile int tick_pending = 0;
+static volatile unsigned long reset_pending = 0;  // cause of the reset to take, 0 for none
+static unsigned long reset_cause = SYSCTL_CAUSE_POR;
+
+jmp_buf host_reset;
+
+void SysTick_IRQHandler(void);
+
+
+static int uart_index(uint32_t uart) {
+  return (uart - UART0) >> 12;
+}
+
+
+static uint64_t elapsed_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) (now.tv_sec - start.tv_sec) * 1000000000 + now.tv_nsec - start.tv_nsec;
+}
+
+
+static void sleep_us(uint64_t us) {
+  struct timespec t = {us / 1000000, (us % 1000000) * 1000};
+
+  while (nanosleep(&t, &t) && errno == EINTR) {
+  }
+}
+
+
+/*
+ * Wait on changed for up to timeout_ms, with lock held.
+ */
+static void wait_changed(int timeout_ms) {
+  struct timespec until;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += (long) timeout_ms * 1000000;
+  until.tv_sec += until.tv_nsec / 1000000000;
+  until.tv_nsec %= 1000000000;
+  pthread_cond_timedwait(&changed, &lock, &until);
+}
+
+
+static void pipe_put(pipe_t *p, unsigned char byte) {
+  p->buf[(p->head + p->len++) % PIPE_SIZE] = byte;
+}
+
+
+static unsigned char pipe_get(pipe_t *p) {
+  unsigned char byte = p->buf[p->head];
+
+  p->head = (p->head + 1) % PIPE_SIZE;
+  p->len--;
+  return byte;
+}
+
+
+/*
+ * Take a requested reset, from the device thread only. A power-on reset
+ * replaces the causes recorded so far, like on the board.
+ */
+static void check_reset(void) {
+  if (reset_pending) {
+    if (reset_pending == SYSCTL_CAUSE_POR) {
+      reset_cause = SYSCTL_CAUSE_POR;
+    } else {
+      reset_cause |= reset_pending;
+    }
+    reset_pending = 0;
+    longjmp(host_reset, 1);
+  }
+}
+
+
+/*
+ * 1ms SysTick: sets the flag hal_tick() reads and clears, like the COUNT bit
+ * of NVIC_ST_CTRL, and runs the interrupt handler.
+ */
+static void *systick_thread(void *arg) {
+  uint64_t next = elapsed_ns();
+
+  (void) arg;
+  while (1) {
+    next += 1000000;
+    uint64_t now = elapsed_ns();
+    if (next > now) {
+      sleep_us((next - now) / 1000);
+    }
+    tick_pending = 1;
+    SysTick_IRQHandler();
+
+    // Wake the device thread from idle_until_rx(), like the interrupt does.
+    pthread_mutex_lock(&lock);
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+
+int host_init(const host_config_t *cfg) {
+  pthread_t systick;
+  struct stat st;
+
+  config = *cfg;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int fd = open(config.flash_path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || fstat(fd, &st)) {
+    return -1;
+  }
+  // Fresh flash reads as erased.
+  unsigned char erased[FLASH_PAGESIZE];
+  memset(erased, 0xFF, sizeof(erased));
+  for (off_t offset = st.st_size; offset < FLASH_SIZE; ) {
+    size_t n = FLASH_PAGESIZE - offset % FLASH_PAGESIZE;
+    if (pwrite(fd, erased, n, offset) < 0) {
+      close(fd);
+      return -1;
+    }
+    offset += n;
+  }
+  flash = mmap(NULL, FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (flash == MAP_FAILED) {
+    return -1;
+  }
+
+  errno = pthread_create(&systick, NULL, systick_thread, NULL);
+  return errno ? -1 : 0;
+}
+
+
+void host_uart_send(uint32_t uart, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  pipe_t *p = &rx[uart_index(uart)];
+
+  pthread_mutex_lock(&lock);
+  while (len) {
+    if (p->len == PIPE_SIZE) {
+      wait_changed(1);
+      continue;
+    }
+    pipe_put(p, *bytes++);
+    len--;
+  }
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+
+size_t host_uart_recv(uint32_t uart, void *data, size_t len, int timeout_ms) {
+  unsigned char *bytes = data;
+  pipe_t *p = &tx[uart_index(uart)];
+  uint64_t deadline = elapsed_ns() + (uint64_t) timeout_ms * 1000000;
+  size_t count = 0;
+
+  pthread_mutex_lock(&lock);
+  while (p->len == 0 && elapsed_ns() < deadline) {
+    wait_changed(1);
+  }
+  while (p->len && count < len) {
+    bytes[count++] = pipe_get(p);
+  }
+  if (count) {
+    pthread_cond_broadcast(&changed);
+  }
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+
+static void request_reset(unsigned long cause) {
+  pthread_mutex_lock(&lock);
+  reset_pending = cause;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+
+void host_request_reset(void) {
+  request_reset(SYSCTL_CAUSE_SW);
+}
+
+
+void host_power_cycle(void) {
+  request_reset(SYSCTL_CAUSE_POR);
+}
+
+
+/*
+ * HAL, see hal.h
+ */
+uint8_t *hal_flash(uint32_t addr) {
+  return flash + addr;
+}
+
+
+int hal_rx_empty(uint32_t uart) {
+  check_reset();
+  pthread_mutex_lock(&lock);
+  int empty = rx[uart_index(uart)].len == 0;
+  pthread_mutex_unlock(&lock);
+  return empty;
+}
+
+
+uint32_t hal_rx_byte(uint32_t uart) {
+  uint32_t byte = 0;
+
+  pthread_mutex_lock(&lock);
+  if (rx[uart_index(uart)].len) {
+    byte = pipe_get(&rx[uart_index(uart)]);
+    pthread_cond_broadcast(&changed);
+  }
+  pthread_mutex_unlock(&lock);
+  return byte;
+}
+
+
+int hal_rx_overrun(uint32_t uart) {
+  (void) uart;
+  return 0;  // a full pipe holds up the sender instead
+}
+
+
+int hal_tick(void) {
+  return __atomic_exchange_n(&tick_pending, 0, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * There is no firmware to run; wait for a reset instead.
+ */
+void hal_boot_firmware(void) {
+  pthread_mutex_lock(&lock);
+  while (!reset_pending) {
+    wait_changed(1000);
+  }
+  pthread_mutex_unlock(&lock);
+  check_reset();
+}
+
+
+/*
+ * Block until uart has received something or the next SysTick.
+ */
+void idle_until_rx(uint32_t uart) {
+  check_reset();
+  pthread_mutex_lock(&lock);
+  if (rx[uart_index(uart)].len == 0 && !reset_pending) {
+    wait_changed(1);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * UART library
+ */
+void uart_init(uint32_t uart) {
+  (void) uart;
+}
+
+
+uint32_t uart_read(uint32_t uart, int blocking, int *read) {
+  while (hal_rx_empty(uart)) {
+    if (!blocking) {
+      *read = 0;
+      return 0;
+    }
+    idle_until_rx(uart);
+  }
+  *read = 1;
+  return hal_rx_byte(uart);
+}
+
+
+void uart_write(uint32_t uart, uint32_t data) {
+  pipe_t *p = &tx[uart_index(uart)];
+
+  pthread_mutex_lock(&lock);
+  while (p->len == PIPE_SIZE) {
+    wait_changed(1);
+  }
+  pipe_put(p, data);
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+
+void uart_write_str(uint32_t uart, char *str) {
+  while (*str) {
+    uart_write(uart, (unsigned char) *str++);
+  }
+}
+
+
+void nl(uint32_t uart) {
+  uart_write(uart, '\n');
+}
+
+
+void uart_write_hex(uint32_t uart, uint32_t data) {
+  char text[11];
+
+  snprintf(text, sizeof(text), "0x%08x", data);
+  uart_write_str(uart, text);
+}
+
+
+/*
+ * Driverlib
+ */
+long FlashErase(unsigned long address) {
+  if (address % FLASH_PAGESIZE || address >= FLASH_SIZE) {
+    return -1;
+  }
+  sleep_us(config.erase_us);
+  memset(flash + address, 0xFF, FLASH_PAGESIZE);
+  return 0;
+}
+
+
+long FlashProgram(unsigned long *data, unsigned long address, unsigned long count) {
+  const unsigned char *bytes = (const unsigned char *) data;
+
+  if (address % FLASH_WRITESIZE || count % FLASH_WRITESIZE || address + count > FLASH_SIZE) {
+    return -1;
+  }
+  sleep_us((uint64_t) config.program_us * (count / FLASH_WRITESIZE));
+  for (unsigned long i = 0; i < count; i++) {
+    flash[address + i] &= bytes[i];
+  }
+  return 0;
+}
+
+
+void SysCtlReset(void) {
+  reset_cause |= SYSCTL_CAUSE_SW;
+  longjmp(host_reset, 1);
+}
+
+
+unsigned long SysCtlResetCauseGet(void) {
+  return reset_cause;
+}
+
+
+void SysCtlResetCauseClear(unsigned long cause) {
+  reset_cause &= ~cause;
+}
+
+
+unsigned long SysCtlClockGet(void) {
+  return CLOCK_HZ;
+}
+
+
+void SysCtlPeripheralEnable(unsigned long peripheral) {
+  (void) peripheral;
+}
+
+
+void IntEnable(unsigned long interrupt) {
+  (void) interrupt;
+}
+
+
+void IntDisable(unsigned long interrupt) {
+  (void) interrupt;
+}
+
+
+tBoolean IntMasterEnable(void) {
+  return 0;
+}
+
+
+void SysTickPeriodSet(unsigned long period) {
+  (void) period;
+}
+
+
+void SysTickEnable(void) {
+}
+
+
+void SysTickIntEnable(void) {
+}
+
+
+void SysTickIntDisable(void) {
+}
+
+
+void TimerConfigure(unsigned long base, unsigned long config) {
+  (void) base;
+  (void) config;
+}
+
+
+void TimerLoadSet(unsigned long base, unsigned long timer, unsigned long value) {
+  (void) base;
+  (void) timer;
+  (void) value;
+}
+
+
+void TimerEnable(unsigned long base, unsigned long timer) {
+  (void) base;
+  (void) timer;
+}
+
+
+// The boot timer counts down from 0xFFFFFFFF at CLOCK_HZ.
+unsigned long TimerValueGet(unsigned long base, unsigned long timer) {
+  (void) base;
+  (void) timer;
+  return (uint32_t) (0xFFFFFFFF - elapsed_ns() * (CLOCK_HZ / 1000000) / 1000);
+}
+
+
+tBoolean UARTCharsAvail(unsigned long base) {
+  return !hal_rx_empty(base);
+}
+
+
+tBoolean UARTBusy(unsigned long base) {
+  (void) base;
+  return 0;  // bytes are in the pipe as soon as they are written
+}
+
+
+/*
+ * There is no linker script to take section sizes from.
+ */
+void mem_report(uint32_t uart) {
+  uart_write_str(uart, "No memory report in the host build\n");
+}
@@ -0,0 +1,53 @@
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Simulated UARTs and flash for the host build of the bootloader.
+ *
+ * The bootloader runs in a thread of its own (the device thread) and talks
+ * to the rest of the process through one pipe per UART and direction. Flash
+ * is a 256KB file mapped into memory, so its contents survive between runs
+ * the way they do on the board. Erasing and programming behave like NOR
+ * flash: an erase sets a page to 0xFF, programming can only clear bits.
+ *
+ * SysTick is a thread that calls SysTick_IRQHandler() every millisecond, so
+ * timeouts take as long as on the board; everything else runs as fast as
+ * the host can go, apart from the configured flash latencies.
+ */
+
+typedef struct {
+  const char *flash_path;  // created and filled with 0xFF if missing
+  uint32_t erase_us;       // time taken by each page erase
+  uint32_t program_us;     // time taken by each word programmed
+} host_config_t;
+
+// Map the flash file and start SysTick. Returns 0, or -1 with errno set.
+int host_init(const host_config_t *config);
+
+// Queue len bytes for the device to receive on uart.
+void host_uart_send(uint32_t uart, const void *data, size_t len);
+
+// Take up to len bytes the device sent on uart, waiting up to timeout_ms
+// for the first one. Returns the number of bytes taken.
+size_t host_uart_recv(uint32_t uart, void *data, size_t len, int timeout_ms);
+
+// Make the device thread reset at its next UART access, like a reset byte on
+// UART0 does on the board.
+void host_request_reset(void);
+
+// Same, but the device comes back as from a power cut: a power-on reset,
+// which autoboots. Flash keeps whatever was programmed up to that point.
+void host_power_cycle(void);
+
+// SysCtlReset() and requested resets longjmp() here, with 1, in the device
+// thread, which has to setjmp() it before calling bootloader_main().
+extern jmp_buf host_reset;
+
+// The bootloader's main(), renamed by host/Makefile.
+int bootloader_main(void);
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * Cuts the power halfway through an update and checks that the bootloader
+ * does not autoboot the half-written image when it comes back:
+ *
+ *   ./power_fail_test
+ *
+ * On fresh flash the initial firmware is installed and autobooted, which
+ * shows the test can see an autoboot. After the interrupted update the
+ * device has to wait for the host instead. A complete update afterwards
+ * makes the image autoboot again.
+ */
+
+// Library Imports
+#include "uart.h"
+
+// Application Imports
+#include "hal_host.h"
+#include "crc32.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define OK 0x00
+#define REPLY_TIMEOUT_MS 2000
+#define AUTOBOOT_WAIT_MS 500  // well past the autoboot window
+#define FRAME_HEADER_LEN 4
+#define FRAME_CRC_LEN 4
+#define FRAME_SIZE 256
+#define IMAGE_SIZE 8192
+#define AUTOBOOT_TEXT "No update requested, booting."
+
+// Everything the device wrote on UART2 since the last clear_debug().
+static char debug[65536];
+static size_t debug_len;
+static pthread_mutex_t debug_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void *collect_debug(void *arg) {
+  char buf[256];
+
+  (void) arg;
+  while (1) {
+    size_t n = host_uart_recv(UART2, buf, sizeof(buf), 100);
+    pthread_mutex_lock(&debug_lock);
+    if (n > sizeof(debug) - 1 - debug_len) {
+      n = sizeof(debug) - 1 - debug_len;
+    }
+    memcpy(debug + debug_len, buf, n);
+    debug_len += n;
+    debug[debug_len] = '\0';
+    pthread_mutex_unlock(&debug_lock);
+  }
+  return NULL;
+}
+
+
+static void clear_debug(void) {
+  pthread_mutex_lock(&debug_lock);
+  debug_len = 0;
+  debug[0] = '\0';
+  pthread_mutex_unlock(&debug_lock);
+}
+
+
+/*
+ * Whether the device autobooted within timeout_ms.
+ */
+static int autobooted(int timeout_ms) {
+  for (int waited = 0; waited < timeout_ms; waited += 10) {
+    pthread_mutex_lock(&debug_lock);
+    int seen = strstr(debug, AUTOBOOT_TEXT) != NULL;
+    pthread_mutex_unlock(&debug_lock);
+    if (seen) {
+      return 1;
+    }
+    usleep(10000);
+  }
+  return 0;
+}
+
+
+static void fail(const char *why) {
+  fprintf(stderr, "FAIL: %s\n", why);
+  exit(1);
+}
+
+
+static void expect_echo(char command) {
+  unsigned char echo = 0;
+
+  while (echo != command) {
+    if (host_uart_recv(UART1, &echo, 1, REPLY_TIMEOUT_MS) != 1) {
+      fail("no answer to a command");
+    }
+  }
+}
+
+
+static void expect_ok(void) {
+  unsigned char reply;
+
+  if (host_uart_recv(UART1, &reply, 1, REPLY_TIMEOUT_MS) != 1 || reply != OK) {
+    fail("no OK for the metadata or a frame");
+  }
+}
+
+
+static void put_crc(unsigned char *dst, const unsigned char *buf, unsigned int len) {
+  uint32_t crc = crc32_update(0, buf, len);
+
+  dst[0] = crc >> 24;
+  dst[1] = crc >> 16;
+  dst[2] = crc >> 8;
+  dst[3] = crc;
+}
+
+
+static void send_frame(uint16_t seq, const unsigned char *data, uint32_t len) {
+  unsigned char frame[FRAME_HEADER_LEN + FRAME_SIZE + FRAME_CRC_LEN];
+
+  frame[0] = len >> 8;
+  frame[1] = len;
+  frame[2] = seq >> 8;
+  frame[3] = seq;
+  memcpy(frame + FRAME_HEADER_LEN, data, len);
+  put_crc(frame + FRAME_HEADER_LEN + len, frame, FRAME_HEADER_LEN + len);
+  host_uart_send(UART1, frame, FRAME_HEADER_LEN + len + FRAME_CRC_LEN);
+  expect_ok();
+}
+
+
+/*
+ * Send a plain version 0 update of IMAGE_SIZE bytes, stopping after
+ * send_len bytes of it. The terminator only goes out for the whole image.
+ */
+static void update(const unsigned char *image, uint32_t send_len) {
+  unsigned char metadata[8 + FRAME_CRC_LEN] = {0, 0, IMAGE_SIZE & 0xFF, IMAGE_SIZE >> 8, 0, 0, 0, 0};
+  uint16_t seq = 0;
+
+  host_uart_send(UART1, "U", 1);
+  expect_echo('U');
+  put_crc(metadata + 8, metadata, 8);
+  host_uart_send(UART1, metadata, sizeof(metadata));
+  expect_ok();
+
+  for (uint32_t offset = 0; offset < send_len; offset += FRAME_SIZE) {
+    send_frame(seq++, image + offset, FRAME_SIZE);
+  }
+  if (send_len == IMAGE_SIZE) {
+    send_frame(seq, NULL, 0);
+  }
+}
+
+
+static void *device(void *arg) {
+  (void) arg;
+  setjmp(host_reset);
+  bootloader_main();
+  return NULL;
+}
+
+
+int main(void) {
+  host_config_t config = {"power-fail-test-flash.bin", 0, 0};
+  unsigned char image[IMAGE_SIZE];
+  pthread_t thread;
+
+  unlink(config.flash_path);
+  if (host_init(&config)) {
+    perror(config.flash_path);
+    return 1;
+  }
+  srand(1);
+  for (int i = 0; i < IMAGE_SIZE; i++) {
+    image[i] = rand();
+  }
+  pthread_create(&thread, NULL, collect_debug, NULL);
+  pthread_create(&thread, NULL, device, NULL);
+
+  if (!autobooted(REPLY_TIMEOUT_MS)) {
+    fail("the initial firmware was not autobooted");
+  }
+
+  // A software reset never autoboots, so the update is not raced.
+  host_request_reset();
+  update(image, IMAGE_SIZE / 2);
+  clear_debug();
+  host_power_cycle();
+
+  if (autobooted(AUTOBOOT_WAIT_MS)) {
+    fail("autobooted the half-written image after a power cut");
+  }
+  host_uart_send(UART1, "Q", 1);
+  expect_echo('Q');
+  while (host_uart_recv(UART1, image, 1, 100)) {
+    // Skip the install info.
+  }
+  printf("Interrupted update: waits for the host\n");
+
+  update(image, IMAGE_SIZE);
+  clear_debug();
+  host_power_cycle();
+
+  if (!autobooted(REPLY_TIMEOUT_MS)) {
+    fail("the committed update was not autobooted");
+  }
+  printf("Committed update: autoboots\n");
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Boots the bootloader over and over on fresh flash and checks that booting
+ * alone does not wear the erase count log:
+ *
+ *   ./wear_test --boots 50
+ *
+ * Each boot adds to boot_count, so the counters log erases one of its pages
+ * every 15 boots and the erase count log then takes a record for it. Nothing
+ * else a boot does should make the erase count log append, let alone erase.
+ */
+
+// Library Imports
+#include "uart.h"
+
+// Application Imports
+#include "hal_host.h"
+#include "telemetry.h"
+#include "crc32.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define REPLY_TIMEOUT_MS 2000
+#define FLASH_PAGESIZE 1024
+#define COUNTERS_PAGES {0x3F400 / FLASH_PAGESIZE, 0x3F000 / FLASH_PAGESIZE}
+#define WEAR_PAGES {0x3EC00 / FLASH_PAGESIZE, 0x3E800 / FLASH_PAGESIZE}
+
+// Telemetry dump, see telemetry_dump().
+typedef struct {
+  uint16_t version;
+  uint16_t pages;
+  telemetry_counters_t counters;
+  uint16_t erase_counts[TELEMETRY_PAGES];
+} dump_t;
+
+
+static void expect_echo(char command) {
+  unsigned char echo = 0;
+
+  while (echo != command) {
+    if (host_uart_recv(UART1, &echo, 1, REPLY_TIMEOUT_MS) != 1) {
+      fprintf(stderr, "No answer to '%c'\n", command);
+      exit(1);
+    }
+  }
+}
+
+
+static void recv_all(void *buf, size_t len) {
+  unsigned char *bytes = buf;
+
+  while (len) {
+    size_t n = host_uart_recv(UART1, bytes, len, REPLY_TIMEOUT_MS);
+    if (n == 0) {
+      fprintf(stderr, "Telemetry dump cut short\n");
+      exit(1);
+    }
+    bytes += n;
+    len -= n;
+  }
+}
+
+
+static void read_telemetry(dump_t *dump) {
+  unsigned char crc_bytes[4];
+
+  host_uart_send(UART1, "T", 1);
+  expect_echo('T');
+  recv_all(dump, sizeof(*dump));
+  recv_all(crc_bytes, sizeof(crc_bytes));
+
+  uint32_t crc = (uint32_t) crc_bytes[0] << 24 | crc_bytes[1] << 16 | crc_bytes[2] << 8 | crc_bytes[3];
+  if (crc != crc32_update(0, (const unsigned char *) dump, sizeof(*dump)) || dump->pages != TELEMETRY_PAGES) {
+    fprintf(stderr, "Bad telemetry dump\n");
+    exit(1);
+  }
+}
+
+
+/*
+ * Run the firmware once the 'B' the caller queued is answered, and reset.
+ * The reset is only taken once the device waits in hal_boot_firmware(),
+ * after boot_firmware() has flushed telemetry.
+ */
+static void boot(void) {
+  expect_echo('B');
+  host_request_reset();
+}
+
+
+static uint32_t erases(const dump_t *dump, const int pages[2]) {
+  return dump->erase_counts[pages[0]] + dump->erase_counts[pages[1]];
+}
+
+
+static void *drain_debug(void *arg) {
+  char buf[256];
+
+  (void) arg;
+  while (1) {
+    host_uart_recv(UART2, buf, sizeof(buf), 100);
+  }
+  return NULL;
+}
+
+
+static void *device(void *arg) {
+  (void) arg;
+  setjmp(host_reset);
+  bootloader_main();
+  return NULL;
+}
+
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+    {"boots", required_argument, NULL, 'b'},
+    {NULL, 0, NULL, 0},
+  };
+  static const int counters_pages[2] = COUNTERS_PAGES;
+  static const int wear_pages[2] = WEAR_PAGES;
+  host_config_t config = {"wear-test-flash.bin", 0, 0};
+  dump_t before, after;
+  int boots = 50;
+  pthread_t thread;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 'b': boots = atoi(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [--boots N]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  unlink(config.flash_path);
+  if (host_init(&config)) {
+    perror(config.flash_path);
+    return 1;
+  }
+  // Queued before the device starts, so it never autoboots.
+  host_uart_send(UART1, "B", 1);
+  pthread_create(&thread, NULL, drain_debug, NULL);
+  pthread_create(&thread, NULL, device, NULL);
+
+  // The first boot installs the initial firmware, erasing its pages.
+  boot();
+  read_telemetry(&before);
+  for (int i = 0; i < boots; i++) {
+    host_uart_send(UART1, "B", 1);
+    boot();
+  }
+  read_telemetry(&after);
+
+  uint32_t counters_erased = erases(&after, counters_pages) - erases(&before, counters_pages);
+  uint32_t wear_erased = erases(&after, wear_pages) - erases(&before, wear_pages);
+  printf("%d boots: counters log erased %u pages, erase count log %u\n", boots, counters_erased,
+         wear_erased);
+
+  if (after.counters.boot_count - before.counters.boot_count != (uint32_t) boots) {
+    fprintf(stderr, "FAIL: boot_count went up by %u\n",
+            after.counters.boot_count - before.counters.boot_count);
+    return 1;
+  }
+  // Each counters log erase is worth one record, and a page takes two.
+  if (wear_erased > (counters_erased + 1) / 2) {
+    fprintf(stderr, "FAIL: the erase count log wears with every boot\n");
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}
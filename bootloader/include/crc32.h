@@ -0,0 +1,17 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+
+#include "ramfunc.h"
+
+/*
+ * CRC-32 (IEEE 802.3, reflected, polynomial 0xEDB88320), the same checksum as
+ * Python's zlib.crc32(). Start with crc = 0 and feed the previous result back
+ * in to checksum data that arrives in pieces.
+ *
+ * Runs from SRAM, as it checks every frame. The tables stay in flash.
+ */
+RAMFUNC uint32_t crc32_update(uint32_t crc, const unsigned char *buf, unsigned int len);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef FLASHLOG_H
+#define FLASHLOG_H
+
+#include <stdint.h>
+
+/*
+ * An append-only log of fixed-size records spread over two flash pages.
+ *
+ * Each record is payload_words of data followed by a commit word that holds a
+ * sequence number. The payload is programmed first and the commit word last,
+ * so a record either reads back complete or is ignored. The newest committed
+ * record wins. A page is only erased when the other one fills up, and then
+ * only after it holds nothing newer than the page being kept.
+ */
+typedef struct {
+  uint32_t pages[2];        // Base addresses of the two flash pages.
+  uint32_t payload_words;   // Record payload size in 32-bit words.
+} flashlog_t;
+
+#define FLASHLOG_MAX_PAYLOAD_WORDS 128
+
+int flashlog_read_latest(const flashlog_t *log, uint32_t *payload);
+long flashlog_append(const flashlog_t *log, const uint32_t *payload);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+
+/*
+ * The hardware accesses the bootloader makes itself instead of through a
+ * library call: reading the UARTs and the SysTick flag, reading flash, and
+ * jumping to the firmware.
+ *
+ * On the board these are the register accesses and pointers they always
+ * were. Built with HOST (host/Makefile), they go to the simulated UARTs and
+ * flash in host/hal_host.c instead, which also stands in for the driverlib
+ * and UART library calls.
+ */
+
+#ifdef HOST
+
+uint8_t *hal_flash(uint32_t addr);
+int hal_rx_empty(uint32_t uart);
+uint32_t hal_rx_byte(uint32_t uart);
+int hal_rx_overrun(uint32_t uart);
+int hal_tick(void);
+void hal_boot_firmware(void);
+
+#else
+
+#include "inc/hw_types.h" // HWREG
+#include "inc/hw_uart.h" // UART registers
+#include "inc/lm3s6965.h" // SysTick registers
+
+// Pointer to the byte of flash at addr.
+#define hal_flash(addr) ((uint8_t *) (addr))
+
+// Nothing in uart's receive FIFO.
+#define hal_rx_empty(uart) (HWREG((uart) + UART_O_FR) & UART_FR_RXFE)
+
+// Pop the next byte off uart's receive FIFO.
+#define hal_rx_byte(uart) (HWREG((uart) + UART_O_DR) & UART_DR_DATA_M)
+
+// A millisecond SysTick wrap since the last call. Reading clears the flag.
+#define hal_tick() (NVIC_ST_CTRL & NVIC_ST_CTRL_COUNT)
+
+// Whether uart dropped bytes to an overrun, clearing the error.
+static inline int hal_rx_overrun(uint32_t uart) {
+  if (HWREG(uart + UART_O_RSR) & UART_RSR_OE) {
+    HWREG(uart + UART_O_ECR) = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// Jump to the firmware's reset code, in Thumb state.
+#define hal_boot_firmware() __asm("LDR R0,=0x10001\n\t" "BX R0\n\t")
+
+#endif
+
+#endif
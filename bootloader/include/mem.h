@@ -0,0 +1,12 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stdint.h>
+
+// Pattern ResetISR() fills the stack with; keep in sync with startup_gcc.c.
+#define MEM_STACK_PAINT 0xC5C5C5C5
+
+uint32_t stack_high_water(void);
+void mem_report(uint32_t uart);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+
+/*
+ * Merkle tree over the firmware's 1KB chunks, built by tools/merkle.py.
+ *
+ * Leaves are SHA-256(0x00 || index (2, big-endian) || chunk) and inner nodes
+ * SHA-256(0x01 || left || right). A level with an odd number of nodes passes
+ * its last node up unchanged, so the proof for a chunk holds one sibling hash
+ * per level where the chunk's ancestor has a sibling.
+ */
+#define MERKLE_HASH_LEN 32
+#define MERKLE_MAX_DEPTH 8  // enough for 256 chunks
+
+unsigned int merkle_proof_len(uint32_t index, uint32_t count);
+int merkle_verify(const unsigned char *root, uint32_t index, uint32_t count,
+                  const unsigned char *chunk, uint32_t chunk_len,
+                  const unsigned char *proof);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#include "ramfunc.h"
+
+/*
+ * Statistical profiler, compiled in with `make PROFILE=1`.
+ *
+ * TIMER1 interrupts at a fixed rate and records the PC and LR of the code it
+ * interrupted; tools/fw_profile.py symbolizes the dump. The rate is prime so it
+ * does not lock onto anything paced by the 1ms SysTick.
+ */
+#define PROFILE_HZ 997
+#define PROFILE_MAX_SAMPLES 256
+
+void profile_start(uint32_t hz);
+void profile_stop(void);
+void profile_dump(uint32_t uart);
+RAMFUNC void profile_timer_isr(void);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef RAMFUNC_H
+#define RAMFUNC_H
+
+// Place a function in the .ramfunc section, which ResetISR() copies to SRAM.
+// Code there keeps executing while FlashErase()/FlashProgram() stall
+// instruction fetch from flash, as long as it does not call back into flash.
+// SRAM is too far away for a plain BL, hence long_call.
+#ifdef HOST
+#define RAMFUNC  // everything runs from RAM on the host, see host/hal_host.h
+#else
+#define RAMFUNC __attribute__((section(".ramfunc"), long_call, noinline))
+#endif
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef REED_SOLOMON_H
+#define REED_SOLOMON_H
+
+#include <stdint.h>
+
+/*
+ * Reed-Solomon decoder over GF(256) (primitive polynomial 0x11D, generator
+ * roots alpha^0 .. alpha^(nparity-1)), matching the encoder in fw_update.py.
+ *
+ * A block is a shortened systematic codeword: the message followed by
+ * nparity parity bytes, at most 255 bytes in all. Up to nparity / 2 corrupted
+ * bytes are corrected in place.
+ */
+#define RS_MAX_BLOCK 255
+#define RS_MAX_PARITY 32
+
+int rs_decode(uint8_t *block, unsigned int len, unsigned int nparity);
+
+#endif
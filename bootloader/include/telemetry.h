@@ -0,0 +1,39 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+/*
+ * Lifetime counters for the update and boot paths, kept in SRAM and flushed
+ * to two flash logs: the counters below, and one 16-bit erase count per
+ * flash page for tracking wear.
+ *
+ * Increment the counters directly; telemetry_flush() writes back whatever
+ * changed. Erase counts saturate at 0xFFFF, past the rated endurance.
+ */
+typedef struct {
+  uint32_t boot_count;
+  uint32_t updates_started;
+  uint32_t updates_committed;
+  uint32_t frames;            // accepted, retransmissions not included
+  uint32_t bytes;             // body bytes in accepted frames
+  uint32_t crc_failures;
+  uint32_t retransmits;
+  uint32_t overruns;          // UART1 receive FIFO overruns during updates
+  uint32_t fec_corrected;
+  uint32_t last_update_ms;
+  uint32_t total_update_ms;
+  uint32_t max_update_ms;
+  uint32_t reserved[4];
+} telemetry_counters_t;
+
+#define TELEMETRY_PAGES 256  // 1KB pages in the LM3S6965's flash
+
+extern telemetry_counters_t telemetry;
+
+void telemetry_load(void);
+long telemetry_erase(uint32_t page_addr);
+long telemetry_flush(void);
+void telemetry_dump(uint32_t uart);
+
+#endif
@@ -1,28 +1,92 @@
+#include <string.h>
+
 // Hardware Imports
 #include "inc/hw_memmap.h" // Peripheral Base Addresses
 #include "inc/lm3s6965.h" // Peripheral Bit Masks and Registers
 #include "inc/hw_types.h" // Boolean type
 #include "inc/hw_ints.h" // Interrupt numbers
+#include "inc/hw_uart.h" // UART registers
+#include "inc/hw_timer.h" // Timer registers
 
 // Driver API Imports
 #include "driverlib/flash.h" // FLASH API
 #include "driverlib/sysctl.h" // System control API (clock/reset)
 #include "driverlib/interrupt.h" // Interrupt API
+#include "driverlib/systick.h" // SysTick API
+#include "driverlib/timer.h" // General purpose timer API
+#include "driverlib/uart.h" // UART status API
 
 // Application Imports
 #include "uart.h"
+#include "ramfunc.h"
+#include "flashlog.h"
+#include "crc32.h"
+#include "reed_solomon.h"
+#include "merkle.h"
+#include "profile.h"
+#include "mem.h"
+#include "telemetry.h"
+#include "hal.h"
+#include "signing_key.h"  // generated by bl_build.py
+
+// Crypto Imports
+#include "bearssl.h"
 
 
 // Forward Declarations
 void load_initial_firmware(void);
 void load_firmware(void);
 void boot_firmware(void);
+void start_boot_timer(void);
+int autoboot_window_expired(void);
+int firmware_valid(void);
+void load_metadata(void);
+long save_metadata(uint16_t, uint16_t);
+void load_install_record(void);
+long save_install_record(uint32_t, uint32_t, const unsigned char*);
+void flash_digest(uint32_t, unsigned char*);
+void send_install_info(void);
 long program_flash(uint32_t, unsigned char*, unsigned int);
+RAMFUNC void idle_until_rx(uint32_t);
+void SysTick_IRQHandler(void);
+RAMFUNC void read_bytes(uint32_t, unsigned char*, unsigned int);
+RAMFUNC unsigned int read_bytes_timeout(uint32_t, unsigned char*, unsigned int);
+void drain_rx(uint32_t);
+void send_nak(uint32_t, uint16_t);
+void reject_update(void);
+void receive_packet(unsigned char*, unsigned int, uint16_t);
+int set_session_options(const unsigned char*);
+int verify_signature(void);
+int receive_plain_frame(unsigned char*, uint32_t, uint32_t*, uint16_t*);
+int receive_fec_frame(unsigned char*, uint32_t, uint32_t*, uint16_t*);
+void load_chunks(uint32_t, uint32_t);
+void load_bonded(uint32_t, uint32_t);
+int bond_poll(uint32_t, int, uint32_t*, uint16_t*);
+int sparse_feed(const unsigned char*, uint32_t);
+int sparse_flush(void);
+int sparse_finish(void);
+uint16_t first_missing_chunk(const uint32_t*, uint32_t);
+void print_transfer_stats(void);
+void reset_idle_stats(void);
+void check_overrun(uint32_t);
+void finish_update(int);
 
 
 // Firmware Constants
 #define METADATA_BASE 0xFC00  // base address of version and firmware size in Flash
+#define METADATA_ALT_BASE 0xF800  // second page of the metadata log
 #define FW_BASE 0x10000  // base address of firmware in Flash
+#define FW_MAX_CHUNKS 186  // 1KB pages from FW_BASE up to the telemetry logs, see telemetry.c
+#define FW_END (FW_BASE + FW_MAX_CHUNKS * FLASH_PAGESIZE)
+#define INSTALL_BASE 0x3FC00  // base address of the installed image's length and digest
+#define INSTALL_ALT_BASE 0x3F800  // second page of the install log
+
+
+// Boot Constants
+#ifndef AUTOBOOT_WINDOW_MS
+#define AUTOBOOT_WINDOW_MS 50  // time to wait for the host before booting, 0 waits forever
+#endif
+#define BOOT_TIMER_BASE TIMER0_BASE  // counts down from reset, read by the firmware
 
 
 // FLASH Constants
@@ -33,8 +97,65 @@ long program_flash(uint32_t, unsigned char*, unsigned int);
 // Protocol Constants
 #define OK    ((unsigned char)0x00)
 #define ERROR ((unsigned char)0x01)
+#define ERROR_CHECK ((unsigned char)0xFE)  // follows ERROR, see reject_update()
 #define UPDATE ((unsigned char)'U')
 #define BOOT ((unsigned char)'B')
+#define MEM_REPORT ((unsigned char)'M')  // prints SRAM use to UART2
+#define PROFILE_DUMP ((unsigned char)'P')  // only with PROFILE=1, see profile.h
+#define QUERY ((unsigned char)'Q')  // answered with the install info, see send_install_info()
+#define TELEMETRY ((unsigned char)'T')  // answered with the telemetry record, see telemetry_dump()
+#define NAK   ((unsigned char)0x02)  // followed by the big-endian sequence number to resend
+
+
+// Frame Constants
+// Frame: length (2, big-endian), sequence number (2, big-endian), data,
+// CRC-32 over everything before it (4, big-endian).
+// FEC frame: the same, with the data zero padded to the negotiated frame size
+// and Reed-Solomon parity over the whole frame appended.
+// Metadata: version (2), size (2), session options (4), CRC-32 (4).
+// Signature: ECDSA P-256 r and s (64), CRC-32 (4), sent after the metadata in
+// signed sessions.
+// Manifest: Merkle root (32), body length (4, big-endian), CRC-32 (4), sent
+// after the signature in Merkle sessions.
+#define FRAME_HEADER_LEN 4
+#define FRAME_CRC_LEN 4
+#define METADATA_LEN 8
+#define METADATA_SEQ 0xFFFF  // sequence number NAKed for bad metadata
+#define SIGNATURE_LEN 64
+#define SIGNATURE_SEQ 0xFFFE  // sequence number NAKed for a bad signature packet
+#define MANIFEST_LEN (MERKLE_HASH_LEN + 4)
+#define MANIFEST_SEQ 0xFFFD  // sequence number NAKed for a bad manifest packet
+// Install info: version (2), size (2), body length (4, big-endian), SHA-256 of
+// the body (32), CRC-32 (4), sent in reply to QUERY.
+#define INSTALL_INFO_LEN (4 + 4 + br_sha256_SIZE)
+// Segment: flash address (4, big-endian), length (4, big-endian), data. The
+// body of a sparse session is a run of these in ascending address order,
+// split across frames however the host likes.
+#define SEGMENT_HEADER_LEN 8
+// Bonded session: plain frames of the negotiated size (only the last data
+// frame may be shorter), striped across UART1 and UART2 and answered on the
+// link they came in on. Frame n goes to byte (n % frames per page) * size of
+// page n / frames per page, so the links can deliver a page's frames in any
+// order; the host holds back a page's frames until the one before it is
+// acknowledged in full, see load_bonded().
+#define BOND_LINKS 2
+#define BOND_MIN_FRAME 32  // a page's frames fit one word of received bits
+#define BOND_MAX_FRAME 128
+#define BOND_NO_SHORT 0xFFFFFFFF
+#define PACKET_MAX_LEN SIGNATURE_LEN
+#define FRAME_TIMEOUT_MS 100  // longest gap between two bytes of a frame
+
+
+// Session Options
+// Sent by the host with the metadata: flags, FEC parity bytes, FEC or bonded
+// frame data size, reserved. The bootloader rejects the update with ERROR if it can't
+// honour them.
+#define OPT_FEC 0x01  // frames carry Reed-Solomon parity
+#define OPT_SIGNED 0x02  // image is signed, see verify_signature()
+#define OPT_MERKLE 0x04  // chunks in any order, see load_chunks(); needs OPT_SIGNED
+#define OPT_SPARSE 0x08  // body is a list of segments, see sparse_feed()
+#define OPT_BONDED 0x10  // frames come over UART1 and UART2, see load_bonded()
+#define OPT_SUPPORTED (OPT_FEC | OPT_SIGNED | OPT_MERKLE | OPT_SPARSE | OPT_BONDED)
 
 
 // Firmware v2 is embedded in bootloader
@@ -43,12 +164,81 @@ extern int _binary_firmware_bin_size;
 
 
 // Device metadata
-uint16_t *fw_version_address = (uint16_t *) METADATA_BASE;
-uint16_t *fw_size_address = (uint16_t *) (METADATA_BASE + 2);
+// Each record is one word: version in the low half, size in the high half.
+const flashlog_t metadata_log = {{METADATA_BASE, METADATA_ALT_BASE}, 1};
+int metadata_valid = 0;
+uint16_t fw_version = 0;
+uint16_t fw_size = 0;
 uint8_t *fw_release_message_address;
 
+// Install log
+// Each record is the metadata word it belongs to, the length of the body as
+// the host sent it (firmware, release message and whatever else followed the
+// metadata) and the body's SHA-256, so a query can be answered without
+// reading the image. A zero length means the body is not known.
+//
+// An update appends a record with length INSTALL_PENDING before it programs
+// the first page, and only its commit appends one that is not. Until then
+// the image at FW_BASE may be half old and half new, so it is not autobooted.
+#define INSTALL_RECORD_WORDS (2 + br_sha256_SIZE / 4)
+#define INSTALL_PENDING 0xFFFFFFFF
+const flashlog_t install_log = {{INSTALL_BASE, INSTALL_ALT_BASE}, INSTALL_RECORD_WORDS};
+uint32_t install_record[INSTALL_RECORD_WORDS];
+int install_pending = 0;  // an update started overwriting the image and never committed
+
 // Firmware Buffer
-unsigned char data[FLASH_PAGESIZE];
+// A page, or in Merkle sessions a chunk followed by its proof.
+unsigned char data[FLASH_PAGESIZE + MERKLE_MAX_DEPTH * MERKLE_HASH_LEN];
+
+
+// Session state, negotiated with each update
+uint32_t fec_parity = 0;    // Reed-Solomon parity bytes per frame, 0 for plain frames
+uint32_t fec_data_len = 0;  // data bytes per FEC frame
+unsigned char fec_block[RS_MAX_BLOCK];
+int signed_session = 0;     // image must match the signature below
+int merkle_session = 0;     // signature covers a Merkle manifest instead of the stream
+int sparse_session = 0;     // body is a list of segments instead of the image itself
+uint32_t bond_frame_len = 0;  // data bytes per bonded frame, 0 unless bonded
+unsigned char signature[SIGNATURE_LEN];
+br_sha256_context image_hash;  // metadata and every accepted frame, in order
+
+
+// Sparse session state, see sparse_feed(). The page buffer holds sparse_page,
+// or nothing while that is 0.
+unsigned char sparse_frame[FLASH_PAGESIZE];
+unsigned char segment_header[SEGMENT_HEADER_LEN];
+uint32_t segment_header_len = 0;
+uint32_t segment_addr = FW_BASE;  // flash address of the segment's next byte
+uint32_t segment_left = 0;        // bytes of the segment still to come
+uint32_t sparse_page = 0;
+
+
+// Bonded session state, one receiver per link, see bond_poll()
+typedef struct {
+  uint32_t uart;
+  unsigned char frame[FRAME_HEADER_LEN + BOND_MAX_FRAME + FRAME_CRC_LEN];
+  uint32_t len;      // bytes of the frame so far
+  uint32_t idle_ms;  // time since the last byte
+  int discard;       // dropping the rest of a bad frame until the line goes quiet
+} bond_link_t;
+bond_link_t bond_links[BOND_LINKS];
+
+
+// Transfer statistics, reported on UART2 at the end of an update
+uint32_t crc_failures = 0;  // frames and metadata that failed the CRC check
+uint32_t retransmits = 0;   // frames the host had to send again
+uint32_t fec_corrected = 0; // bytes repaired by the Reed-Solomon decoder
+uint32_t verify_cycles = 0; // system clock cycles spent in the signature check
+
+// Boot timer cycles spent asleep in idle_until_rx() and awake in between,
+// since reset_idle_stats()
+uint64_t idle_cycles = 0;
+uint64_t busy_cycles = 0;
+uint32_t last_wake = 0;
+
+// Milliseconds since reset, counted by SysTick
+volatile uint32_t uptime_ms = 0;
+uint32_t update_start_ms = 0;
 
 
 int main(void) {
@@ -61,131 +251,608 @@ int main(void) {
   uart_init(UART1);
   uart_init(UART2);
 
-  // Enable UART0 interrupt
+  // Enable UART0 interrupt, and UART1's for idle_until_rx() to wake on
   IntEnable(INT_UART0);
+  IntEnable(INT_UART1);
   IntMasterEnable();
 
-  load_initial_firmware();
+  // 1ms SysTick, polled for timeouts. Reading the control register clears the
+  // wrap flag, so each wrap is seen by one poller only. The interrupt does
+  // nothing but wake idle_until_rx() so timeout loops keep counting.
+  SysTickPeriodSet(SysCtlClockGet() / 1000);
+  SysTickIntEnable();
+  SysTickEnable();
+
+#ifdef PROFILE
+  profile_start(PROFILE_HZ);
+#endif
+
+  telemetry_load();
+  telemetry.boot_count++;
+
+  load_metadata();
+  if (!metadata_valid){
+    load_initial_firmware();
+  }
 
   uart_write_str(UART2, "Welcome to the BWSI Vehicle Update Service!\n");
   uart_write_str(UART2, "Send \"U\" to update, and \"B\" to run the firmware.\n");
   uart_write_str(UART2, "Writing 0x20 to UART0 will reset the device.\n");
 
-  int resp;
+  if (autoboot_window_expired()){
+    boot_firmware();
+  }
+
+  unsigned char instruction;
   while (1){
-    uint32_t instruction = uart_read(UART1, BLOCKING, &resp);
+    read_bytes(UART1, &instruction, 1);
     if (instruction == UPDATE){
       uart_write_str(UART1, "U");
       load_firmware();
     } else if (instruction == BOOT){
       uart_write_str(UART1, "B");
       boot_firmware();
+    } else if (instruction == QUERY){
+      uart_write_str(UART1, "Q");
+      send_install_info();
+    } else if (instruction == TELEMETRY){
+      uart_write_str(UART1, "T");
+      telemetry_dump(UART1);
+    } else if (instruction == MEM_REPORT){
+      mem_report(UART2);
+#ifdef PROFILE
+    } else if (instruction == PROFILE_DUMP){
+      profile_dump(UART2);
+#endif
+    }
+  }
+}
+
+
+/*
+ * Start a free-running 32-bit down counter at the system clock.
+ *
+ * Called first thing from ResetISR(), so the firmware can work out its
+ * reset-to-main() latency from how far BOOT_TIMER_BASE has counted.
+ */
+void start_boot_timer(void) {
+  SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER0);
+  TimerConfigure(BOOT_TIMER_BASE, TIMER_CFG_32_BIT_PER);
+  TimerLoadSet(BOOT_TIMER_BASE, TIMER_A, 0xFFFFFFFF);
+  TimerEnable(BOOT_TIMER_BASE, TIMER_A);
+}
+
+
+/*
+ * Check for an installed firmware image worth booting: committed, and not
+ * partly overwritten by an update that never finished.
+ */
+int firmware_valid(void) {
+  return metadata_valid && !install_pending && *(uint32_t *) hal_flash(FW_BASE) != 0xFFFFFFFF;
+}
+
+
+/*
+ * Read the installed version and size from the newest metadata record.
+ */
+void load_metadata(void) {
+  uint32_t metadata;
+
+  metadata_valid = flashlog_read_latest(&metadata_log, &metadata) == 0;
+  if (metadata_valid) {
+    fw_version = metadata & 0xFFFF;
+    fw_size = metadata >> 16;
+    fw_release_message_address = hal_flash(FW_BASE + fw_size);
+  }
+  load_install_record();
+}
+
+
+/*
+ * Append a metadata record, which commits the installed image.
+ *
+ * Only erases when the current metadata page is full, and the previous record
+ * stays valid until the new one is completely written. Only the record is
+ * power-fail atomic: updates overwrite the image in place, so an interrupted
+ * one leaves neither image intact, and all the pending install record can
+ * do is keep it from being autobooted.
+ */
+long save_metadata(uint16_t version, uint16_t size) {
+  // Create 32 bit word for flash programming, version is at lower address, size is at higher address
+  uint32_t metadata = ((uint32_t) size << 16) | version;
+  long status = flashlog_append(&metadata_log, &metadata);
+
+  if (status == 0) {
+    metadata_valid = 1;
+    fw_version = version;
+    fw_size = size;
+    fw_release_message_address = hal_flash(FW_BASE + size);
+  }
+  return status;
+}
+
+
+/*
+ * Read the newest install record, keeping it only if it describes the image
+ * the metadata commits.
+ *
+ * A pending record, or one for other metadata (a commit cut short between
+ * its install record and its metadata), means the image was being rewritten.
+ * No record at all is an image from before the install log, and fine.
+ */
+void load_install_record(void) {
+  uint32_t metadata = ((uint32_t) fw_size << 16) | fw_version;
+  int found = metadata_valid && flashlog_read_latest(&install_log, install_record) == 0;
+
+  install_pending = found && (install_record[0] != metadata || install_record[1] == INSTALL_PENDING);
+  if (!found || install_pending) {
+    memset(install_record, 0, sizeof(install_record));
+  }
+}
+
+
+/*
+ * Append an install record for a body of body_len bytes with the given
+ * SHA-256, or with a NULL digest and INSTALL_PENDING for the image about to
+ * be overwritten.
+ *
+ * Written right before the metadata when an image is committed, and pending
+ * before the first page of an update is programmed, so a record never vouches
+ * for a half-written image and autoboot stays off until the commit.
+ */
+long save_install_record(uint32_t metadata, uint32_t body_len, const unsigned char *digest) {
+  long status;
+
+  memset(install_record, 0, sizeof(install_record));
+  install_record[0] = metadata;
+  install_record[1] = body_len;
+  if (digest) {
+    memcpy(install_record + 2, digest, br_sha256_SIZE);
+  }
+
+  status = flashlog_append(&install_log, install_record);
+  if (status) {
+    memset(install_record, 0, sizeof(install_record));
+  } else {
+    install_pending = body_len == INSTALL_PENDING;
+  }
+  return status;
+}
+
+
+/*
+ * SHA-256 of the len bytes at FW_BASE, for bodies that were not received in
+ * order.
+ */
+void flash_digest(uint32_t len, unsigned char *digest) {
+  br_sha256_context hash;
+
+  br_sha256_init(&hash);
+  br_sha256_update(&hash, hal_flash(FW_BASE), len);
+  br_sha256_out(&hash, digest);
+}
+
+
+/*
+ * Tell the host what is installed, from the cached install record.
+ */
+void send_install_info(void) {
+  unsigned char info[INSTALL_INFO_LEN];
+  uint32_t body_len = install_pending ? 0 : install_record[1];
+
+  info[0] = fw_version & 0xFF;
+  info[1] = fw_version >> 8;
+  info[2] = fw_size & 0xFF;
+  info[3] = fw_size >> 8;
+  info[4] = body_len >> 24;
+  info[5] = body_len >> 16;
+  info[6] = body_len >> 8;
+  info[7] = body_len;
+  memcpy(info + 8, install_record + 2, br_sha256_SIZE);
+
+  uint32_t crc = crc32_update(0, info, INSTALL_INFO_LEN);
+  for (int i = 0; i < INSTALL_INFO_LEN; i++) {
+    uart_write(UART1, info[i]);
+  }
+  uart_write(UART1, crc >> 24);
+  uart_write(UART1, crc >> 16);
+  uart_write(UART1, crc >> 8);
+  uart_write(UART1, crc);
+}
+
+
+/*
+ * Give the host AUTOBOOT_WINDOW_MS to start talking on UART1.
+ *
+ * Returns 1 if the window passed in silence and the installed firmware should
+ * be booted. The bootloader stays in its command loop instead if autoboot is
+ * disabled, there is no valid image, or the last reset was a software reset
+ * (a UART0 reset request or a failed update), so the host can always get in by
+ * resetting the device first.
+ */
+int autoboot_window_expired(void) {
+  uint32_t cause = SysCtlResetCauseGet();
+  SysCtlResetCauseClear(cause);
+
+  if (AUTOBOOT_WINDOW_MS == 0 || (cause & SYSCTL_CAUSE_SW) || !firmware_valid()) {
+    return 0;
+  }
+
+  // Count 1ms SysTick wraps.
+  int elapsed_ms = 0;
+  while (elapsed_ms < AUTOBOOT_WINDOW_MS) {
+    if (UARTCharsAvail(UART1)) {
+      return 0;
+    }
+    if (hal_tick()) {
+      elapsed_ms++;
     }
+    idle_until_rx(UART1);
   }
+
+  uart_write_str(UART2, "No update requested, booting.\n");
+  return 1;
 }
 
 
 /*
  * Load initial firmware into flash
+ *
+ * Only runs while no firmware has ever been committed. The release message is
+ * stored right behind the image, like an update's.
  */
 void load_initial_firmware(void) {
-  int size = (int)&_binary_firmware_bin_size;
-  int *data = (int *)&_binary_firmware_bin_start;
-    
-  uint16_t version = 2;
-  uint32_t metadata = (((uint16_t) size & 0xFFFF) << 16) | (version & 0xFFFF);
-  program_flash(METADATA_BASE, (uint8_t*)(&metadata), 4);
-  fw_release_message_address = (uint8_t *) "This is the initial release message.";
-    
-  int i = 0;
-  for (; i < size / FLASH_PAGESIZE; i++){
-       program_flash(FW_BASE + (i * FLASH_PAGESIZE), ((unsigned char *) data) + (i * FLASH_PAGESIZE), FLASH_PAGESIZE);
+  int size = (int)(intptr_t)&_binary_firmware_bin_size;
+  unsigned char *image = (unsigned char *)&_binary_firmware_bin_start;
+  const char *message = "This is the initial release message.";
+  int total = size + strlen(message) + 1;
+
+  for (int offset = 0; offset < total; offset += FLASH_PAGESIZE){
+    int len = total - offset < FLASH_PAGESIZE ? total - offset : FLASH_PAGESIZE;
+    for (int i = 0; i < len; i++){
+      int pos = offset + i;
+      data[i] = pos < size ? image[pos] : message[pos - size];
+    }
+    program_flash(FW_BASE + offset, data, len);
   }
-  program_flash(FW_BASE + (i * FLASH_PAGESIZE), ((unsigned char *) data) + (i * FLASH_PAGESIZE), size % FLASH_PAGESIZE);
+
+  flash_digest(total, data);
+  save_install_record(((uint32_t) size << 16) | 2, total, data);
+  save_metadata(2, size);
+}
+
+
+/*
+ * Receive a fixed-size control packet (metadata, signature) into buf, NAKing
+ * it with nak_seq until it arrives intact.
+ *
+ * Returns once len bytes with a matching CRC are in buf.
+ */
+void receive_packet(unsigned char *buf, unsigned int len, uint16_t nak_seq) {
+  unsigned char packet[PACKET_MAX_LEN + FRAME_CRC_LEN];
+
+  while (1) {
+    read_bytes(UART1, packet, 1);
+    if (read_bytes_timeout(UART1, packet + 1, len + FRAME_CRC_LEN - 1) == len + FRAME_CRC_LEN - 1) {
+      unsigned char *trailer = packet + len;
+      uint32_t crc = ((uint32_t) trailer[0] << 24) | ((uint32_t) trailer[1] << 16) |
+                     ((uint32_t) trailer[2] << 8) | trailer[3];
+      if (crc32_update(0, packet, len) == crc) {
+        memcpy(buf, packet, len);
+        return;
+      }
+    }
+    crc_failures++;
+    check_overrun(UART1);
+    drain_rx(UART1);
+    send_nak(UART1, nak_seq);
+  }
+}
+
+
+/*
+ * Apply the session options that follow the version and size.
+ *
+ * Returns 0 if the bootloader can run the update the way the host asked.
+ */
+int set_session_options(const unsigned char *options) {
+  uint32_t flags = options[0];
+
+  fec_parity = 0;
+  fec_data_len = 0;
+  bond_frame_len = 0;
+  signed_session = (flags & OPT_SIGNED) != 0;
+  merkle_session = (flags & OPT_MERKLE) != 0;
+  sparse_session = (flags & OPT_SPARSE) != 0;
+
+  if (flags & ~OPT_SUPPORTED) {
+    return -1;
+  }
+
+  // Chunk frames carry a whole page plus its proof, far more than an RS block.
+  if (merkle_session && (!signed_session || (flags & OPT_FEC))) {
+    return -1;
+  }
+
+  // Chunks are pieces of a flat image.
+  if (merkle_session && sparse_session) {
+    return -1;
+  }
+
+  if (flags & OPT_FEC) {
+    uint32_t parity = options[1];
+    uint32_t data_len = options[2];
+
+    // Frames must tile the page buffer exactly and fit in one RS block.
+    if (parity == 0 || parity % 2 || parity > RS_MAX_PARITY ||
+        data_len == 0 || FLASH_PAGESIZE % data_len ||
+        FRAME_HEADER_LEN + data_len + FRAME_CRC_LEN + parity > RS_MAX_BLOCK) {
+      return -1;
+    }
+    fec_parity = parity;
+    fec_data_len = data_len;
+  }
+
+  if (flags & OPT_BONDED) {
+    uint32_t data_len = options[2];
+
+    // Bonded frames are plain frames that tile the page buffer; chunks and
+    // segments have no fixed place in it.
+    if ((flags & (OPT_FEC | OPT_MERKLE | OPT_SPARSE)) ||
+        data_len < BOND_MIN_FRAME || data_len > BOND_MAX_FRAME || FLASH_PAGESIZE % data_len) {
+      return -1;
+    }
+    bond_frame_len = data_len;
+  }
+  return 0;
+}
+
+
+/*
+ * Receive one plain frame, with its data going to dst.
+ *
+ * Returns 0 with the frame's length and sequence number once a frame with a
+ * matching CRC is in, -1 if it has to be sent again.
+ */
+int receive_plain_frame(unsigned char *dst, uint32_t room, uint32_t *frame_length, uint16_t *seq) {
+  unsigned char header[FRAME_HEADER_LEN];
+  unsigned char trailer[FRAME_CRC_LEN];
+
+  // Get the length and sequence number. The first byte may take as long as
+  // the host likes, the rest of the frame has to follow promptly.
+  read_bytes(UART1, header, 1);
+  if (read_bytes_timeout(UART1, header + 1, FRAME_HEADER_LEN - 1) != FRAME_HEADER_LEN - 1) {
+    return -1;
+  }
+  *frame_length = ((uint32_t)header[0] << 8) | header[1];
+  *seq = ((uint16_t)header[2] << 8) | header[3];
+
+  // A length that can't fit the page buffer means a corrupted header; the
+  // rest of the frame is discarded with it.
+  if (*frame_length > room) {
+    drain_rx(UART1);
+    return -1;
+  }
+
+  // Get the number of bytes specified and the CRC. The data lands straight
+  // in the page buffer but only counts once the CRC matches.
+  if (read_bytes_timeout(UART1, dst, *frame_length) != *frame_length ||
+      read_bytes_timeout(UART1, trailer, FRAME_CRC_LEN) != FRAME_CRC_LEN) {
+    return -1;
+  }
+  uint32_t crc = ((uint32_t)trailer[0] << 24) | ((uint32_t)trailer[1] << 16) |
+                 ((uint32_t)trailer[2] << 8) | trailer[3];
+  if (crc32_update(crc32_update(0, header, FRAME_HEADER_LEN), dst, *frame_length) != crc) {
+    drain_rx(UART1);
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * Receive one FEC frame, with its data going to dst.
+ *
+ * FEC frames all have the same size, so the whole block is read before any
+ * of it is trusted, then repaired in place. The CRC still has the last word:
+ * it catches blocks damaged past what the parity can fix.
+ */
+int receive_fec_frame(unsigned char *dst, uint32_t room, uint32_t *frame_length, uint16_t *seq) {
+  uint32_t crc_offset = FRAME_HEADER_LEN + fec_data_len;
+  uint32_t block_len = crc_offset + FRAME_CRC_LEN + fec_parity;
+
+  read_bytes(UART1, fec_block, 1);
+  if (read_bytes_timeout(UART1, fec_block + 1, block_len - 1) != block_len - 1) {
+    return -1;
+  }
+
+  int corrected = rs_decode(fec_block, block_len, fec_parity);
+  if (corrected < 0) {
+    drain_rx(UART1);
+    return -1;
+  }
+
+  *frame_length = ((uint32_t)fec_block[0] << 8) | fec_block[1];
+  *seq = ((uint16_t)fec_block[2] << 8) | fec_block[3];
+  if (*frame_length > fec_data_len || *frame_length > room) {
+    return -1;
+  }
+
+  uint32_t crc = ((uint32_t)fec_block[crc_offset] << 24) | ((uint32_t)fec_block[crc_offset + 1] << 16) |
+                 ((uint32_t)fec_block[crc_offset + 2] << 8) | fec_block[crc_offset + 3];
+  if (crc32_update(0, fec_block, FRAME_HEADER_LEN + *frame_length) != crc) {
+    return -1;
+  }
+
+  fec_corrected += corrected;
+  memcpy(dst, fec_block + FRAME_HEADER_LEN, *frame_length);
+  return 0;
 }
 
 
 /*
  * Load the firmware into flash.
+ *
+ * Frames are acknowledged one at a time. A frame that times out, fails its CRC
+ * or arrives out of order is NAKed with the sequence number the bootloader
+ * expects, and the host resends just that frame. A repeat of the last accepted
+ * frame (its OK got lost) is acknowledged again without being stored twice.
+ * With FEC negotiated, most corrupted frames are repaired without a NAK.
  */
 void load_firmware(void)
 {
-  int frame_length = 0;
-  int read = 0;
-  uint32_t rcv = 0;
-  
+  unsigned char metadata[METADATA_LEN];
+  uint32_t frame_length = 0;
+  uint16_t seq = 0;
+  uint16_t expected_seq = 0;
+  int nak_sent = 0;
+
   uint32_t data_index = 0;
   uint32_t page_addr = FW_BASE;
+  uint32_t body_len = 0;
+  br_sha256_context body_hash;
+  unsigned char digest[br_sha256_SIZE];
   uint32_t version = 0;
   uint32_t size = 0;
 
-  // Get version.
-  rcv = uart_read(UART1, BLOCKING, &read);
-  version = (uint32_t)rcv;
-  rcv = uart_read(UART1, BLOCKING, &read);
-  version |= (uint32_t)rcv << 8;
+  crc_failures = 0;
+  retransmits = 0;
+  reset_idle_stats();
+  fec_corrected = 0;
+  telemetry.updates_started++;
+  update_start_ms = uptime_ms;
+
+  // Get version and size.
+  receive_packet(metadata, METADATA_LEN, METADATA_SEQ);
+  version = (uint32_t)metadata[0] | ((uint32_t)metadata[1] << 8);
+  size = (uint32_t)metadata[2] | ((uint32_t)metadata[3] << 8);
 
   uart_write_str(UART2, "Received Firmware Version: ");
   uart_write_hex(UART2, version);
   nl(UART2);
 
-  // Get size.
-  rcv = uart_read(UART1, BLOCKING, &read);
-  size = (uint32_t)rcv;
-  rcv = uart_read(UART1, BLOCKING, &read);
-  size |= (uint32_t)rcv << 8;
-  
-
   uart_write_str(UART2, "Received Firmware Size: ");
   uart_write_hex(UART2, size);
   nl(UART2);
 
 
   // Compare to old version and abort if older (note special case for version 0).
-  uint16_t old_version = *fw_version_address;
+  uint16_t old_version = fw_version;
+
+  if (set_session_options(metadata + 4)) {
+    reject_update(); // Reject the session options.
+    return;
+  }
 
   if (version != 0 && version < old_version) {
-    uart_write(UART1, ERROR); // Reject the metadata.
-    SysCtlReset(); // Reset device
+    reject_update(); // Reject the metadata.
     return;
   } else if (version == 0) {
     // If debug firmware, don't change version
     version = old_version;
   }
 
-  // Write new firmware size and version to Flash
-  // Create 32 bit word for flash programming, version is at lower address, size is at higher address
-  uint32_t metadata = ((size & 0xFFFF) << 16) | (version & 0xFFFF);
-  program_flash(METADATA_BASE, (uint8_t*)(&metadata), 4);
-  fw_release_message_address = (uint8_t *) (FW_BASE + size);
-
+  // The new size and version are only committed to flash once the whole
+  // image is in. The pages are not: the old image is gone from the first one
+  // on, whether or not the update finishes.
   uart_write(UART1, OK); // Acknowledge the metadata.
 
+  // The installed image is about to be overwritten; stop answering queries
+  // with its digest, and stop autobooting it until the commit.
+  if (save_install_record(((uint32_t) fw_size << 16) | fw_version, INSTALL_PENDING, NULL)) {
+    reject_update(); // Reject the update
+    return;
+  }
+
+  // A signed image is hashed as it arrives, so checking it at the end takes
+  // a single signature verify and no second pass over flash.
+  if (signed_session) {
+    receive_packet(signature, SIGNATURE_LEN, SIGNATURE_SEQ);
+    uart_write(UART1, OK); // Acknowledge the signature.
+    br_sha256_init(&image_hash);
+    br_sha256_update(&image_hash, metadata, 4);
+  }
+
+  if (merkle_session) {
+    load_chunks(version, size);
+    finish_update(1);
+    print_transfer_stats();
+    return;
+  }
+
+  if (bond_frame_len) {
+    load_bonded(version, size);
+    finish_update(1);
+    print_transfer_stats();
+    return;
+  }
+
+  // Sparse sessions take frames into their own buffer and copy each segment
+  // into the page buffer at its place in the page.
+  unsigned char *frame = sparse_session ? sparse_frame : data;
+  segment_header_len = 0;
+  segment_addr = FW_BASE;
+  segment_left = 0;
+  sparse_page = 0;
+  br_sha256_init(&body_hash);
+
   /* Loop here until you can get all your characters and stuff */
   while (1) {
 
-    // Get two bytes for the length.
-    rcv = uart_read(UART1, BLOCKING, &read);
-    frame_length = (int)rcv << 8;
-    rcv = uart_read(UART1, BLOCKING, &read);
-    frame_length += (int)rcv;
+    uint32_t room = sparse_session ? sizeof(sparse_frame) : FLASH_PAGESIZE - data_index;
+    int status = fec_parity ?
+      receive_fec_frame(frame + data_index, room, &frame_length, &seq) :
+      receive_plain_frame(frame + data_index, room, &frame_length, &seq);
+    if (status) {
+      crc_failures++;
+      check_overrun(UART1);
+      send_nak(UART1, expected_seq);
+      nak_sent = 1;
+      continue;
+    }
+
+    if (seq != expected_seq) {
+      retransmits++;
+      if (expected_seq != 0 && seq == (uint16_t)(expected_seq - 1)) {
+        uart_write(UART1, OK); // Already stored, only the OK went missing.
+      } else {
+        send_nak(UART1, expected_seq);
+        nak_sent = 1;
+      }
+      continue;
+    }
+    if (nak_sent) {
+      retransmits++;
+      nak_sent = 0;
+    }
+    expected_seq++;
+    telemetry.frames++;
+    telemetry.bytes += frame_length;
+    if (signed_session) {
+      br_sha256_update(&image_hash, frame + data_index, frame_length);
+    }
+    br_sha256_update(&body_hash, frame + data_index, frame_length);
+    body_len += frame_length;
 
     // Write length debug message
-    uart_write_hex(UART2,(unsigned char)rcv);
+    uart_write_hex(UART2, frame_length);
     nl(UART2);
 
-    // Get the number of bytes specified
-    for (int i = 0; i < frame_length; ++i){
-        data[data_index] = uart_read(UART1, BLOCKING, &read);
-        data_index += 1;
-    } //for
+    if (sparse_session) {
+      if (sparse_feed(frame, frame_length) || (frame_length == 0 && sparse_finish())) {
+        reject_update(); // Reject the malformed or misplaced segment
+        return;
+      }
+    } else {
+      data_index += frame_length;
+    }
 
     // If we filed our page buffer, program it
-    if (data_index == FLASH_PAGESIZE || frame_length == 0) {
-      // Try to write flash and check for error
-      if (program_flash(page_addr, data, data_index)){
-        uart_write(UART1, ERROR); // Reject the firmware
-        SysCtlReset(); // Reset device
+    if (!sparse_session && (data_index == FLASH_PAGESIZE || frame_length == 0)) {
+      // Try to write flash and check for error, keeping clear of the install
+      // log
+      if (page_addr >= FW_END || program_flash(page_addr, data, data_index)){
+        reject_update(); // Reject the firmware
         return;
       }
 #if 1
@@ -200,16 +867,524 @@ void load_firmware(void)
       // Update to next page
       page_addr += FLASH_PAGESIZE;
       data_index = 0;
+    } // if
 
-      // If at end of firmware, go to main
-      if (frame_length == 0) {
-        uart_write(UART1, OK);
-        break;
+    // If at end of firmware, commit it and go to main
+    if (frame_length == 0) {
+      if (signed_session && !verify_signature()) {
+        // The old image is partly overwritten already; make sure neither
+        // it nor the rejected one gets booted.
+        telemetry_erase(FW_BASE);
+        uart_write_str(UART2, "Signature check failed\n");
+        reject_update(); // Reject the firmware
+        return;
       }
-    } // if
+      br_sha256_out(&body_hash, digest);
+      if (save_install_record((size << 16) | version, body_len, digest) || save_metadata(version, size)){
+        reject_update(); // Reject the firmware
+        return;
+      }
+      uart_write(UART1, OK);
+      break;
+    }
 
     uart_write(UART1, OK); // Acknowledge the frame.
   } // while(1)
+
+  finish_update(1);
+  print_transfer_stats();
+}
+
+
+/*
+ * Receive a Merkle session's chunks, in whatever order they come, and commit.
+ *
+ * The manifest is checked against the signature before any chunk is taken,
+ * and every chunk against the manifest's root before it is programmed, so
+ * tampered data is turned away as soon as it shows up and never reaches
+ * flash. Each chunk frame's sequence number is its index and its data is the
+ * chunk followed by its proof. The zero-length frame only ends the transfer
+ * once every chunk is in; until then it is NAKed with the first missing index.
+ */
+void load_chunks(uint32_t version, uint32_t size)
+{
+  unsigned char manifest[MANIFEST_LEN];
+  uint32_t received[(FW_MAX_CHUNKS + 31) / 32];
+  uint32_t frame_length = 0;
+  uint16_t index = 0;
+
+  receive_packet(manifest, MANIFEST_LEN, MANIFEST_SEQ);
+  uint32_t body_len = ((uint32_t)manifest[32] << 24) | ((uint32_t)manifest[33] << 16) |
+                      ((uint32_t)manifest[34] << 8) | manifest[35];
+  uint32_t chunk_count = (body_len + FLASH_PAGESIZE - 1) / FLASH_PAGESIZE;
+
+  br_sha256_update(&image_hash, manifest, MANIFEST_LEN);
+  if (chunk_count == 0 || chunk_count > FW_MAX_CHUNKS || !verify_signature()) {
+    uart_write_str(UART2, "Manifest rejected\n");
+    reject_update(); // Reject the manifest
+    return;
+  }
+  uart_write(UART1, OK); // Acknowledge the manifest.
+
+  memset(received, 0, sizeof(received));
+  uint32_t remaining = chunk_count;
+  while (1) {
+    if (receive_plain_frame(data, sizeof(data), &frame_length, &index)) {
+      crc_failures++;
+      check_overrun(UART1);
+      send_nak(UART1, first_missing_chunk(received, chunk_count));
+      continue;
+    }
+
+    if (frame_length == 0) {
+      if (remaining == 0) {
+        break;
+      }
+      send_nak(UART1, first_missing_chunk(received, chunk_count));
+      continue;
+    }
+
+    uint32_t chunk_len = body_len - (uint32_t)index * FLASH_PAGESIZE;
+    if (chunk_len > FLASH_PAGESIZE) {
+      chunk_len = FLASH_PAGESIZE;
+    }
+    if (index >= chunk_count ||
+        frame_length != chunk_len + merkle_proof_len(index, chunk_count) * MERKLE_HASH_LEN) {
+      reject_update(); // Reject the malformed chunk
+      return;
+    }
+
+    if (received[index / 32] & (1UL << (index % 32))) {
+      retransmits++;
+      uart_write(UART1, OK); // Already stored, only the OK went missing.
+      continue;
+    }
+
+    if (!merkle_verify(manifest, index, chunk_count, data, chunk_len, data + chunk_len)) {
+      uart_write_str(UART2, "Chunk failed Merkle check: ");
+      uart_write_hex(UART2, index);
+      nl(UART2);
+      telemetry_erase(FW_BASE); // Chunks already programmed may be half an image.
+      reject_update(); // Reject the firmware
+      return;
+    }
+
+    if (program_flash(FW_BASE + (uint32_t)index * FLASH_PAGESIZE, data, chunk_len)) {
+      reject_update(); // Reject the firmware
+      return;
+    }
+    received[index / 32] |= 1UL << (index % 32);
+    remaining--;
+    telemetry.frames++;
+    telemetry.bytes += chunk_len;
+
+    uart_write(UART1, OK); // Acknowledge the chunk.
+  }
+
+  flash_digest(body_len, data);
+  if (save_install_record((size << 16) | version, body_len, data) || save_metadata(version, size)) {
+    reject_update(); // Reject the firmware
+    return;
+  }
+  uart_write(UART1, OK);
+}
+
+
+/*
+ * Receive a bonded session's frames over both links and commit.
+ *
+ * Each link is stop-and-wait on its own: a frame is answered with OK or NAK
+ * on the link it came in on, and a link whose frame was lost or damaged gets
+ * its NAK without holding up the other one. The page buffer takes the frames
+ * of one page at a time; the page is programmed as soon as the last of them
+ * is in, before that frame's OK goes out, so nothing arrives while flash is
+ * busy. Frames of earlier pages are acknowledged again without being stored,
+ * frames past the current page are NAKed. The zero-length frame commits the
+ * image once every frame before it is in; until then it is NAKed with the
+ * first missing sequence number.
+ *
+ * Both receivers are serviced from one loop, so this busy-polls the UARTs
+ * instead of sleeping in idle_until_rx(), and writes nothing to UART2 but
+ * answers.
+ */
+void load_bonded(uint32_t version, uint32_t size)
+{
+  const uint32_t uarts[BOND_LINKS] = {UART1, UART2};
+  uint32_t frames_per_page = FLASH_PAGESIZE / bond_frame_len;
+  uint32_t received = 0;              // frames of the current page in the page buffer
+  uint32_t page_first = 0;            // sequence number of the current page's first frame
+  uint32_t page_bytes = 0;            // end of the data in the page buffer
+  uint32_t short_seq = BOND_NO_SHORT; // the short frame that ends the image, once it is in
+  uint32_t page_addr = FW_BASE;
+  uint32_t body_len = 0;
+  uint32_t frame_length = 0;
+  uint16_t seq = 0;
+  br_sha256_context body_hash;
+  unsigned char digest[br_sha256_SIZE];
+
+  for (int i = 0; i < BOND_LINKS; i++) {
+    bond_links[i].uart = uarts[i];
+    bond_links[i].len = 0;
+    bond_links[i].idle_ms = 0;
+    bond_links[i].discard = 0;
+  }
+
+  // Nothing was meant for UART2 before the metadata was acknowledged.
+  while (!hal_rx_empty(UART2)) {
+    (void) hal_rx_byte(UART2);
+  }
+  check_overrun(UART2);
+  br_sha256_init(&body_hash);
+
+  while (1) {
+    int tick = hal_tick() != 0;
+
+    for (uint32_t i = 0; i < BOND_LINKS; i++) {
+      uint32_t uart = bond_links[i].uart;
+      int status = bond_poll(i, tick, &frame_length, &seq);
+      if (status == 0) {
+        continue;
+      }
+
+      uint16_t missing = page_first + first_missing_chunk(&received, frames_per_page);
+      if (status < 0) {
+        crc_failures++;
+        check_overrun(uart);
+        send_nak(uart, missing);
+        continue;
+      }
+
+      if (frame_length == 0) {
+        if (seq != missing) {
+          send_nak(uart, missing);
+          continue;
+        }
+        if (short_seq != BOND_NO_SHORT && short_seq + 1 != seq) {
+          reject_update(); // Reject the short frame in the middle of the image
+          return;
+        }
+        if (received) {
+          if (page_addr >= FW_END || program_flash(page_addr, data, page_bytes)) {
+            reject_update(); // Reject the firmware
+            return;
+          }
+          if (signed_session) {
+            br_sha256_update(&image_hash, data, page_bytes);
+          }
+          br_sha256_update(&body_hash, data, page_bytes);
+          body_len += page_bytes;
+        }
+        if (signed_session && !verify_signature()) {
+          // The old image is partly overwritten already; make sure neither
+          // it nor the rejected one gets booted.
+          telemetry_erase(FW_BASE);
+          reject_update(); // Reject the firmware
+          return;
+        }
+        br_sha256_out(&body_hash, digest);
+        if (save_install_record((size << 16) | version, body_len, digest) || save_metadata(version, size)) {
+          reject_update(); // Reject the firmware
+          return;
+        }
+        uart_write(uart, OK);
+        return;
+      }
+
+      uint32_t slot = (uint32_t)seq - page_first;
+      if (seq < page_first || (slot < frames_per_page && (received & (1UL << slot)))) {
+        retransmits++;
+        uart_write(uart, OK); // Already stored, only the OK went missing.
+        continue;
+      }
+      if (slot >= frames_per_page) {
+        send_nak(uart, missing);
+        continue;
+      }
+
+      // Only the last data frame may be short, or the frames after it would
+      // leave a gap in the image.
+      if (seq > short_seq || (frame_length < bond_frame_len && short_seq != BOND_NO_SHORT)) {
+        reject_update(); // Reject the frame past the end of the image
+        return;
+      }
+      if (frame_length < bond_frame_len) {
+        short_seq = seq;
+      }
+
+      memcpy(data + slot * bond_frame_len, bond_links[i].frame + FRAME_HEADER_LEN, frame_length);
+      received |= 1UL << slot;
+      if (slot * bond_frame_len + frame_length > page_bytes) {
+        page_bytes = slot * bond_frame_len + frame_length;
+      }
+      telemetry.frames++;
+      telemetry.bytes += frame_length;
+
+      // Program a full page, keeping clear of the install log
+      if (first_missing_chunk(&received, frames_per_page) == frames_per_page) {
+        if (page_addr >= FW_END || program_flash(page_addr, data, page_bytes)) {
+          reject_update(); // Reject the firmware
+          return;
+        }
+        if (signed_session) {
+          br_sha256_update(&image_hash, data, page_bytes);
+        }
+        br_sha256_update(&body_hash, data, page_bytes);
+        body_len += page_bytes;
+
+        page_addr += FLASH_PAGESIZE;
+        page_first += frames_per_page;
+        received = 0;
+        page_bytes = 0;
+      }
+
+      uart_write(uart, OK); // Acknowledge the frame.
+    }
+  }
+}
+
+
+/*
+ * Take whatever bonded link i has received so far, without waiting for more.
+ * tick is set once per millisecond and times the link out after
+ * FRAME_TIMEOUT_MS of quiet.
+ *
+ * Returns 1 with the frame's length and sequence number once a frame with a
+ * matching CRC is in, its data in the link's frame buffer; -1 once a frame
+ * that timed out or failed its CRC is over and has to be sent again; and 0
+ * while a frame is still on its way. A frame that can't be right is dropped
+ * up to the quiet time, which leaves the link lined up with the resend.
+ */
+int bond_poll(uint32_t i, int tick, uint32_t *frame_length, uint16_t *seq)
+{
+  bond_link_t *link = &bond_links[i];
+
+  while (!hal_rx_empty(link->uart)) {
+    unsigned char byte = hal_rx_byte(link->uart);
+
+    link->idle_ms = 0;
+    if (link->discard) {
+      continue;
+    }
+    link->frame[link->len++] = byte;
+    if (link->len < FRAME_HEADER_LEN) {
+      continue;
+    }
+
+    *frame_length = ((uint32_t)link->frame[0] << 8) | link->frame[1];
+    if (*frame_length > bond_frame_len) {
+      link->discard = 1;
+      continue;
+    }
+    if (link->len == FRAME_HEADER_LEN + *frame_length + FRAME_CRC_LEN) {
+      unsigned char *trailer = link->frame + FRAME_HEADER_LEN + *frame_length;
+      uint32_t crc = ((uint32_t)trailer[0] << 24) | ((uint32_t)trailer[1] << 16) |
+                     ((uint32_t)trailer[2] << 8) | trailer[3];
+      if (crc32_update(0, link->frame, FRAME_HEADER_LEN + *frame_length) == crc) {
+        *seq = ((uint16_t)link->frame[2] << 8) | link->frame[3];
+        link->len = 0;
+        return 1;
+      }
+      link->discard = 1;
+    }
+  }
+
+  if ((link->len || link->discard) && tick && ++link->idle_ms >= FRAME_TIMEOUT_MS) {
+    link->len = 0;
+    link->idle_ms = 0;
+    link->discard = 0;
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * Feed len bytes of a sparse session's body through the segment parser.
+ *
+ * Segment data is copied into the page buffer at its offset in its page; the
+ * page is erased and programmed once a segment moves on to another page, so
+ * only pages some segment touches are erased, each one once. Whatever no
+ * segment covers in such a page reads back as erased flash.
+ *
+ * Returns 0, or -1 for a segment that goes backwards, is empty, or does not
+ * fit between FW_BASE and FW_END, or if programming failed.
+ */
+int sparse_feed(const unsigned char *buf, uint32_t len)
+{
+  while (len) {
+    if (segment_left == 0) {
+      segment_header[segment_header_len++] = *buf++;
+      len--;
+      if (segment_header_len < SEGMENT_HEADER_LEN) {
+        continue;
+      }
+      segment_header_len = 0;
+
+      uint32_t addr = ((uint32_t)segment_header[0] << 24) | ((uint32_t)segment_header[1] << 16) |
+                      ((uint32_t)segment_header[2] << 8) | segment_header[3];
+      uint32_t seg_len = ((uint32_t)segment_header[4] << 24) | ((uint32_t)segment_header[5] << 16) |
+                         ((uint32_t)segment_header[6] << 8) | segment_header[7];
+      if (addr < segment_addr || addr >= FW_END || seg_len == 0 || seg_len > FW_END - addr) {
+        return -1;
+      }
+      segment_addr = addr;
+      segment_left = seg_len;
+      continue;
+    }
+
+    uint32_t page = segment_addr & ~(FLASH_PAGESIZE - 1);
+    if (page != sparse_page) {
+      if (sparse_flush()) {
+        return -1;
+      }
+      sparse_page = page;
+      memset(data, 0xFF, FLASH_PAGESIZE);
+    }
+
+    uint32_t n = page + FLASH_PAGESIZE - segment_addr;
+    if (n > segment_left) {
+      n = segment_left;
+    }
+    if (n > len) {
+      n = len;
+    }
+    memcpy(data + (segment_addr - page), buf, n);
+    buf += n;
+    len -= n;
+    segment_addr += n;
+    segment_left -= n;
+  }
+  return 0;
+}
+
+
+/*
+ * Program the page in the page buffer, if any.
+ *
+ * Returns 0, or -1 if programming failed.
+ */
+int sparse_flush(void)
+{
+  if (sparse_page == 0) {
+    return 0;
+  }
+  if (program_flash(sparse_page, data, FLASH_PAGESIZE)) {
+    return -1;
+  }
+  uart_write_str(UART2, "Page successfully programmed\nAddress: ");
+  uart_write_hex(UART2, sparse_page);
+  nl(UART2);
+  sparse_page = 0;
+  return 0;
+}
+
+
+/*
+ * Program the last page once the body is complete.
+ *
+ * Returns 0, or -1 if the body ended in the middle of a segment or
+ * programming failed.
+ */
+int sparse_finish(void)
+{
+  if (segment_left || segment_header_len) {
+    return -1;
+  }
+  return sparse_flush();
+}
+
+
+/*
+ * Index of the lowest chunk not received yet, count if there is none.
+ */
+uint16_t first_missing_chunk(const uint32_t *received, uint32_t count)
+{
+  uint32_t index;
+
+  for (index = 0; index < count; index++) {
+    if (!(received[index / 32] & (1UL << (index % 32)))) {
+      break;
+    }
+  }
+  return index;
+}
+
+
+/*
+ * Report what the last update cost on UART2.
+ */
+void print_transfer_stats(void)
+{
+  uart_write_str(UART2, "CRC failures: ");
+  uart_write_hex(UART2, crc_failures);
+  uart_write_str(UART2, "\nRetransmits: ");
+  uart_write_hex(UART2, retransmits);
+  uart_write_str(UART2, "\nFEC corrected bytes: ");
+  uart_write_hex(UART2, fec_corrected);
+  if (signed_session) {
+    uart_write_str(UART2, "\nSignature verify cycles: ");
+    uart_write_hex(UART2, verify_cycles);
+  }
+  if (idle_cycles + busy_cycles) {
+    uart_write_str(UART2, "\nIdle percent: ");
+    uart_write_hex(UART2, idle_cycles * 100 / (idle_cycles + busy_cycles));
+  }
+  nl(UART2);
+}
+
+
+/*
+ * Add the update that just ended to the lifetime telemetry and flush it.
+ */
+void finish_update(int committed)
+{
+  uint32_t elapsed = uptime_ms - update_start_ms;
+
+  telemetry.updates_committed += committed;
+  telemetry.crc_failures += crc_failures;
+  telemetry.retransmits += retransmits;
+  telemetry.fec_corrected += fec_corrected;
+  telemetry.last_update_ms = elapsed;
+  telemetry.total_update_ms += elapsed;
+  if (elapsed > telemetry.max_update_ms) {
+    telemetry.max_update_ms = elapsed;
+  }
+  telemetry_flush();
+}
+
+
+/*
+ * Count and clear a receive overrun on uart. Bytes lost to one show up as a
+ * frame that fails its CRC or times out.
+ */
+void check_overrun(uint32_t uart)
+{
+  if (hal_rx_overrun(uart)) {
+    telemetry.overruns++;
+  }
+}
+
+
+/*
+ * Check the signature over the hashed metadata and image.
+ *
+ * ECDSA P-256 with BearSSL's ec_p256_m15, whose fixed-base window tables for
+ * the generator are const and stay in flash. The time taken is measured on
+ * the free-running boot timer and kept in verify_cycles.
+ */
+int verify_signature(void) {
+  unsigned char hash[br_sha256_SIZE];
+  br_ec_public_key key = {
+    BR_EC_secp256r1, (unsigned char *) signing_public_key, sizeof(signing_public_key)
+  };
+
+  uint32_t start = TimerValueGet(BOOT_TIMER_BASE, TIMER_A);
+  br_sha256_out(&image_hash, hash);
+  uint32_t valid = br_ecdsa_i15_vrfy_raw(&br_ec_p256_m15, hash, sizeof(hash),
+                                         &key, signature, SIGNATURE_LEN);
+  verify_cycles = start - TimerValueGet(BOOT_TIMER_BASE, TIMER_A);
+
+  return valid == 1;
 }
 
 int verify_hmac(uint32_t metadata, char data[]) {
@@ -223,6 +1398,147 @@ char decrypt_firmware(char data[]) {
 }
 
 
+/*
+ * Sleep until uart has received something, or the next interrupt.
+ *
+ * Only UART1 has its interrupt enabled in the NVIC; any other uart just
+ * sleeps until the next SysTick. Interrupts are masked from the check through
+ * the WFI, so a byte landing in between still wakes the core; the RX
+ * interrupt itself is only unmasked while asleep and is never taken.
+ *
+ * The host build has its own, in host/hal_host.c.
+ */
+#ifndef HOST
+RAMFUNC void idle_until_rx(uint32_t uart)
+{
+  uint32_t sleep, wake;
+
+  __asm("CPSID I");
+  if (HWREG(uart + UART_O_FR) & UART_FR_RXFE) {
+    HWREG(uart + UART_O_IM) |= UART_INT_RX | UART_INT_RT;
+    sleep = HWREG(BOOT_TIMER_BASE + TIMER_O_TAR);
+    __asm("WFI");
+    wake = HWREG(BOOT_TIMER_BASE + TIMER_O_TAR);
+    HWREG(uart + UART_O_IM) &= ~(UART_INT_RX | UART_INT_RT);
+    NVIC_UNPEND0 = 1 << (INT_UART1 - 16);
+
+    // The boot timer counts down.
+    busy_cycles += last_wake - sleep;
+    idle_cycles += sleep - wake;
+    last_wake = wake;
+  }
+  __asm("CPSIE I");
+}
+#endif
+
+
+/*
+ * SysTick's interrupt ends the WFI in idle_until_rx() and keeps uptime_ms.
+ */
+void SysTick_IRQHandler(void)
+{
+  uptime_ms++;
+}
+
+
+/*
+ * Start measuring how much of the time is spent in idle_until_rx().
+ */
+void reset_idle_stats(void)
+{
+  idle_cycles = 0;
+  busy_cycles = 0;
+  last_wake = TimerValueGet(BOOT_TIMER_BASE, TIMER_A);
+}
+
+
+/*
+ * Receive exactly len bytes from a UART, blocking until they arrive.
+ *
+ * This is the inner loop of every transfer, so it runs from SRAM and reads
+ * the UART registers directly instead of going through the UART library.
+ * The core sleeps while the FIFO is empty.
+ */
+RAMFUNC void read_bytes(uint32_t uart, unsigned char *dst, unsigned int len)
+{
+  while (len--) {
+    while (hal_rx_empty(uart)) {
+      idle_until_rx(uart);
+    }
+    *dst++ = hal_rx_byte(uart);
+  }
+}
+
+
+/*
+ * Receive up to len bytes from a UART, giving up once the line has been quiet
+ * for FRAME_TIMEOUT_MS.
+ *
+ * Returns the number of bytes received, which is len unless it timed out.
+ */
+RAMFUNC unsigned int read_bytes_timeout(uint32_t uart, unsigned char *dst, unsigned int len)
+{
+  unsigned int count = 0;
+
+  while (count < len) {
+    unsigned int idle_ms = 0;
+    while (hal_rx_empty(uart)) {
+      if (hal_tick() && ++idle_ms >= FRAME_TIMEOUT_MS) {
+        return count;
+      }
+      idle_until_rx(uart);
+    }
+    dst[count++] = hal_rx_byte(uart);
+  }
+  return count;
+}
+
+
+/*
+ * Throw away everything the host is still sending, until the line goes quiet.
+ *
+ * After a corrupted frame the host is still waiting for an answer, so this
+ * leaves the receiver lined up with the start of the retransmission.
+ */
+void drain_rx(uint32_t uart)
+{
+  unsigned char discard;
+
+  while (read_bytes_timeout(uart, &discard, 1)) {
+  }
+}
+
+
+/*
+ * Ask the host to resend the frame with sequence number seq, on uart.
+ */
+void send_nak(uint32_t uart, uint16_t seq)
+{
+  uart_write(uart, NAK);
+  uart_write(uart, seq >> 8);
+  uart_write(uart, seq & 0xFF);
+}
+
+
+/*
+ * Tell the host the update failed for good, then reset. The failed update
+ * still counts towards the telemetry.
+ *
+ * OK and ERROR are a single bit apart, so ERROR is followed by its complement
+ * for the host to tell a real rejection from a corrupted OK. The reset waits
+ * until both bytes are out.
+ */
+void reject_update(void)
+{
+  finish_update(0);
+  uart_write(UART1, ERROR);
+  uart_write(UART1, ERROR_CHECK);
+  while (UARTBusy(UART1)) {
+  }
+  SysCtlReset(); // Reset device
+}
+
+
 /*
  * Program a stream of bytes to the flash.
  * This function takes the starting address of a 1KB page, a pointer to the
@@ -236,16 +1552,16 @@ long program_flash(uint32_t page_addr, unsigned char *data, unsigned int data_le
   unsigned int padded_data_len;
 
   // Erase next FLASH page
-  FlashErase(page_addr);
+  telemetry_erase(page_addr);
 
   // Clear potentially unused bytes in last word
   if (data_len % FLASH_WRITESIZE){
     // Get number unused
     int rem = data_len % FLASH_WRITESIZE;
     int i;
-    // Set to 0
-    for (i = 0; i < rem; i++){
-      data[data_len-1-i] = 0x00;
+    // Set the padding after the data to 0
+    for (i = 0; i < FLASH_WRITESIZE - rem; i++){
+      data[data_len+i] = 0x00;
     }
     // Pad to 4-byte word
     padded_data_len = data_len+(FLASH_WRITESIZE-rem);
@@ -262,9 +1578,17 @@ void boot_firmware(void)
 {
   uart_write_str(UART2, (char *) fw_release_message_address);
 
+#ifdef PROFILE
+  profile_stop();
+#endif
+
+  telemetry_flush();
+
+  // Hand over SysTick and the NVIC as the firmware expects to find them;
+  // until it installs its own handlers these vectors still point here.
+  SysTickIntDisable();
+  IntDisable(INT_UART1);
+
   // Boot the firmware
-    __asm(
-    "LDR R0,=0x10001\n\t"
-    "BX R0\n\t"
-  );
-}
\ No newline at end of file
+  hal_boot_firmware();
+}
@@ -0,0 +1,144 @@
+// Hardware Imports
+#include "inc/hw_types.h" // Boolean type
+
+// Driver API Imports
+#include "driverlib/flash.h" // FLASH API
+
+// Application Imports
+#include "flashlog.h"
+#include "telemetry.h"
+#include "hal.h"
+
+
+// FLASH Constants
+#define FLASH_PAGESIZE 1024
+#define ERASED_WORD 0xFFFFFFFF
+
+
+// Commit word: sequence number in the upper 24 bits, a fixed tag in the low
+// byte. The tag is never 0xFF, so a committed record can't look erased.
+#define COMMIT_TAG 0xA5
+#define COMMIT_WORD(seq) (((seq) << 8) | COMMIT_TAG)
+#define COMMIT_SEQ(word) ((word) >> 8)
+#define IS_COMMITTED(word) (((word) & 0xFF) == COMMIT_TAG)
+
+
+// Where the log currently stands, as found by scan().
+typedef struct {
+  int latest_page;          // Page holding the newest record, -1 if none.
+  uint32_t latest_addr;     // Address of the newest record.
+  uint32_t latest_seq;
+  uint32_t next_slot[2];    // First slot after the last used one, per page.
+} scan_t;
+
+
+static uint32_t record_words(const flashlog_t *log) {
+  return log->payload_words + 1;
+}
+
+static uint32_t slots_per_page(const flashlog_t *log) {
+  return FLASH_PAGESIZE / (record_words(log) * 4);
+}
+
+
+/*
+ * Walk both pages once, finding the newest committed record and where the
+ * next append could go. Slots with anything programmed in them (torn writes
+ * included) count as used.
+ */
+static void scan(const flashlog_t *log, scan_t *result) {
+  result->latest_page = -1;
+  result->latest_addr = 0;
+  result->latest_seq = 0;
+
+  for (int page = 0; page < 2; page++) {
+    result->next_slot[page] = 0;
+
+    for (uint32_t slot = 0; slot < slots_per_page(log); slot++) {
+      uint32_t addr = log->pages[page] + slot * record_words(log) * 4;
+      uint32_t *record = (uint32_t *) hal_flash(addr);
+      uint32_t commit = record[log->payload_words];
+      int used = 0;
+
+      for (uint32_t i = 0; i < record_words(log); i++) {
+        if (record[i] != ERASED_WORD) {
+          used = 1;
+          break;
+        }
+      }
+      if (!used) {
+        continue;
+      }
+
+      result->next_slot[page] = slot + 1;
+      if (IS_COMMITTED(commit) && COMMIT_SEQ(commit) > result->latest_seq) {
+        result->latest_page = page;
+        result->latest_addr = addr;
+        result->latest_seq = COMMIT_SEQ(commit);
+      }
+    }
+  }
+}
+
+
+/*
+ * Copy the newest committed record's payload out.
+ * Returns 0 on success, -1 if the log holds no committed record.
+ */
+int flashlog_read_latest(const flashlog_t *log, uint32_t *payload) {
+  scan_t state;
+  scan(log, &state);
+
+  if (state.latest_page < 0) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < log->payload_words; i++) {
+    payload[i] = ((uint32_t *) hal_flash(state.latest_addr))[i];
+  }
+  return 0;
+}
+
+
+/*
+ * Append a record, erasing a page only if the active one is full.
+ * Returns 0 on success, nonzero if flash programming failed.
+ */
+long flashlog_append(const flashlog_t *log, const uint32_t *payload) {
+  uint32_t buffer[FLASHLOG_MAX_PAYLOAD_WORDS];
+  unsigned long commit;
+  scan_t state;
+  long status;
+
+  scan(log, &state);
+
+  int page = state.latest_page < 0 ? 0 : state.latest_page;
+  uint32_t slot = state.next_slot[page];
+
+  // Active page full: start over on the other one. Everything there is older
+  // than the newest record, which stays intact until the new one commits.
+  if (slot == slots_per_page(log)) {
+    if (state.latest_page >= 0) {
+      page ^= 1;
+    }
+    status = telemetry_erase(log->pages[page]);
+    if (status) {
+      return status;
+    }
+    slot = 0;
+  }
+
+  uint32_t addr = log->pages[page] + slot * record_words(log) * 4;
+
+  // FlashProgram() wants word-aligned RAM, whatever the caller passed in.
+  for (uint32_t i = 0; i < log->payload_words; i++) {
+    buffer[i] = payload[i];
+  }
+  status = FlashProgram((unsigned long *) buffer, addr, log->payload_words * 4);
+  if (status) {
+    return status;
+  }
+
+  commit = COMMIT_WORD(state.latest_seq + 1);
+  return FlashProgram(&commit, addr + log->payload_words * 4, 4);
+}
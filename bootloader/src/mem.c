@@ -0,0 +1,51 @@
+// Library Imports
+#include "uart.h"
+
+// Application Imports
+#include "mem.h"
+
+
+// Section boundaries from main.ld.
+extern unsigned long _data, _edata;
+extern unsigned long _ramfunc, _eramfunc;
+extern unsigned long _bss, _ebss;
+extern unsigned long _stack, _estack;
+
+
+/*
+ * Deepest the stack has been since reset, in bytes.
+ *
+ * The stack grows down from _estack, so the lowest word that lost its paint
+ * marks how far it got.
+ */
+uint32_t stack_high_water(void) {
+  unsigned long *word = &_stack;
+
+  while (word < &_estack && *word == MEM_STACK_PAINT) {
+    word++;
+  }
+  return (uint32_t) &_estack - (uint32_t) word;
+}
+
+
+static void write_region(uint32_t uart, char *name, uint32_t bytes) {
+  uart_write_str(uart, name);
+  uart_write_hex(uart, bytes);
+  nl(uart);
+}
+
+
+/*
+ * Print the SRAM each section takes and the stack high-water mark, in bytes.
+ *
+ * Nothing allocates from a heap, so the gap between .bss and the stack is
+ * simply unused.
+ */
+void mem_report(uint32_t uart) {
+  write_region(uart, ".data      ", (uint32_t) &_edata - (uint32_t) &_data);
+  write_region(uart, ".ramfunc   ", (uint32_t) &_eramfunc - (uint32_t) &_ramfunc);
+  write_region(uart, ".bss       ", (uint32_t) &_ebss - (uint32_t) &_bss);
+  write_region(uart, "unused     ", (uint32_t) &_stack - (uint32_t) &_ebss);
+  write_region(uart, "stack size ", (uint32_t) &_estack - (uint32_t) &_stack);
+  write_region(uart, "stack used ", stack_high_water());
+}
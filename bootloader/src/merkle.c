@@ -0,0 +1,71 @@
+// Crypto Imports
+#include "bearssl.h"
+
+// Application Imports
+#include "merkle.h"
+
+#include <string.h>
+
+
+#define LEAF_PREFIX 0x00
+#define NODE_PREFIX 0x01
+
+
+/*
+ * Number of sibling hashes in the proof for chunk index out of count.
+ */
+unsigned int merkle_proof_len(uint32_t index, uint32_t count) {
+  unsigned int len = 0;
+
+  while (count > 1) {
+    if ((index ^ 1) < count) {
+      len++;
+    }
+    index >>= 1;
+    count = (count + 1) >> 1;
+  }
+  return len;
+}
+
+
+/*
+ * Check one chunk against the root, using the sibling hashes from its proof.
+ *
+ * Returns 1 if the chunk is the one the root was built over, 0 otherwise.
+ */
+int merkle_verify(const unsigned char *root, uint32_t index, uint32_t count,
+                  const unsigned char *chunk, uint32_t chunk_len,
+                  const unsigned char *proof) {
+  br_sha256_context ctx;
+  unsigned char hash[MERKLE_HASH_LEN];
+  unsigned char prefix[3];
+
+  prefix[0] = LEAF_PREFIX;
+  prefix[1] = index >> 8;
+  prefix[2] = index & 0xFF;
+  br_sha256_init(&ctx);
+  br_sha256_update(&ctx, prefix, 3);
+  br_sha256_update(&ctx, chunk, chunk_len);
+  br_sha256_out(&ctx, hash);
+
+  while (count > 1) {
+    if ((index ^ 1) < count) {
+      prefix[0] = NODE_PREFIX;
+      br_sha256_init(&ctx);
+      br_sha256_update(&ctx, prefix, 1);
+      if (index & 1) {
+        br_sha256_update(&ctx, proof, MERKLE_HASH_LEN);
+        br_sha256_update(&ctx, hash, MERKLE_HASH_LEN);
+      } else {
+        br_sha256_update(&ctx, hash, MERKLE_HASH_LEN);
+        br_sha256_update(&ctx, proof, MERKLE_HASH_LEN);
+      }
+      br_sha256_out(&ctx, hash);
+      proof += MERKLE_HASH_LEN;
+    }
+    index >>= 1;
+    count = (count + 1) >> 1;
+  }
+
+  return memcmp(hash, root, MERKLE_HASH_LEN) == 0;
+}
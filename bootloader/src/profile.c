@@ -0,0 +1,153 @@
+// Hardware Imports
+#include "inc/hw_memmap.h" // Peripheral Base Addresses
+#include "inc/hw_types.h" // Boolean type
+#include "inc/hw_ints.h" // Interrupt numbers
+#include "inc/hw_timer.h" // Timer registers
+
+// Driver API Imports
+#include "driverlib/interrupt.h" // Interrupt API
+#include "driverlib/sysctl.h" // System control API (clock/reset)
+#include "driverlib/timer.h" // General purpose timer API
+
+// Library Imports
+#include "uart.h"
+
+// Application Imports
+#include "profile.h"
+
+
+#define PROFILE_TIMER_BASE TIMER1_BASE  // TIMER0 is the boot timer
+#define PROFILE_BYTES_PER_LINE 32       // same layout as the firmware's DUMP
+
+
+typedef struct {
+  uint32_t pc;
+  uint32_t lr;  // only trustworthy when the interrupted code is a leaf
+} profile_sample_t;
+
+// A ring that keeps the newest samples once it fills up.
+static profile_sample_t samples[PROFILE_MAX_SAMPLES];
+static volatile uint32_t sample_count;  // samples taken since profile_start()
+static uint32_t sample_hz;
+
+
+/*
+ * Record the PC and LR from the exception frame the timer interrupt pushed.
+ *
+ * Lives in SRAM like the rest of the flash write path, so sampling does not
+ * stall while FlashErase()/FlashProgram() hold up instruction fetch.
+ */
+RAMFUNC __attribute__((used)) void profile_sample(uint32_t *frame) {
+  profile_sample_t *sample = &samples[sample_count % PROFILE_MAX_SAMPLES];
+
+  HWREG(PROFILE_TIMER_BASE + TIMER_O_ICR) = TIMER_TIMA_TIMEOUT;
+  sample->pc = frame[6];
+  sample->lr = frame[5];
+  sample_count++;
+}
+
+
+/*
+ * TIMER1A handler: find the frame on whichever stack was active and hand it to
+ * profile_sample(). The branch leaves EXC_RETURN in LR to return through.
+ */
+RAMFUNC __attribute__((naked)) void profile_timer_isr(void) {
+  __asm(
+    "TST LR, #4\n\t"
+    "ITE EQ\n\t"
+    "MRSEQ R0, MSP\n\t"
+    "MRSNE R0, PSP\n\t"
+    "B profile_sample\n\t"
+  );
+}
+
+
+/*
+ * Start sampling at hz, discarding any earlier samples.
+ */
+void profile_start(uint32_t hz) {
+  sample_count = 0;
+  sample_hz = hz;
+
+  SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER1);
+  TimerDisable(PROFILE_TIMER_BASE, TIMER_A);
+  TimerConfigure(PROFILE_TIMER_BASE, TIMER_CFG_32_BIT_PER);
+  TimerLoadSet(PROFILE_TIMER_BASE, TIMER_A, SysCtlClockGet() / hz);
+  TimerIntEnable(PROFILE_TIMER_BASE, TIMER_TIMA_TIMEOUT);
+  IntEnable(INT_TIMER1A);
+  TimerEnable(PROFILE_TIMER_BASE, TIMER_A);
+}
+
+
+/*
+ * Stop sampling. Must happen before booting the firmware, whose vector table
+ * starts out as a copy of ours and would otherwise keep calling in here.
+ */
+void profile_stop(void) {
+  TimerDisable(PROFILE_TIMER_BASE, TIMER_A);
+  TimerIntDisable(PROFILE_TIMER_BASE, TIMER_TIMA_TIMEOUT);
+  IntDisable(INT_TIMER1A);
+  TimerIntClear(PROFILE_TIMER_BASE, TIMER_TIMA_TIMEOUT);
+}
+
+
+static void write_hex(uint32_t uart, const unsigned char *buf, uint32_t len) {
+  static const char digits[] = "0123456789abcdef";
+
+  while (len--) {
+    uart_write(uart, digits[*buf >> 4]);
+    uart_write(uart, digits[*buf & 0xF]);
+    buf++;
+  }
+}
+
+
+static void write_hex_word(uint32_t uart, uint32_t word) {
+  unsigned char be[4] = { word >> 24, word >> 16, word >> 8, word };
+
+  uart_write_str(uart, "0x");
+  write_hex(uart, be, sizeof(be));
+}
+
+
+/*
+ * Write the samples out in the firmware's PROFILE DUMP format: a
+ * "PROFILE <count> <hz>" header, then the samples, oldest first, as
+ * "addr: hex" lines.
+ *
+ * Sampling is paused while the buffer is written out.
+ */
+void profile_dump(uint32_t uart) {
+  uint32_t count, len, done, start = 0;
+  const unsigned char *raw = (const unsigned char *) samples;
+
+  TimerDisable(PROFILE_TIMER_BASE, TIMER_A);
+  count = sample_count;
+  if (count > PROFILE_MAX_SAMPLES) {
+    // Wrapped: the oldest sample is the one to be overwritten next.
+    start = (count % PROFILE_MAX_SAMPLES) * sizeof(profile_sample_t);
+    count = PROFILE_MAX_SAMPLES;
+  }
+  len = count * sizeof(profile_sample_t);
+
+  uart_write_str(uart, "PROFILE ");
+  write_hex_word(uart, count);
+  uart_write_str(uart, " ");
+  write_hex_word(uart, sample_hz);
+  nl(uart);
+
+  for (done = 0; done < len; done += PROFILE_BYTES_PER_LINE) {
+    uint32_t offset = (start + done) % len;
+    uint32_t addr = (uint32_t) (raw + offset);
+    unsigned char be_addr[4] = { addr >> 24, addr >> 16, addr >> 8, addr };
+    uint32_t line = len - done < PROFILE_BYTES_PER_LINE ? len - done : PROFILE_BYTES_PER_LINE;
+    uint32_t before_wrap = len - offset < line ? len - offset : line;
+
+    write_hex(uart, be_addr, sizeof(be_addr));
+    uart_write_str(uart, ": ");
+    write_hex(uart, raw + offset, before_wrap);
+    write_hex(uart, raw, line - before_wrap);
+    nl(uart);
+  }
+  TimerEnable(PROFILE_TIMER_BASE, TIMER_A);
+}
@@ -58,6 +58,12 @@ static void IntDefaultHandler(void);
 //
 //******************************************************************************
 extern void UART0_IRQHandler(void);
+extern void SysTick_IRQHandler(void);
+#ifdef PROFILE
+extern void profile_timer_isr(void);
+#else
+#define profile_timer_isr IntDefaultHandler
+#endif
 
 
 
@@ -68,13 +74,15 @@ extern void UART0_IRQHandler(void);
 //
 //*****************************************************************************
 extern int main(void);
+extern void start_boot_timer(void);
 
 //*****************************************************************************
 //
-// Reserve space for the system stack.
+// The system stack is reserved at the top of SRAM by main.ld.
 //
 //*****************************************************************************
-static unsigned long pulStack[64];
+extern unsigned long _stack;
+extern unsigned long _estack;
 
 //*****************************************************************************
 //
@@ -85,7 +93,7 @@ static unsigned long pulStack[64];
 __attribute__ ((section(".isr_vector")))
 void (* const g_pfnVectors[])(void) =
 {
-    (void (*)(void))((unsigned long)pulStack + sizeof(pulStack)),
+    (void (*)(void))((unsigned long)&_estack),
                                             // The initial stack pointer
     ResetISR,                               // The reset handler
     NmiSR,                                  // The NMI handler
@@ -101,7 +109,7 @@ void (* const g_pfnVectors[])(void) =
     IntDefaultHandler,                      // Debug monitor handler
     0,                                      // Reserved
     IntDefaultHandler,                      // The PendSV handler
-    IntDefaultHandler,                      // The SysTick handler
+    SysTick_IRQHandler,                     // The SysTick handler
     IntDefaultHandler,                      // GPIO Port A
     IntDefaultHandler,                      // GPIO Port B
     IntDefaultHandler,                      // GPIO Port C
@@ -123,7 +131,7 @@ void (* const g_pfnVectors[])(void) =
     IntDefaultHandler,                      // Watchdog timer
     IntDefaultHandler,                      // Timer 0 subtimer A
     IntDefaultHandler,                      // Timer 0 subtimer B
-    IntDefaultHandler,                      // Timer 1 subtimer A
+    profile_timer_isr,                      // Timer 1 subtimer A
     IntDefaultHandler,                      // Timer 1 subtimer B
     IntDefaultHandler,                      // Timer 2 subtimer A
     IntDefaultHandler,                      // Timer 2 subtimer B
@@ -171,6 +179,9 @@ extern unsigned long _data;
 extern unsigned long _edata;
 extern unsigned long _bss;
 extern unsigned long _ebss;
+extern unsigned long _ramfunc;
+extern unsigned long _eramfunc;
+extern unsigned long _ramfunc_load;
 
 //*****************************************************************************
 //
@@ -187,6 +198,11 @@ ResetISR(void)
 {
     unsigned long *pulSrc, *pulDest;
 
+    //
+    // Start timing the boot, so the firmware can report its latency.
+    //
+    start_boot_timer();
+
     //
     // Copy the data segment initializers from flash to SRAM.
     //
@@ -196,6 +212,15 @@ ResetISR(void)
         *pulDest++ = *pulSrc++;
     }
 
+    //
+    // Copy the functions that execute from SRAM (the .ramfunc section).
+    //
+    pulSrc = &_ramfunc_load;
+    for(pulDest = &_ramfunc; pulDest < &_eramfunc; )
+    {
+        *pulDest++ = *pulSrc++;
+    }
+
     //
     // Zero fill the bss segment.
     //
@@ -209,6 +234,20 @@ ResetISR(void)
           "        strlt   r2, [r0], #4\n"
           "        blt     zero_loop");
 
+    //
+    // Paint the part of the stack below this frame with MEM_STACK_PAINT (see
+    // mem.h), so stack_high_water() can tell how deep it has grown.
+    //
+    __asm("    ldr     r0, =_stack\n"
+          "    mov     r1, sp\n"
+          "    ldr     r2, =0xC5C5C5C5\n"
+          "    .thumb_func\n"
+          "paint_loop:\n"
+          "        cmp     r0, r1\n"
+          "        it      lt\n"
+          "        strlt   r2, [r0], #4\n"
+          "        blt     paint_loop");
+
     //
     // Call the application's entry point.
     //
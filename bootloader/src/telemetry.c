@@ -0,0 +1,137 @@
+// Driver API Imports
+#include "driverlib/flash.h" // FLASH API
+
+// Library Imports
+#include "uart.h"
+
+// Application Imports
+#include "telemetry.h"
+#include "flashlog.h"
+#include "crc32.h"
+
+#include <string.h>
+
+
+// FLASH Constants
+#define FLASH_PAGESIZE 1024
+#define COUNTERS_BASE 0x3F400  // counters log, below the install log
+#define COUNTERS_ALT_BASE 0x3F000
+#define WEAR_BASE 0x3EC00  // erase count log
+#define WEAR_ALT_BASE 0x3E800
+#define WEAR_FIRST_PAGE (0xF800 / FLASH_PAGESIZE)  // metadata log, the lowest page ever erased
+
+#define COUNTER_WORDS (sizeof(telemetry_counters_t) / 4)
+#define WEAR_WORDS ((TELEMETRY_PAGES - WEAR_FIRST_PAGE) * 2 / 4)
+
+
+// Dump: format version (2), page count (2), the counters (4 each), the erase
+// counts (2 each), all little-endian, then a CRC-32 over all of it (4,
+// big-endian).
+#define DUMP_VERSION 1
+
+
+static const flashlog_t counters_log = {{COUNTERS_BASE, COUNTERS_ALT_BASE}, COUNTER_WORDS};
+static const flashlog_t wear_log = {{WEAR_BASE, WEAR_ALT_BASE}, WEAR_WORDS};
+
+telemetry_counters_t telemetry;
+
+// The erase count log only holds pages from WEAR_FIRST_PAGE up, the ones
+// below are the bootloader's own code, so a log page takes two records.
+static uint16_t erase_counts[TELEMETRY_PAGES] __attribute__((aligned(4)));
+#define LOGGED_COUNTS ((uint32_t *) &erase_counts[WEAR_FIRST_PAGE])
+
+// Copies of what is in flash, to tell whether a flush has anything to write.
+static telemetry_counters_t flushed;
+static int wear_dirty = 0;
+
+
+/*
+ * Read the counters and erase counts back from flash, starting from zero if
+ * there are none yet.
+ */
+void telemetry_load(void) {
+  if (flashlog_read_latest(&counters_log, (uint32_t *) &telemetry)) {
+    memset(&telemetry, 0, sizeof(telemetry));
+  }
+  memset(erase_counts, 0, sizeof(erase_counts));
+  flashlog_read_latest(&wear_log, LOGGED_COUNTS);  // stays zero if nothing is logged yet
+  flushed = telemetry;
+  wear_dirty = 0;
+}
+
+
+/*
+ * Erase a flash page, counting it against the page's wear.
+ *
+ * The erase count log only erases its own pages while appending, and the
+ * record it then writes already holds the new count, so those erases leave
+ * nothing to flush. Counting them as a change would make every flush erase
+ * another page of the log.
+ */
+long telemetry_erase(uint32_t page_addr) {
+  uint32_t page = page_addr / FLASH_PAGESIZE;
+
+  if (page < TELEMETRY_PAGES && erase_counts[page] != 0xFFFF) {
+    erase_counts[page]++;
+    if (page_addr != WEAR_BASE && page_addr != WEAR_ALT_BASE) {
+      wear_dirty = 1;
+    }
+  }
+  return FlashErase(page_addr);
+}
+
+
+/*
+ * Append whatever changed since the last flush to its log.
+ *
+ * Called at the end of every update and before booting the firmware, rather
+ * than on every change, so the logs' own pages wear slowly: a page of the
+ * counters log takes 15 records, one of the erase count log two. A boot
+ * that changed nothing but boot_count only appends to the counters log.
+ */
+long telemetry_flush(void) {
+  long status = 0;
+
+  if (memcmp(&telemetry, &flushed, sizeof(telemetry))) {
+    status = flashlog_append(&counters_log, (const uint32_t *) &telemetry);
+    if (status == 0) {
+      flushed = telemetry;
+    }
+  }
+  if (wear_dirty && status == 0) {
+    status = flashlog_append(&wear_log, LOGGED_COUNTS);
+    if (status == 0) {
+      wear_dirty = 0;
+    }
+  }
+  return status;
+}
+
+
+static uint32_t dump_bytes(uint32_t uart, uint32_t crc, const void *buf, uint32_t len) {
+  const unsigned char *bytes = buf;
+
+  for (uint32_t i = 0; i < len; i++) {
+    uart_write(uart, bytes[i]);
+  }
+  return crc32_update(crc, bytes, len);
+}
+
+
+/*
+ * Send the counters and erase counts as one binary record, for
+ * tools/fw_telemetry.py to collect. The Cortex-M3 is little-endian, so the
+ * SRAM copies go out as they are.
+ */
+void telemetry_dump(uint32_t uart) {
+  uint16_t header[2] = {DUMP_VERSION, TELEMETRY_PAGES};
+  uint32_t crc = 0;
+
+  crc = dump_bytes(uart, crc, header, sizeof(header));
+  crc = dump_bytes(uart, crc, &telemetry, sizeof(telemetry));
+  crc = dump_bytes(uart, crc, erase_counts, sizeof(erase_counts));
+  uart_write(uart, crc >> 24);
+  uart_write(uart, crc >> 16);
+  uart_write(uart, crc >> 8);
+  uart_write(uart, crc);
+}
@@ -1,10 +1,17 @@
 #include <string.h>
 
+#include "inc/hw_types.h"
+#include "inc/hw_memmap.h"
+#include "driverlib/timer.h"
+
 #define VERSION_2
 #include "usart.h"
 #include "uart.h"
 #include "util.h"
 #include "mitre_car.h"
+#include "sched.h"
+#include "dump.h"
+#include "diag.h"
 
 static const char *FLAG_RESPONSE = "Nice try.";
 
@@ -13,14 +20,27 @@ void getFlag(char *flag)
     flag = strcpy(flag, FLAG_RESPONSE);
 }
 
-int main(void) __attribute__((section(".text.main")));
-int main (void)
+static int shell_task;
+
+RAMFUNC static void signalShell(void)
 {
-    printBanner();
-    for(;;) // Loop forever.
+    schedSignal(shell_task);
+}
+
+// Handle every command typed since the last run. Lines the receive ring had
+// no room for are lost, and count as the shell's overruns.
+static void shellTask(void)
+{
+    static unsigned int dropped = 0;
+    unsigned int now_dropped = droppedLines();
+    char buff[256];
+    int len;
+
+    schedOverrun(shell_task, now_dropped - dropped);
+    dropped = now_dropped;
+
+    while((len = pollPrompt(buff, 256)) >= 0)
     {
-        char buff[256];
-        int len = prompt(buff, 256);
         if(buff[0] != '\0' && strncmp(buff, "FLAG", len) == 0)
         {
             getFlag(buff);
@@ -28,3 +48,23 @@ int main (void)
         }
     }
 }
+
+int main(void) __attribute__((section(".text.main")));
+int main (void)
+{
+    // The bootloader starts TIMER0 counting down from 0xFFFFFFFF at reset.
+    unsigned long boot_cycles = 0xFFFFFFFF - TimerValueGet(TIMER0_BASE, TIMER_A);
+
+    initializeUSART();
+    schedInit();
+
+    shell_task = schedAddEvent("shell", shellTask);
+    schedAddPeriodic("dump", DUMP_POLL_MS, dumpTask);
+    schedAddPeriodic("diag", DIAG_POLL_MS, diagTask);
+    setLineCallback(signalShell);
+
+    printBanner();
+    printBootTime(boot_cycles);
+    schedSignal(shell_task); // Show the first prompt.
+    schedRun();
+}
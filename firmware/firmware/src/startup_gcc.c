@@ -0,0 +1,109 @@
+//*****************************************************************************
+//
+// startup_gcc.c - Startup code for the firmware image.
+//
+// The bootloader hands control to the firmware by branching to the first
+// instruction of the image (FW_BASE), still running on the bootloader's stack
+// and without initializing any of the firmware's RAM.  The firmware's .data and
+// .bss overlap the bootloader's, so before main() touches a single global the
+// stack is moved to the top of SRAM and the data and bss segments are set up
+// here.
+//
+//*****************************************************************************
+
+//*****************************************************************************
+//
+// The entry point for the application.
+//
+//*****************************************************************************
+extern int main(void);
+
+//*****************************************************************************
+//
+// The following are constructs created by the linker, indicating where the
+// the "data", "ramfunc" and "bss" segments reside in memory, and where the
+// stack begins.  The initializers for the "data" segment resides immediately
+// following the "text" segment, followed by the "ramfunc" code.
+//
+//*****************************************************************************
+extern unsigned long _etext;
+extern unsigned long _data;
+extern unsigned long _edata;
+extern unsigned long _bss;
+extern unsigned long _ebss;
+extern unsigned long _estack;
+extern unsigned long _ramfunc;
+extern unsigned long _eramfunc;
+extern unsigned long _ramfunc_load;
+
+void ResetISR(void) __attribute__((naked, section(".text.entry")));
+void FirmwareInit(void) __attribute__((noreturn));
+
+//*****************************************************************************
+//
+// This is the first instruction of the firmware image.  Nothing here may use
+// the stack, so it only paints the firmware's own stack with MEM_STACK_PAINT
+// (see mem.h), switches to it and continues in FirmwareInit().
+//
+//*****************************************************************************
+void
+ResetISR(void)
+{
+    __asm("    ldr     r0, =_stack\n"
+          "    ldr     r1, =_estack\n"
+          "    ldr     r2, =0xC5C5C5C5\n"
+          "paint_loop:\n"
+          "    cmp     r0, r1\n"
+          "    it      lt\n"
+          "    strlt   r2, [r0], #4\n"
+          "    blt     paint_loop\n"
+          "    mov     sp, r1\n"
+          "    b       FirmwareInit");
+}
+
+//*****************************************************************************
+//
+// Copy the data segment initializers and the SRAM resident code from flash to
+// SRAM, zero fill the bss segment and call the application's entry point.
+//
+//*****************************************************************************
+void
+FirmwareInit(void)
+{
+    unsigned long *pulSrc, *pulDest;
+
+    //
+    // Copy the data segment initializers from flash to SRAM.
+    //
+    pulSrc = &_etext;
+    for(pulDest = &_data; pulDest < &_edata; )
+    {
+        *pulDest++ = *pulSrc++;
+    }
+
+    //
+    // Copy the functions that execute from SRAM (the .ramfunc section).
+    //
+    pulSrc = &_ramfunc_load;
+    for(pulDest = &_ramfunc; pulDest < &_eramfunc; )
+    {
+        *pulDest++ = *pulSrc++;
+    }
+
+    //
+    // Zero fill the bss segment.
+    //
+    for(pulDest = &_bss; pulDest < &_ebss; )
+    {
+        *pulDest++ = 0;
+    }
+
+    //
+    // Call the application's entry point.
+    //
+    main();
+
+    while(1)
+    {
+    }
+}
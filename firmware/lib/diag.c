@@ -0,0 +1,51 @@
+#include "inc/hw_types.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_uart.h"
+
+#include "diag.h"
+#include "mem.h"
+#include "usart.h"
+#include "util.h"
+
+// Stack bounds from firmware.ld.
+extern unsigned long _stack, _estack;
+
+static unsigned long rx_errors;       // Polls that found UART2 error flags set.
+static unsigned long reported_errors;
+static int stack_warned;
+
+static void warnCount(const char *what, unsigned long count, const char *unit)
+{
+    char number[11];
+
+    writeConst("Warning: ");
+    writeConst(what);
+    uint2str(count, number);
+    write(number);
+    writeLineConst(unit);
+}
+
+// Look for trouble nothing else notices and report it on the console once:
+// receive errors on UART2, which the receive interrupt reads past, and the
+// stack getting close to its limit.
+void diagTask(void)
+{
+    unsigned long stack_size = (unsigned long)&_estack - (unsigned long)&_stack;
+
+    if(HWREG(UART2_BASE + UART_O_RSR) & (UART_RSR_OE | UART_RSR_BE | UART_RSR_PE | UART_RSR_FE))
+    {
+        HWREG(UART2_BASE + UART_O_ECR) = 0;
+        rx_errors++;
+    }
+    if(rx_errors != reported_errors)
+    {
+        warnCount("UART2 receive errors, ", rx_errors, " so far");
+        reported_errors = rx_errors;
+    }
+
+    if(!stack_warned && stackHighWater() * 100 > stack_size * DIAG_STACK_WARN_PERCENT)
+    {
+        warnCount("stack has reached ", stackHighWater(), " bytes");
+        stack_warned = 1;
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#define DIAG_POLL_MS 100
+
+// Warn once the stack has been this deep, in percent of its size.
+#define DIAG_STACK_WARN_PERCENT 75
+
+void diagTask(void);
+
+#endif
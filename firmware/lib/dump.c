@@ -0,0 +1,156 @@
+#include "dump.h"
+#include "usart.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Worst case chunk: one "aaaaaaaa: " prefix and newline per line of hex.
+#define DUMP_BUFFER_SIZE (DUMP_LINES_PER_CHUNK * (8 + 2 + HEX_ENCODED_LEN(DUMP_BYTES_PER_LINE) + 1))
+
+// Memory is converted one chunk at a time into one half of a double buffer
+// while the other half is still being transmitted straight from the buffer.
+static char dump_buffer[2][DUMP_BUFFER_SIZE];
+static unsigned int dump_ticket[2];
+static int dump_current;
+
+static const unsigned char *dump_next;
+static unsigned long dump_remaining;
+static int dump_active;
+static codec_stream_t dump_stream;
+
+static int isDumpable(unsigned long addr, unsigned long len)
+{
+    if(len == 0)
+    {
+        return 0;
+    }
+    if(addr - DUMP_FLASH_BASE < DUMP_FLASH_SIZE)
+    {
+        return len <= DUMP_FLASH_BASE + DUMP_FLASH_SIZE - addr;
+    }
+    if(addr - DUMP_SRAM_BASE < DUMP_SRAM_SIZE)
+    {
+        return len <= DUMP_SRAM_BASE + DUMP_SRAM_SIZE - addr;
+    }
+    return 0;
+}
+
+// "DUMP <addr> <len> [HEX|B64]"; numbers may be decimal or 0x-prefixed.
+void dumpCommand(char *args)
+{
+    char *end;
+    unsigned long addr, len;
+    codec_format_t format = CODEC_HEX;
+
+    addr = strtoul(args, &end, 0);
+    if(end == args)
+    {
+        writeLineConst("Usage: DUMP <addr> <len> [HEX|B64]");
+        return;
+    }
+    args = end;
+    len = strtoul(args, &end, 0);
+    if(end == args)
+    {
+        writeLineConst("Usage: DUMP <addr> <len> [HEX|B64]");
+        return;
+    }
+    while(*end == ' ')
+    {
+        end++;
+    }
+    if(strcmp(end, "B64") == 0)
+    {
+        format = CODEC_BASE64;
+    }
+    else if(*end != '\0' && strcmp(end, "HEX") != 0)
+    {
+        writeLineConst("Unknown format. Use HEX or B64.");
+        return;
+    }
+
+    dumpStart(addr, len, format);
+}
+
+// Queue a dump for dumpTask() to stream out. Returns -1, after saying why,
+// if another dump is still running or the range is not readable.
+int dumpStart(unsigned long addr, unsigned long len, codec_format_t format)
+{
+    if(dump_active)
+    {
+        writeLineConst("A dump is already running.");
+        return -1;
+    }
+    if(!isDumpable(addr, len))
+    {
+        writeLineConst("Address range is outside flash and SRAM.");
+        return -1;
+    }
+
+    dump_next = (const unsigned char *)addr;
+    dump_remaining = len;
+    codecStreamInit(&dump_stream, format);
+    // An empty write yields a ticket that already counts as sent.
+    dump_ticket[0] = dump_ticket[1] = writeRef(dump_buffer[0], 0);
+    dump_current = 0;
+    dump_active = 1;
+    return 0;
+}
+
+// Hex chunks carry the address of each line; base64 is one continuous
+// stream broken into lines.
+static int fillChunk(char *out)
+{
+    unsigned long len = dump_remaining < DUMP_CHUNK_SIZE ? dump_remaining : DUMP_CHUNK_SIZE;
+    int n = 0;
+
+    if(dump_stream.format == CODEC_HEX)
+    {
+        unsigned long done;
+        for(done = 0; done < len; done += DUMP_BYTES_PER_LINE)
+        {
+            unsigned long addr = (unsigned long)(dump_next + done);
+            unsigned char be_addr[4] = { addr >> 24, addr >> 16, addr >> 8, addr };
+            unsigned long line = len - done < DUMP_BYTES_PER_LINE ? len - done : DUMP_BYTES_PER_LINE;
+
+            n += hexEncode(be_addr, 4, out + n);
+            out[n++] = ':';
+            out[n++] = ' ';
+            n += codecStreamUpdate(&dump_stream, dump_next + done, line, out + n);
+            out[n++] = '\n';
+        }
+    }
+    else
+    {
+        n += codecStreamUpdate(&dump_stream, dump_next, len, out + n);
+        if(len == dump_remaining)
+        {
+            n += codecStreamFinal(&dump_stream, out + n);
+        }
+        out[n++] = '\n';
+    }
+
+    dump_next += len;
+    dump_remaining -= len;
+    return n;
+}
+
+// Periodic task: refill whichever half of the buffer the UART has finished
+// with. Never waits on the wire, so the rest of the system keeps running.
+void dumpTask(void)
+{
+    while(dump_active && writeDone(dump_ticket[dump_current]))
+    {
+        char *out = dump_buffer[dump_current];
+        int n = fillChunk(out);
+
+        dump_ticket[dump_current] = writeRef(out, n);
+        dump_current ^= 1;
+
+        if(dump_remaining == 0)
+        {
+            dump_active = 0;
+        }
+    }
+}
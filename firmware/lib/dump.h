@@ -0,0 +1,22 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include "util.h"
+
+// Memory that DUMP may read. Everything else is rejected rather than risking
+// a bus fault on unmapped addresses.
+#define DUMP_FLASH_BASE 0x00000000
+#define DUMP_FLASH_SIZE 0x00040000
+#define DUMP_SRAM_BASE 0x20000000
+#define DUMP_SRAM_SIZE 0x00010000
+
+#define DUMP_BYTES_PER_LINE 32
+#define DUMP_LINES_PER_CHUNK 6
+#define DUMP_CHUNK_SIZE (DUMP_BYTES_PER_LINE * DUMP_LINES_PER_CHUNK)
+#define DUMP_POLL_MS 5
+
+void dumpCommand(char *args);
+int dumpStart(unsigned long addr, unsigned long len, codec_format_t format);
+void dumpTask(void);
+
+#endif
\ No newline at end of file
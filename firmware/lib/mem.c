@@ -0,0 +1,52 @@
+#include "mem.h"
+#include "usart.h"
+#include "util.h"
+
+// Section boundaries from firmware.ld.
+extern unsigned long _data, _edata;
+extern unsigned long _ramfunc, _eramfunc;
+extern unsigned long _bss, _ebss;
+extern unsigned long _stack, _estack;
+
+// Deepest the stack has been since reset, in bytes. The stack grows down from
+// _estack, so the first word from the bottom that lost its paint marks it.
+unsigned long stackHighWater(void)
+{
+    unsigned long *word = &_stack;
+
+    while(word < &_estack && *word == MEM_STACK_PAINT)
+    {
+        word++;
+    }
+    return (unsigned long)&_estack - (unsigned long)word;
+}
+
+static void printRegion(const char *name, unsigned long bytes)
+{
+    char number[11];
+
+    writeConst(name);
+    uint2str(bytes, number);
+    write(number);
+    writeLineConst(" bytes");
+}
+
+// SRAM layout from the bottom up. Nothing allocates from a heap, so the gap
+// between .bss and the stack is simply unused.
+void printMemory(void)
+{
+    char number[11];
+
+    printRegion(".data      ", (unsigned long)&_edata - (unsigned long)&_data);
+    printRegion(".ramfunc   ", (unsigned long)&_eramfunc - (unsigned long)&_ramfunc);
+    printRegion(".bss       ", (unsigned long)&_ebss - (unsigned long)&_bss);
+    printRegion("unused     ", (unsigned long)&_stack - (unsigned long)&_ebss);
+
+    writeConst("stack      ");
+    uint2str(stackHighWater(), number);
+    write(number);
+    writeConst(" of ");
+    uint2str((unsigned long)&_estack - (unsigned long)&_stack, number);
+    write(number);
+    writeLineConst(" bytes used at most");
+}
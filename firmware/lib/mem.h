@@ -0,0 +1,10 @@
+#ifndef MEM_H
+#define MEM_H
+
+// Pattern ResetISR() fills the stack with; keep in sync with startup_gcc.c.
+#define MEM_STACK_PAINT 0xC5C5C5C5
+
+unsigned long stackHighWater(void);
+void printMemory(void);
+
+#endif
@@ -1,4 +1,13 @@
+#include "inc/hw_types.h"
+#include "driverlib/sysctl.h"
+
 #include "mitre_car.h"
+#include "usart.h"
+#include "sched.h"
+#include "dump.h"
+#include "profile.h"
+#include "mem.h"
+#include "util.h"
 #include "uart.h"
 
 #include <string.h>
@@ -31,50 +40,103 @@ static const char *HELP_TEXT =
     " * SAFETY - Query safety system status\n"
     " * INFOTAINMENT - Query information/entertainment system status\n"
     " * SECURITY - Query cybersecurity system status\n"
+    " * TASKS - Show scheduler task statistics\n"
+    " * MEM - Show SRAM use and the stack high-water mark\n"
+    " * DUMP <addr> <len> [HEX|B64] - Read out flash or SRAM\n"
+    " * PROFILE [START [hz]|STOP|DUMP] - Sample where the CPU spends its time\n"
     " * FLAG - ???\n"
     "\n";
 
 void printBanner()
 {
-    write(STARTUP_BANNER);
+    writeConst(STARTUP_BANNER);
+}
+
+void printBootTime(unsigned long cycles)
+{
+    char number[11];
+    unsigned long cycles_per_us = SysCtlClockGet() / 1000000;
+
+    uint2str(cycles / (cycles_per_us ? cycles_per_us : 1), number);
+    writeConst("Reset to main(): ");
+    write(number);
+    writeLineConst(" us");
 }
 
 int prompt(char* buffer, int max_bytes)
 {
-    write("->");
+    writeConst("->");
     int len = readLine(buffer, max_bytes);
     parseCommand(buffer, len);
 
     return len;
 }
 
+int pollPrompt(char* buffer, int max_bytes)
+{
+    static int prompted = 0;
+
+    if(!prompted)
+    {
+        writeConst("->");
+        prompted = 1;
+    }
+
+    int len = pollLine(buffer, max_bytes);
+    if(len < 0)
+    {
+        return -1; // Nothing typed yet.
+    }
+
+    prompted = 0;
+    parseCommand(buffer, len);
+
+    return len;
+}
+
 void parseCommand(char* buffer, int len)
 {
-    if(strncmp(buffer, "HELP", len) == 0)
+    if(strncmp(buffer, "DUMP ", 5) == 0)
+    {
+        dumpCommand(buffer + 5);
+    }
+    else if(strncmp(buffer, "PROFILE", 7) == 0 && (buffer[7] == ' ' || buffer[7] == '\0'))
     {
-        write(HELP_TEXT);
+        profileCommand(buffer + 7);
+    }
+    else if(strncmp(buffer, "HELP", len) == 0)
+    {
+        writeConst(HELP_TEXT);
     }
     else if(strncmp(buffer, "EMISSIONS", len) == 0)
     {
-        writeLine("Now that you mention it, the smoke usually isn't that color...");
+        writeLineConst("Now that you mention it, the smoke usually isn't that color...");
     }
     else if(strncmp(buffer, "SAFETY", len) == 0)
     {
-        writeLine("System normal.");
+        writeLineConst("System normal.");
     }
     else if(strncmp(buffer, "INFOTAINMENT", len) == 0)
     {
-        writeLine("Playing video: https://www.youtube.com/watch?v=dQw4w9WgXcQ");
+        writeLineConst("Playing video: https://www.youtube.com/watch?v=dQw4w9WgXcQ");
     }
     else if(strncmp(buffer, "SECURITY", len) == 0)
     {
-        writeLine("No viruses detected. Signatures last updated 1/1/1970.\n"
-                  "Firewall disabled because it stops the airbags from "
-                  "deploying.");
+        writeLineConst("No viruses detected. Signatures last updated 1/1/1970.\n"
+                       "Firewall disabled because it stops the airbags from "
+                       "deploying.");
+    }
+    else if(strncmp(buffer, "TASKS", len) == 0)
+    {
+        printTasks();
+    }
+    else if(strncmp(buffer, "MEM", len) == 0)
+    {
+        printMemory();
     }
     else if(strncmp(buffer, "FLAG", len) == 0);
     else
     {
-        writeLine("Command not recognized. Use \"HELP\" for a listing.");
+        writeLineConst("Command not recognized. Use \"HELP\" for a listing.");
     }
 }
@@ -1,3 +1,5 @@
 void printBanner(void);
+void printBootTime(unsigned long cycles);
 void parseCommand(char* buffer, int len);
 int prompt(char* buffer, int max_bytes);
+int pollPrompt(char* buffer, int max_bytes);
@@ -0,0 +1,204 @@
+#include "inc/hw_types.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_ints.h"
+#include "inc/hw_timer.h"
+#include "driverlib/interrupt.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/timer.h"
+
+#include "profile.h"
+#include "dump.h"
+#include "usart.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The PC and LR stacked on exception entry. LR names the caller only when the
+// interrupted function has not reused it, which is reliable for leaf code.
+typedef struct
+{
+    unsigned long pc;
+    unsigned long lr;
+} profile_sample_t;
+
+// A ring that keeps the newest samples once it fills up.
+static profile_sample_t samples[PROFILE_MAX_SAMPLES];
+static volatile unsigned long sample_count; // Samples taken since the start.
+static unsigned long sample_hz;
+static int profiling;
+static int samples_in_order; // Ring rotated oldest-first by dumpSamples().
+
+// Called with the exception frame the timer interrupt pushed. The handler
+// shares its priority with the UART and SysTick handlers, so time spent in
+// those is charged to wherever they return to.
+RAMFUNC __attribute__((used)) void profileSample(unsigned long *frame)
+{
+    profile_sample_t *sample = &samples[sample_count % PROFILE_MAX_SAMPLES];
+
+    HWREG(TIMER1_BASE + TIMER_O_ICR) = TIMER_TIMA_TIMEOUT;
+    sample->pc = frame[6];
+    sample->lr = frame[5];
+    sample_count++;
+}
+
+// The frame is on whichever stack was in use when the interrupt hit. Branching
+// rather than calling leaves EXC_RETURN in LR for profileSample() to return
+// through.
+RAMFUNC __attribute__((naked)) void Timer1A_IRQHandler(void)
+{
+    __asm("    tst     lr, #4\n"
+          "    ite     eq\n"
+          "    mrseq   r0, msp\n"
+          "    mrsne   r0, psp\n"
+          "    b       profileSample\n");
+}
+
+void profileStart(unsigned long hz)
+{
+    profileStop();
+
+    sample_count = 0;
+    sample_hz = hz;
+    samples_in_order = 0;
+
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER1);
+    TimerConfigure(TIMER1_BASE, TIMER_CFG_32_BIT_PER);
+    TimerLoadSet(TIMER1_BASE, TIMER_A, SysCtlClockGet() / hz);
+    IntRegister(INT_TIMER1A, Timer1A_IRQHandler);
+    TimerIntEnable(TIMER1_BASE, TIMER_TIMA_TIMEOUT);
+    IntEnable(INT_TIMER1A);
+    TimerEnable(TIMER1_BASE, TIMER_A);
+    profiling = 1;
+}
+
+void profileStop(void)
+{
+    if(!profiling)
+    {
+        return;
+    }
+
+    TimerDisable(TIMER1_BASE, TIMER_A);
+    IntDisable(INT_TIMER1A);
+    TimerIntClear(TIMER1_BASE, TIMER_TIMA_TIMEOUT);
+    profiling = 0;
+}
+
+static void printStatus(void)
+{
+    char number[11];
+
+    if(sample_hz == 0)
+    {
+        writeLineConst("Not profiling.");
+        return;
+    }
+
+    writeConst(profiling ? "Profiling at " : "Stopped at ");
+    uint2str(sample_hz, number);
+    write(number);
+    writeConst(" Hz, ");
+    uint2str(sample_count, number);
+    write(number);
+    writeLineConst(" samples taken.");
+}
+
+static void reverseSamples(unsigned long from, unsigned long to)
+{
+    while(from + 1 < to)
+    {
+        profile_sample_t sample = samples[from];
+        samples[from++] = samples[--to];
+        samples[to] = sample;
+    }
+}
+
+// Once the ring has wrapped, the oldest sample sits at the write index. Rotate
+// it to the front, in place, so the dump below reads oldest to newest.
+static void orderSamples(void)
+{
+    unsigned long oldest = sample_count % PROFILE_MAX_SAMPLES;
+
+    if(sample_count <= PROFILE_MAX_SAMPLES || samples_in_order)
+    {
+        return;
+    }
+    reverseSamples(0, oldest);
+    reverseSamples(oldest, PROFILE_MAX_SAMPLES);
+    reverseSamples(0, PROFILE_MAX_SAMPLES);
+    samples_in_order = 1;
+}
+
+// The header tells tools/fw_profile.py how many samples follow and at what rate
+// they were taken; the samples themselves go out as an ordinary hex DUMP.
+static void dumpSamples(void)
+{
+    char number[11];
+    unsigned long count = sample_count;
+
+    if(count > PROFILE_MAX_SAMPLES)
+    {
+        count = PROFILE_MAX_SAMPLES;
+    }
+    if(count == 0)
+    {
+        writeLineConst("No samples taken.");
+        return;
+    }
+
+    orderSamples();
+    writeConst("PROFILE ");
+    uint2str(count, number);
+    write(number);
+    writeConst(" ");
+    uint2str(sample_hz, number);
+    writeLine(number);
+    dumpStart((unsigned long)samples, count * sizeof(profile_sample_t), CODEC_HEX);
+}
+
+// "PROFILE [START [hz]|STOP|DUMP]"; DUMP stops sampling so the buffer holds
+// still while it is streamed out.
+void profileCommand(char *args)
+{
+    while(*args == ' ')
+    {
+        args++;
+    }
+
+    if(strncmp(args, "START", 5) == 0)
+    {
+        char *end;
+        unsigned long hz = strtoul(args + 5, &end, 0);
+
+        if(end == args + 5)
+        {
+            hz = PROFILE_DEFAULT_HZ;
+        }
+        if(hz == 0 || hz > PROFILE_MAX_HZ)
+        {
+            writeLineConst("Rate must be between 1 and 20000 Hz.");
+            return;
+        }
+        profileStart(hz);
+        printStatus();
+    }
+    else if(strcmp(args, "STOP") == 0)
+    {
+        profileStop();
+        printStatus();
+    }
+    else if(strcmp(args, "DUMP") == 0)
+    {
+        profileStop();
+        dumpSamples();
+    }
+    else if(*args == '\0')
+    {
+        printStatus();
+    }
+    else
+    {
+        writeLineConst("Usage: PROFILE [START [hz]|STOP|DUMP]");
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "ramfunc.h"
+
+// Statistical profiler. TIMER1 interrupts at a fixed rate and records where
+// the interrupted code was; tools/fw_profile.py symbolizes the dump. The default
+// rate is prime so it does not lock onto work released by the 1kHz SysTick.
+#define PROFILE_DEFAULT_HZ 997
+#define PROFILE_MAX_HZ 20000
+#define PROFILE_MAX_SAMPLES 512
+
+void profileCommand(char *args);
+void profileStart(unsigned long hz);
+void profileStop(void);
+RAMFUNC void Timer1A_IRQHandler(void);
+
+#endif
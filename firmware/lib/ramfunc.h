@@ -0,0 +1,8 @@
+#ifndef RAMFUNC_H
+#define RAMFUNC_H
+
+// Run a function from SRAM. The firmware's startup code copies the .ramfunc
+// section there; long_call because SRAM is out of BL range from flash.
+#define RAMFUNC __attribute__((section(".ramfunc"), long_call, noinline))
+
+#endif
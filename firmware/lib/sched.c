@@ -0,0 +1,286 @@
+#include "inc/hw_types.h"
+#include "driverlib/cpu.h"
+#include "driverlib/interrupt.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/systick.h"
+
+#include "sched.h"
+#include "usart.h"
+#include "util.h"
+
+#include <string.h>
+
+// A cooperative, run-to-completion scheduler. Handlers are called from
+// schedRun() only, never from interrupt context, so they may use anything the
+// main loop could. Interrupt handlers hand work over with schedSignal().
+typedef struct
+{
+    const char *name;
+    task_handler_t handler;
+    unsigned long period;            // In ticks, SCHED_EVENT for event tasks.
+    unsigned long next_release;      // Tick of the next periodic release.
+    volatile unsigned long signals;  // Incremented by schedSignal().
+    unsigned long handled;           // Signals consumed by the task.
+    unsigned long runs;
+    unsigned long worst_cycles;
+    unsigned long overruns;
+} task_t;
+
+static task_t tasks[SCHED_MAX_TASKS];
+static int task_count;
+
+static volatile unsigned long ticks;
+static unsigned long cycles_per_tick;
+static unsigned long cycles_per_us;
+static unsigned long long idle_cycles; // Spent asleep in schedIdle().
+
+void SysTick_IRQHandler(void)
+{
+    ticks++;
+}
+
+unsigned long schedTicks(void)
+{
+    return ticks;
+}
+
+// Free-running cycle count, built from the tick count and the SysTick down
+// counter. Wraps every 2^32 cycles, which is fine for measuring differences.
+unsigned long schedCycles(void)
+{
+    unsigned long t, value;
+
+    do
+    {
+        t = ticks;
+        value = SysTickValueGet();
+    } while(t != ticks);
+
+    return t * cycles_per_tick + (cycles_per_tick - 1 - value);
+}
+
+void schedInit(void)
+{
+    task_count = 0;
+    ticks = 0;
+    idle_cycles = 0;
+
+    cycles_per_tick = SysCtlClockGet() / SCHED_TICK_HZ;
+    cycles_per_us = SysCtlClockGet() / 1000000;
+    if(cycles_per_us == 0)
+    {
+        cycles_per_us = 1;
+    }
+
+    SysTickPeriodSet(cycles_per_tick);
+    SysTickIntRegister(SysTick_IRQHandler);
+    SysTickIntEnable();
+    SysTickEnable();
+    IntMasterEnable();
+}
+
+static int addTask(const char *name, unsigned long period, task_handler_t handler)
+{
+    if(task_count == SCHED_MAX_TASKS)
+    {
+        return -1;
+    }
+
+    task_t *task = &tasks[task_count];
+    memset(task, 0, sizeof(*task));
+    task->name = name;
+    task->handler = handler;
+    task->period = period;
+    task->next_release = ticks + period;
+
+    return task_count++;
+}
+
+int schedAddPeriodic(const char *name, unsigned long period_ms, task_handler_t handler)
+{
+    unsigned long period = period_ms * SCHED_TICK_HZ / 1000;
+
+    return addTask(name, period ? period : 1, handler);
+}
+
+int schedAddEvent(const char *name, task_handler_t handler)
+{
+    return addTask(name, SCHED_EVENT, handler);
+}
+
+// Safe to call from interrupt context. Signals that arrive while the task is
+// still pending are coalesced into a single run, so an event task has to
+// handle all the work pending when it runs. That alone loses nothing; a task
+// that finds work was lost reports it with schedOverrun().
+RAMFUNC void schedSignal(int task)
+{
+    if(task >= 0 && task < task_count)
+    {
+        tasks[task].signals++;
+    }
+}
+
+// Count work lost before task got to it as overruns. Main loop only.
+void schedOverrun(int task, unsigned long count)
+{
+    if(task >= 0 && task < task_count)
+    {
+        tasks[task].overruns += count;
+    }
+}
+
+static void runTask(task_t *task)
+{
+    unsigned long start = schedCycles();
+    task->handler();
+    unsigned long elapsed = schedCycles() - start;
+
+    task->runs++;
+    if(elapsed > task->worst_cycles)
+    {
+        task->worst_cycles = elapsed;
+    }
+    if(task->period != SCHED_EVENT && elapsed > task->period * cycles_per_tick)
+    {
+        task->overruns++;
+    }
+}
+
+static int isReady(task_t *task)
+{
+    if(task->period == SCHED_EVENT)
+    {
+        unsigned long signals = task->signals;
+        if(signals == task->handled)
+        {
+            return 0;
+        }
+        task->handled = signals;
+        return 1;
+    }
+
+    unsigned long now = ticks;
+    if((long)(now - task->next_release) < 0)
+    {
+        return 0;
+    }
+
+    task->next_release += task->period;
+    if((long)(now - task->next_release) >= 0)
+    {
+        // A whole period was missed; skip the lost releases instead of
+        // running the task back to back to catch up.
+        task->overruns += (now - task->next_release) / task->period + 1;
+        task->next_release = now + task->period;
+    }
+    return 1;
+}
+
+// Like isReady(), but without consuming the release.
+static int anyReady(void)
+{
+    int i;
+    for(i = 0; i < task_count; ++i)
+    {
+        task_t *task = &tasks[i];
+        if(task->period == SCHED_EVENT ? task->signals != task->handled
+                                       : (long)(ticks - task->next_release) >= 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Sleep until the next interrupt. Call with interrupts disabled after finding
+// nothing to do, so an interrupt that arrives in between still ends the
+// sleep; returns with interrupts enabled, once that interrupt has been served.
+void schedIdle(void)
+{
+    unsigned long start = schedCycles();
+
+    CPUwfi();
+    IntMasterEnable();
+    idle_cycles += schedCycles() - start;
+}
+
+// Share of the time since schedInit() spent in schedIdle().
+unsigned long schedIdlePercent(void)
+{
+    unsigned long long total = (unsigned long long)ticks * cycles_per_tick;
+
+    return total ? idle_cycles * 100 / total : 0;
+}
+
+void schedRun(void)
+{
+    for(;;) // Loop forever.
+    {
+        int i;
+        for(i = 0; i < task_count; ++i)
+        {
+            if(isReady(&tasks[i]))
+            {
+                runTask(&tasks[i]);
+            }
+        }
+
+        // Sleep until an interrupt signals a task or the next tick releases
+        // one.
+        IntMasterDisable();
+        if(anyReady())
+        {
+            IntMasterEnable();
+        }
+        else
+        {
+            schedIdle();
+        }
+    }
+}
+
+static void writeColumn(const char *text, int width)
+{
+    static const char SPACES[] = "              ";
+    int len = strlen(text);
+
+    write(text);
+    if(len < width)
+    {
+        writeBytes(SPACES, width - len);
+    }
+}
+
+void printTasks(void)
+{
+    char number[11];
+    int i;
+
+    writeLineConst("Task          Period(ms)  Runs        WCET(us)    Overruns");
+    for(i = 0; i < task_count; ++i)
+    {
+        task_t *task = &tasks[i];
+
+        writeColumn(task->name, 14);
+        if(task->period == SCHED_EVENT)
+        {
+            writeColumn("event", 12);
+        }
+        else
+        {
+            uint2str(task->period * 1000 / SCHED_TICK_HZ, number);
+            writeColumn(number, 12);
+        }
+        uint2str(task->runs, number);
+        writeColumn(number, 12);
+        uint2str(task->worst_cycles / cycles_per_us, number);
+        writeColumn(number, 12);
+        uint2str(task->overruns, number);
+        writeLine(number);
+    }
+
+    writeConst("Idle: ");
+    uint2str(schedIdlePercent(), number);
+    write(number);
+    writeLineConst("%");
+}
@@ -0,0 +1,25 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "ramfunc.h"
+
+#define SCHED_TICK_HZ 1000
+#define SCHED_MAX_TASKS 8
+#define SCHED_EVENT 0 // Period of a task that only runs when signalled.
+
+typedef void (*task_handler_t)(void);
+
+void schedInit(void);
+int schedAddPeriodic(const char *name, unsigned long period_ms, task_handler_t handler);
+int schedAddEvent(const char *name, task_handler_t handler);
+RAMFUNC void schedSignal(int task);
+void schedOverrun(int task, unsigned long count);
+void schedRun(void);
+void schedIdle(void);
+unsigned long schedIdlePercent(void);
+unsigned long schedTicks(void);
+unsigned long schedCycles(void);
+void printTasks(void);
+void SysTick_IRQHandler(void);
+
+#endif
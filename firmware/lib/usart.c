@@ -1,43 +1,406 @@
+#include "inc/hw_types.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_ints.h"
+#include "inc/hw_uart.h"
+#include "driverlib/interrupt.h"
+#include "driverlib/systick.h"
+#include "driverlib/uart.h"
+
 #include "usart.h"
 #include "uart.h"
+#include "ramfunc.h"
+#include "sched.h"
+
+#include <string.h>
+
+// Lines assembled by the receive interrupt. Each completed line is stored in
+// the ring buffer followed by a '\0', so the reader can pull whole lines out
+// without ever seeing a partially typed one.
+static volatile char rx_ring[RX_RING_SIZE];
+static volatile unsigned int rx_head;            // Written by the ISR only.
+static volatile unsigned int rx_tail;            // Written by the reader only.
+static volatile unsigned int rx_lines_committed; // Written by the ISR only.
+static volatile unsigned int rx_lines_consumed;  // Written by the reader only.
+static volatile unsigned int rx_lines_dropped;   // Written by the ISR only.
+
+// The line currently being typed. Only touched in interrupt context.
+static char rx_edit[RX_LINE_MAX];
+static unsigned int rx_edit_len;
+static char rx_last_byte;
+
+// Called from interrupt context whenever a complete line has been queued.
+static void (*line_callback)(void);
+
+// Output waiting for the transmit interrupt. Each segment points either into
+// tx_ring (a copy made by write()) or straight at caller-owned constant data
+// (writeConst()). The main loop only appends, the interrupt only consumes.
+// TX_RING_SIZE and TX_SEGMENTS must be powers of two.
+typedef struct
+{
+    const char *data;
+    unsigned int len;
+    int copied;
+} tx_segment_t;
+
+static tx_segment_t tx_segments[TX_SEGMENTS];
+static volatile unsigned int tx_seg_head;   // Written by the writer only.
+static volatile unsigned int tx_seg_tail;   // Written by the ISR only.
+static unsigned int tx_seg_pos;             // Bytes of the tail segment sent.
+static char tx_ring[TX_RING_SIZE];
+static volatile unsigned int tx_ring_head;  // Written by the writer only.
+static volatile unsigned int tx_ring_tail;  // Written by the ISR only.
+static tx_policy_t tx_policy;
+
+RAMFUNC static void commitLine(void)
+{
+    unsigned int head = rx_head;
+    unsigned int used = head - rx_tail;
+    unsigned int i;
+
+    // Keep the line only if it fits together with its terminator.
+    if(RX_RING_SIZE - used < rx_edit_len + 1)
+    {
+        rx_lines_dropped++;
+        return;
+    }
+
+    for(i = 0; i < rx_edit_len; ++i)
+    {
+        rx_ring[(head + i) % RX_RING_SIZE] = rx_edit[i];
+    }
+    rx_ring[(head + i) % RX_RING_SIZE] = '\0';
+
+    rx_head = head + rx_edit_len + 1;
+    rx_lines_committed++;
+
+    if(line_callback)
+    {
+        line_callback();
+    }
+}
+
+RAMFUNC static void receiveByte(char received_byte)
+{
+    char last_byte = rx_last_byte;
+    rx_last_byte = received_byte;
+
+    if(received_byte == '\n' && last_byte == '\r')
+    {
+        // Second half of a CRLF; the line was already committed on the CR.
+        return;
+    }
+
+    if(received_byte == '\n' || received_byte == '\r')
+    {
+        commitLine();
+        rx_edit_len = 0;
+    }
+    else if(received_byte == '\b' || received_byte == 0x7F)
+    {
+        if(rx_edit_len > 0)
+        {
+            rx_edit_len--;
+        }
+    }
+    else if(rx_edit_len < RX_LINE_MAX)
+    {
+        rx_edit[rx_edit_len++] = received_byte;
+    }
+}
+
+// The interrupt path runs from SRAM and touches the UART registers directly
+// rather than through driverlib, which lives in flash.
+
+// Move queued output into the transmit FIFO until either runs out.
+RAMFUNC static void fillTxFifo(void)
+{
+    while(tx_seg_tail != tx_seg_head &&
+          !(HWREG(UART2_BASE + UART_O_FR) & UART_FR_TXFF))
+    {
+        tx_segment_t *seg = &tx_segments[tx_seg_tail % TX_SEGMENTS];
+
+        HWREG(UART2_BASE + UART_O_DR) = seg->data[tx_seg_pos++];
+        if(tx_seg_pos == seg->len)
+        {
+            if(seg->copied)
+            {
+                tx_ring_tail += seg->len;
+            }
+            tx_seg_pos = 0;
+            tx_seg_tail++;
+        }
+    }
+}
+
+RAMFUNC void UART2_IRQHandler(void)
+{
+    unsigned long status = HWREG(UART2_BASE + UART_O_MIS);
+    HWREG(UART2_BASE + UART_O_ICR) = status;
+
+    // Drain the whole FIFO; the receive timeout interrupt covers the bytes
+    // left below the FIFO trigger level.
+    while(!(HWREG(UART2_BASE + UART_O_FR) & UART_FR_RXFE))
+    {
+        receiveByte((char)(HWREG(UART2_BASE + UART_O_DR) & UART_DR_DATA_M));
+    }
+
+    if(status & UART_INT_TX)
+    {
+        fillTxFifo();
+    }
+}
+
+int pollLine(char *buffer, int max_bytes)
+{
+    unsigned int tail = rx_tail;
+    int i = 0;
+    char received_byte;
+
+    if(rx_lines_committed == rx_lines_consumed)
+    {
+        return -1; // No complete line yet.
+    }
+
+    // Copy the line out, discarding whatever does not fit in the caller's
+    // buffer.
+    do
+    {
+        received_byte = rx_ring[tail % RX_RING_SIZE];
+        tail++;
+        if(received_byte != '\0' && i < max_bytes - 1)
+        {
+            buffer[i++] = received_byte;
+        }
+    } while(received_byte != '\0');
+    buffer[i] = '\0';
+
+    rx_tail = tail;
+    rx_lines_consumed++;
+
+    // Return number of bytes received (length of string).
+    return i;
+}
 
 int readLine(char *buffer, int max_bytes)
 {
-    int i;
-    int ret;
-    for (i = 0;i < max_bytes; ++i)
+    int len;
+
+    while((len = pollLine(buffer, max_bytes)) < 0)
     {
-        // Fetch the received byte value into the variable "received_byte".
-        char received_byte = uart_read(UART2, 1, &ret);
-        // If the line has ended, terminate the string and break. Otherwise,
-        // store the byte and contintue.
-        if(received_byte == '\n' || received_byte == '\r')
+        // Sleep until the receive interrupt, unless a line came in since the
+        // poll.
+        IntMasterDisable();
+        if(rx_lines_committed == rx_lines_consumed)
         {
-            buffer[i] = '\0';
-            break;
+            schedIdle();
         }
         else
         {
-            buffer[i] = received_byte;
+            IntMasterEnable();
         }
     }
 
-    // Reture number of bytes received (length of string).
-    return i;
+    return len;
+}
+
+// Lines thrown away because the reader fell behind and the ring was full.
+unsigned int droppedLines(void)
+{
+    return rx_lines_dropped;
+}
+
+void setLineCallback(void (*callback)(void))
+{
+    line_callback = callback;
+}
+
+// The transmit interrupt only fires when the FIFO drains past its trigger
+// level, so an idle transmitter has to be primed from here.
+static void startTx(void)
+{
+    IntDisable(INT_UART2);
+    fillTxFifo();
+    IntEnable(INT_UART2);
+}
+
+// Bytes that can be queued right now without waiting.
+static unsigned int txRoom(void)
+{
+    if(tx_seg_head - tx_seg_tail == TX_SEGMENTS)
+    {
+        return 0;
+    }
+    return TX_RING_SIZE - (tx_ring_head - tx_ring_tail);
+}
+
+// Wait for the transmit interrupt to make room. The FIFO is topped up with
+// interrupts masked, so the interrupt cannot come and go before the sleep.
+static void waitTx(void)
+{
+    IntMasterDisable();
+    fillTxFifo();
+    if(txRoom() == 0)
+    {
+        schedIdle();
+    }
+    else
+    {
+        IntMasterEnable();
+    }
+}
+
+static void pushSegment(const char *data, unsigned int len, int copied)
+{
+    tx_segment_t *seg = &tx_segments[tx_seg_head % TX_SEGMENTS];
+
+    seg->data = data;
+    seg->len = len;
+    seg->copied = copied;
+    tx_seg_head++; // Publish the segment to the ISR.
+}
+
+void setTxPolicy(tx_policy_t policy)
+{
+    tx_policy = policy;
+}
+
+void writeBytes(const char *buffer, unsigned int len)
+{
+    if(tx_policy != TX_BLOCK && len > txRoom())
+    {
+        if(tx_policy == TX_DROP)
+        {
+            return;
+        }
+        len = txRoom();
+    }
+
+    while(len)
+    {
+        unsigned int head = tx_ring_head % TX_RING_SIZE;
+        unsigned int chunk = txRoom();
+
+        if(chunk == 0)
+        {
+            if(tx_policy != TX_BLOCK)
+            {
+                break; // Out of segments; drop the rest.
+            }
+            waitTx();
+            continue;
+        }
+
+        // Copies never wrap; the remainder goes into a second segment.
+        if(chunk > len)
+        {
+            chunk = len;
+        }
+        if(chunk > TX_RING_SIZE - head)
+        {
+            chunk = TX_RING_SIZE - head;
+        }
+
+        memcpy(&tx_ring[head], buffer, chunk);
+        tx_ring_head += chunk;
+        pushSegment(&tx_ring[head], chunk, 1);
+
+        buffer += chunk;
+        len -= chunk;
+    }
+
+    startTx();
+}
+
+// Queue caller-owned data without copying it. The data must stay untouched
+// until writeDone() reports the returned ticket as sent.
+unsigned int writeRef(const char *buffer, unsigned int len)
+{
+    if(len == 0)
+    {
+        return tx_seg_head;
+    }
+
+    while(tx_seg_head - tx_seg_tail == TX_SEGMENTS)
+    {
+        if(tx_policy != TX_BLOCK)
+        {
+            return tx_seg_head; // Dropped, so trivially done.
+        }
+        waitTx();
+    }
+
+    pushSegment(buffer, len, 0);
+    startTx();
+    return tx_seg_head;
+}
+
+int writeDone(unsigned int ticket)
+{
+    return (int)(tx_seg_tail - ticket) >= 0;
+}
+
+void writeConst(const char *buffer)
+{
+    writeRef(buffer, strlen(buffer));
 }
 
 void write(const char *buffer)
 {
-    uart_write_str(UART2, buffer); // Send the byte.
+    writeBytes(buffer, strlen(buffer));
 }
 
 void writeLine(const char *buffer)
 {
     write(buffer);
-    nl(UART2);
+    writeConst("\n");
+}
+
+void writeLineConst(const char *buffer)
+{
+    writeConst(buffer);
+    writeConst("\n");
+}
+
+void flushOutput(void)
+{
+    while(tx_seg_tail != tx_seg_head)
+    {
+        startTx();
+    }
+    while(UARTBusy(UART2_BASE))
+    {
+    }
+}
+
+// Stands in for the bootloader's SysTick handler, which the copied vector
+// table still points at and which counts its uptime in what is now firmware
+// RAM. schedInit() installs the real one.
+static void DefaultSysTickHandler(void)
+{
 }
 
 void initializeUSART()
 {
     uart_init(UART2);
+
+    rx_head = rx_tail = 0;
+    rx_lines_committed = rx_lines_consumed = rx_lines_dropped = 0;
+    rx_edit_len = 0;
+    rx_last_byte = '\0';
+    line_callback = 0;
+
+    tx_seg_head = tx_seg_tail = tx_seg_pos = 0;
+    tx_ring_head = tx_ring_tail = 0;
+    tx_policy = TX_BLOCK;
+
+    // The firmware has no vector table of its own, so this moves the table to
+    // SRAM (copying the bootloader's entries) before installing the handler.
+    // SysTick may still be counting, so keep its interrupt off and its entry
+    // away from the bootloader's handler whatever state it was left in.
+    SysTickIntDisable();
+    IntRegister(INT_UART2, UART2_IRQHandler);
+    IntRegister(FAULT_SYSTICK, DefaultSysTickHandler);
+    UARTIntEnable(UART2_BASE, UART_INT_RX | UART_INT_RT | UART_INT_TX);
+    IntEnable(INT_UART2);
+    IntMasterEnable();
 }
@@ -1,7 +1,41 @@
+#ifndef USART_H
+#define USART_H
+
+#include "ramfunc.h"
+
 #define USART_BAUDRATE 115200
 #define BAUD_PRESCALE (((F_CPU / (USART_BAUDRATE * 16UL))) - 1)
 
+// Receive buffering for UART2. RX_RING_SIZE must be a power of two.
+#define RX_RING_SIZE 512
+#define RX_LINE_MAX 255
+
+// Transmit buffering for UART2. Both sizes must be powers of two.
+#define TX_RING_SIZE 1024
+#define TX_SEGMENTS 32
+
+// What write() does when the transmit queue is full.
+typedef enum
+{
+    TX_BLOCK,    // Wait for the interrupt to make room (default).
+    TX_DROP,     // Discard the whole write.
+    TX_TRUNCATE  // Queue what fits and discard the rest.
+} tx_policy_t;
+
 int readLine(char* buffer, int max_bytes);
+int pollLine(char* buffer, int max_bytes);
+unsigned int droppedLines(void);
+void setLineCallback(void (*callback)(void));
 void write(const char *buffer);
+void writeBytes(const char *buffer, unsigned int len);
+void writeConst(const char *buffer);
+unsigned int writeRef(const char *buffer, unsigned int len);
+int writeDone(unsigned int ticket);
 void writeLine(const char* buffer);
+void writeLineConst(const char* buffer);
+void flushOutput(void);
+void setTxPolicy(tx_policy_t policy);
 void initializeUSART(void);
+RAMFUNC void UART2_IRQHandler(void);
+
+#endif
\ No newline at end of file
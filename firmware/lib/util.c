@@ -1,11 +1,93 @@
 #include "util.h"
 #include <string.h>
+#include <stdint.h>
+
+// Both characters of every byte's hex encoding, first character in the low
+// byte so a little-endian 16-bit store writes them in order.
+static const uint16_t HEX_ENCODE[256] =
+{
+    0x3030, 0x3130, 0x3230, 0x3330, 0x3430, 0x3530, 0x3630, 0x3730,
+    0x3830, 0x3930, 0x6130, 0x6230, 0x6330, 0x6430, 0x6530, 0x6630,
+    0x3031, 0x3131, 0x3231, 0x3331, 0x3431, 0x3531, 0x3631, 0x3731,
+    0x3831, 0x3931, 0x6131, 0x6231, 0x6331, 0x6431, 0x6531, 0x6631,
+    0x3032, 0x3132, 0x3232, 0x3332, 0x3432, 0x3532, 0x3632, 0x3732,
+    0x3832, 0x3932, 0x6132, 0x6232, 0x6332, 0x6432, 0x6532, 0x6632,
+    0x3033, 0x3133, 0x3233, 0x3333, 0x3433, 0x3533, 0x3633, 0x3733,
+    0x3833, 0x3933, 0x6133, 0x6233, 0x6333, 0x6433, 0x6533, 0x6633,
+    0x3034, 0x3134, 0x3234, 0x3334, 0x3434, 0x3534, 0x3634, 0x3734,
+    0x3834, 0x3934, 0x6134, 0x6234, 0x6334, 0x6434, 0x6534, 0x6634,
+    0x3035, 0x3135, 0x3235, 0x3335, 0x3435, 0x3535, 0x3635, 0x3735,
+    0x3835, 0x3935, 0x6135, 0x6235, 0x6335, 0x6435, 0x6535, 0x6635,
+    0x3036, 0x3136, 0x3236, 0x3336, 0x3436, 0x3536, 0x3636, 0x3736,
+    0x3836, 0x3936, 0x6136, 0x6236, 0x6336, 0x6436, 0x6536, 0x6636,
+    0x3037, 0x3137, 0x3237, 0x3337, 0x3437, 0x3537, 0x3637, 0x3737,
+    0x3837, 0x3937, 0x6137, 0x6237, 0x6337, 0x6437, 0x6537, 0x6637,
+    0x3038, 0x3138, 0x3238, 0x3338, 0x3438, 0x3538, 0x3638, 0x3738,
+    0x3838, 0x3938, 0x6138, 0x6238, 0x6338, 0x6438, 0x6538, 0x6638,
+    0x3039, 0x3139, 0x3239, 0x3339, 0x3439, 0x3539, 0x3639, 0x3739,
+    0x3839, 0x3939, 0x6139, 0x6239, 0x6339, 0x6439, 0x6539, 0x6639,
+    0x3061, 0x3161, 0x3261, 0x3361, 0x3461, 0x3561, 0x3661, 0x3761,
+    0x3861, 0x3961, 0x6161, 0x6261, 0x6361, 0x6461, 0x6561, 0x6661,
+    0x3062, 0x3162, 0x3262, 0x3362, 0x3462, 0x3562, 0x3662, 0x3762,
+    0x3862, 0x3962, 0x6162, 0x6262, 0x6362, 0x6462, 0x6562, 0x6662,
+    0x3063, 0x3163, 0x3263, 0x3363, 0x3463, 0x3563, 0x3663, 0x3763,
+    0x3863, 0x3963, 0x6163, 0x6263, 0x6363, 0x6463, 0x6563, 0x6663,
+    0x3064, 0x3164, 0x3264, 0x3364, 0x3464, 0x3564, 0x3664, 0x3764,
+    0x3864, 0x3964, 0x6164, 0x6264, 0x6364, 0x6464, 0x6564, 0x6664,
+    0x3065, 0x3165, 0x3265, 0x3365, 0x3465, 0x3565, 0x3665, 0x3765,
+    0x3865, 0x3965, 0x6165, 0x6265, 0x6365, 0x6465, 0x6565, 0x6665,
+    0x3066, 0x3166, 0x3266, 0x3366, 0x3466, 0x3566, 0x3666, 0x3766,
+    0x3866, 0x3966, 0x6166, 0x6266, 0x6366, 0x6466, 0x6566, 0x6666,
+};
+
+// Value of every hex digit, -1 for anything else.
+static const signed char HEX_DECODE[256] =
+{
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+static const char BASE64_ENCODE[64] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Value of every base64 digit, -1 for anything else (including '=').
+static const signed char BASE64_DECODE[256] =
+{
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
 char hex2nybble(char nybble)
 {
-    if(nybble >= 'A' && nybble <= 'F') return nybble - 'A' + 10;
-    else if(nybble >= 'a' && nybble <= 'f') return nybble - 'a' + 10;
-    else if(nybble >= '0' && nybble <= '9') return nybble - '0';
-    else return -1;
+    return HEX_DECODE[(unsigned char)nybble];
 }
 
 char hex2byte(char upper_nybble, char lower_nybble)
@@ -16,21 +98,204 @@ char hex2byte(char upper_nybble, char lower_nybble)
 int hex2str(char *hex_str, int length, char *byte_str)
 {
     length = strnlen(hex_str, length);
+    return hexDecode(hex_str, length, (unsigned char *)byte_str);
+}
+
+int str2hex(char *byte_str, int length, char *hex_str)
+{
+    return hexEncode((const unsigned char *)byte_str, length, hex_str);
+}
+
+int hexEncode(const unsigned char *src, int length, char *dst)
+{
+    int i = 0;
+    uint32_t word, lo, hi;
+
+    // Four input bytes become two 32-bit stores of output.
+    for(; i + 4 <= length; i += 4)
+    {
+        memcpy(&word, src + i, 4);
+        lo = HEX_ENCODE[word & 0xFF] | (uint32_t)HEX_ENCODE[(word >> 8) & 0xFF] << 16;
+        hi = HEX_ENCODE[(word >> 16) & 0xFF] | (uint32_t)HEX_ENCODE[word >> 24] << 16;
+        memcpy(dst + i * 2, &lo, 4);
+        memcpy(dst + i * 2 + 4, &hi, 4);
+    }
+    for(; i < length; ++i)
+    {
+        memcpy(dst + i * 2, &HEX_ENCODE[src[i]], 2);
+    }
+    return length * 2;
+}
+
+int hexDecode(const char *src, int length, unsigned char *dst)
+{
     int i;
-    for(i = 0; i < length; i+=2)
+    int invalid = 0;
+
+    if(length & 1)
     {
-        byte_str[i>>1] = hex2byte(hex_str[i], hex_str[i+1]);
+        return -1;
     }
-    return i>>1;
+
+    for(i = 0; i < length; i += 2)
+    {
+        int upper = HEX_DECODE[(unsigned char)src[i]];
+        int lower = HEX_DECODE[(unsigned char)src[i + 1]];
+
+        // Any -1 sets the sign bit; checked once at the end.
+        invalid |= upper | lower;
+        dst[i >> 1] = (upper << 4) | lower;
+    }
+    return invalid < 0 ? -1 : length >> 1;
 }
 
-int str2hex(char *byte_str, int length, char *hex_str)
+// Encode one 3-byte group into four characters with a single store.
+static void base64Group(const unsigned char *src, char *dst)
+{
+    uint32_t bits = (uint32_t)src[0] << 16 | (uint32_t)src[1] << 8 | src[2];
+    uint32_t out = (uint32_t)BASE64_ENCODE[bits >> 18]
+                 | (uint32_t)BASE64_ENCODE[(bits >> 12) & 0x3F] << 8
+                 | (uint32_t)BASE64_ENCODE[(bits >> 6) & 0x3F] << 16
+                 | (uint32_t)BASE64_ENCODE[bits & 0x3F] << 24;
+
+    memcpy(dst, &out, 4);
+}
+
+int base64Encode(const unsigned char *src, int length, char *dst)
+{
+    codec_stream_t stream;
+    int n;
+
+    codecStreamInit(&stream, CODEC_BASE64);
+    n = codecStreamUpdate(&stream, src, length, dst);
+    return n + codecStreamFinal(&stream, dst + n);
+}
+
+int base64Decode(const char *src, int length, unsigned char *dst)
 {
     int i;
-    for(i = 0; i < length; ++i)
+    int n = 0;
+    int invalid = 0;
+
+    // Trailing padding only says how many bytes the last group holds.
+    while(length > 0 && src[length - 1] == '=')
+    {
+        length--;
+    }
+    if(length % 4 == 1)
+    {
+        return -1;
+    }
+
+    for(i = 0; i + 4 <= length; i += 4)
+    {
+        int a = BASE64_DECODE[(unsigned char)src[i]];
+        int b = BASE64_DECODE[(unsigned char)src[i + 1]];
+        int c = BASE64_DECODE[(unsigned char)src[i + 2]];
+        int d = BASE64_DECODE[(unsigned char)src[i + 3]];
+        uint32_t bits = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6 | (uint32_t)d;
+
+        invalid |= a | b | c | d;
+        dst[n++] = bits >> 16;
+        dst[n++] = bits >> 8;
+        dst[n++] = bits;
+    }
+    if(i < length)
+    {
+        int a = BASE64_DECODE[(unsigned char)src[i]];
+        int b = BASE64_DECODE[(unsigned char)src[i + 1]];
+        int c = length - i == 3 ? BASE64_DECODE[(unsigned char)src[i + 2]] : 0;
+        uint32_t bits = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6;
+
+        invalid |= a | b | c;
+        dst[n++] = bits >> 16;
+        if(length - i == 3)
+        {
+            dst[n++] = bits >> 8;
+        }
+    }
+    return invalid < 0 ? -1 : n;
+}
+
+void codecStreamInit(codec_stream_t *stream, codec_format_t format)
+{
+    stream->format = format;
+    stream->carry_len = 0;
+}
+
+// Encode as much of the input as forms complete output groups. Hex has no
+// grouping; base64 holds back up to two bytes until the next update or the
+// final call. Returns the number of characters written.
+int codecStreamUpdate(codec_stream_t *stream, const unsigned char *src, int length, char *dst)
+{
+    int n = 0;
+
+    if(stream->format == CODEC_HEX)
+    {
+        return hexEncode(src, length, dst);
+    }
+
+    while(stream->carry_len > 0 && stream->carry_len < 3 && length > 0)
+    {
+        stream->carry[stream->carry_len++] = *src++;
+        length--;
+    }
+    if(stream->carry_len == 3)
+    {
+        base64Group(stream->carry, dst);
+        n += 4;
+        stream->carry_len = 0;
+    }
+
+    for(; length >= 3; length -= 3, src += 3, n += 4)
+    {
+        base64Group(src, dst + n);
+    }
+
+    memcpy(stream->carry + stream->carry_len, src, length);
+    stream->carry_len += length;
+    return n;
+}
+
+// Flush held back input with padding. Returns the number of characters
+// written.
+int codecStreamFinal(codec_stream_t *stream, char *dst)
+{
+    unsigned char group[3] = {0, 0, 0};
+    int carry_len = stream->carry_len;
+
+    if(stream->format == CODEC_HEX || carry_len == 0)
+    {
+        return 0;
+    }
+
+    memcpy(group, stream->carry, carry_len);
+    base64Group(group, dst);
+    dst[3] = '=';
+    if(carry_len == 1)
+    {
+        dst[2] = '=';
+    }
+    stream->carry_len = 0;
+    return 4;
+}
+
+int uint2str(unsigned long value, char *str)
+{
+    char digits[10];
+    int n = 0;
+    int i;
+
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+
+    for(i = 0; i < n; ++i)
     {
-        hex_str[i*2]   = (byte_str[i]>>4)  > 9 ? (byte_str[i]>>4)  + 'a' - 10 : (byte_str[i]>>4)  + '0';
-        hex_str[i*2+1] = (byte_str[i]&0xF) > 9 ? (byte_str[i]&0xF) + 'a' - 10 : (byte_str[i]&0xF) + '0';
+        str[i] = digits[n - 1 - i];
     }
-    return i*2;
+    str[n] = '\0';
+    return n;
 }
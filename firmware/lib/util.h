@@ -1,4 +1,35 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+typedef enum
+{
+    CODEC_HEX,
+    CODEC_BASE64
+} codec_format_t;
+
+// State for encoding a stream that arrives in arbitrary pieces.
+typedef struct
+{
+    codec_format_t format;
+    unsigned char carry[3];
+    int carry_len;
+} codec_stream_t;
+
+// Output sizes, not counting a terminator.
+#define HEX_ENCODED_LEN(n) ((n) * 2)
+#define BASE64_ENCODED_LEN(n) (((n) + 2) / 3 * 4)
+
 char hex2nybble(char nybble);
 char hex2byte(char upper_nybble, char lower_nybble);
 int hex2str(char* hex_str, int length, char* byte_str);
 int str2hex(char *byte_str, int length, char *hex_str);
+int hexEncode(const unsigned char *src, int length, char *dst);
+int hexDecode(const char *src, int length, unsigned char *dst);
+int base64Encode(const unsigned char *src, int length, char *dst);
+int base64Decode(const char *src, int length, unsigned char *dst);
+void codecStreamInit(codec_stream_t *stream, codec_format_t format);
+int codecStreamUpdate(codec_stream_t *stream, const unsigned char *src, int length, char *dst);
+int codecStreamFinal(codec_stream_t *stream, char *dst);
+int uint2str(unsigned long value, char *str);
+
+#endif
\ No newline at end of file
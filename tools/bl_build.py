@@ -12,7 +12,11 @@ import pathlib
 import shutil
 import subprocess
 
+from Crypto.PublicKey import ECC
+
 FILE_DIR = pathlib.Path(__file__).parent.absolute()
+SIGNING_KEY = FILE_DIR / 'signing_key.pem'
+SIGNING_KEY_HEADER = FILE_DIR / '..' / 'bootloader' / 'include' / 'signing_key.h'
 
 
 def copy_initial_firmware(binary_path):
@@ -27,10 +31,48 @@ def copy_initial_firmware(binary_path):
     shutil.copy(binary_path, bootloader / 'src' / 'firmware.bin')
 
 
-def make_bootloader():
+def generate_signing_key(new_key=False):
+    """
+    Create the release signing key and compile its public half into the
+    bootloader.
+
+    The private key (SIGNING_KEY) stays on the build host and is what
+    fw_protect.py signs releases with. An existing key is kept unless new_key
+    is set, so devices already in the field keep accepting new releases.
+
+    Return:
+        None
+    """
+    if new_key or not SIGNING_KEY.exists():
+        key = ECC.generate(curve='P-256')
+        with open(SIGNING_KEY, 'wt') as fp:
+            fp.write(key.export_key(format='PEM'))
+    else:
+        with open(SIGNING_KEY, 'rt') as fp:
+            key = ECC.import_key(fp.read())
+
+    # Uncompressed SEC1 point, as BearSSL expects it.
+    point = key.public_key().pointQ
+    public = b'\x04' + int(point.x).to_bytes(32, 'big') + int(point.y).to_bytes(32, 'big')
+
+    lines = ['  ' + ', '.join('0x{:02X}'.format(b) for b in public[i:i + 12]) for i in range(0, len(public), 12)]
+    with open(SIGNING_KEY_HEADER, 'wt') as fp:
+        fp.write('// Generated by bl_build.py, do not edit.\n')
+        fp.write('// Release signing public key (P-256, uncompressed).\n')
+        fp.write('static const unsigned char signing_public_key[{}] = {{\n'.format(len(public)))
+        fp.write(',\n'.join(lines))
+        fp.write('\n};\n')
+
+
+def make_bootloader(autoboot_window=None):
     """
     Build the bootloader from source.
 
+    Args:
+        autoboot_window: Milliseconds the bootloader waits for the host before
+            booting the installed firmware (0 disables autoboot). None keeps
+            the Makefile default.
+
     Return:
         True if successful, False otherwise.
     """
@@ -38,8 +80,12 @@ def make_bootloader():
     bootloader = FILE_DIR / '..' / 'bootloader'
     os.chdir(bootloader)
 
+    cmd = ['make']
+    if autoboot_window is not None:
+        cmd.append(f'AUTOBOOT_WINDOW_MS={autoboot_window}')
+
     subprocess.call('make clean', shell=True)
-    status = subprocess.call('make')
+    status = subprocess.call(cmd)
 
     # Return True if make returned 0, otherwise return False.
     return (status == 0)
@@ -48,6 +94,10 @@ def make_bootloader():
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Bootloader Build Tool')
     parser.add_argument("--initial-firmware", help="Path to the the firmware binary.", default=None)
+    parser.add_argument("--autoboot-window", help="Milliseconds to wait for an update before booting (0 disables).",
+                        type=int, default=None)
+    parser.add_argument("--new-signing-key", help="Replace the release signing key. Devices built with the old key will reject releases signed with the new one.",
+                        action='store_true')
     args = parser.parse_args()
     if args.initial_firmware is None:
         binary_path = FILE_DIR / '..' / 'firmware' / 'firmware' / 'gcc' / 'main.bin'
@@ -60,4 +110,5 @@ if __name__ == '__main__':
                 binary_path))
 
     copy_initial_firmware(binary_path)
-    make_bootloader()
+    generate_signing_key(new_key=args.new_signing_key)
+    make_bootloader(autoboot_window=args.autoboot_window)
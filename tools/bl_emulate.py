@@ -4,11 +4,16 @@ import os
 import pty
 import subprocess
 import fcntl
+import random
+import shutil
+import socket
 import threading
 import time
 
 from core.pseudo_serial import SocketSerial
 
+import uart_capture
+
 
 def set_nonblocking(fd):
     """Make a file_handle non-blocking."""
@@ -26,7 +31,23 @@ def disable_local_echo(fd):
     termios.tcsetattr(fd, termios.TCSADRAIN, new)
 
 
-def connect_socks(ser, fd):
+def flip_bits(data, ber, rng):
+    """Flip each bit of data with probability ber, like a noisy line would."""
+    if not ber:
+        return data
+    data = bytearray(data)
+    for i in range(len(data)):
+        for bit in range(8):
+            if rng.random() < ber:
+                data[i] ^= 1 << bit
+    return bytes(data)
+
+
+def connect_socks(ser, fd, ber=0.0, rng=None, capture=None, uart=None):
+    """
+    Bridge a QEMU UART to a pty. With a capture, the bytes are recorded as
+    they cross the bridge, before any injected bit errors.
+    """
     def _connect_socks():
         set_nonblocking(fd)
         disable_local_echo(fd)
@@ -34,14 +55,18 @@ def connect_socks(ser, fd):
             if ser.isOpen():
                 data0 = ser.read(100, timeout=.1)
                 if len(data0):
-                    os.write(fd, data0)
+                    if capture is not None:
+                        capture.record(uart, uart_capture.TO_HOST, data0)
+                    os.write(fd, flip_bits(data0, ber, rng))
 
             try:
                 # return 1-n bytes or exception if no bytes
                 time.sleep(.1)
                 data1 = os.read(fd, 1024)
                 if len(data1):
-                    ser.write(data1)
+                    if capture is not None:
+                        capture.record(uart, uart_capture.TO_DEVICE, data1)
+                    ser.write(flip_bits(data1, ber, rng))
             except BlockingIOError:
                 pass
 
@@ -50,43 +75,323 @@ def connect_socks(ser, fd):
     return t
 
 
-def emulate(binary_path, debug=False):
-    cmd = ['qemu-system-arm', '-M', 'lm3s6965evb', '-nographic', '-kernel', binary_path]
-    if debug:
-        cmd.extend(['-s', '-S'])
-    ports = []
-    for idx, port in enumerate([13337, 13338, 13339]):
-        cmd.extend(['-serial', f'tcp:0.0.0.0:{port},server'])
-        name = f'/embsec/UART{idx}'
-        ports.append((port, name))
+UART_COUNT = 3
+LEGACY_DIR = '/embsec'
+LEGACY_PORTS = [13337, 13338, 13339]
+FARM_DIR = '/tmp/embsec-farm'
+RESET_BYTE = b'\x20'  # written to UART0, see the bootloader's UART0 handler
+RESET_SETTLE_TIME = 0.5  # seconds for the bootloader to come back up
+READY_TIMEOUT = 10  # seconds
+BOOT_TIMEOUT = 60  # seconds for a cold boot, including load_initial_firmware()
+READY_BANNER = b'Writing 0x20 to UART0 will reset the device.'
+SNAPSHOT_NAME = 'ready'
+SNAPSHOT_SIZE = '1M'  # only holds the saved VM state; no device is attached
+
+
+def free_port():
+    """Ask the OS for a TCP port nobody is listening on."""
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+class Device:
+    """
+    One emulated board: a QEMU process with its UARTs on TCP ports, bridged to
+    ptys that are symlinked as <uart_dir>/UART0..2.
+
+    Only the host link (UART1) is noisy; reset and debug stay clean.
+    """
+
+    def __init__(self, binary_path, uart_dir, ports, host='127.0.0.1', ber=0.0, seed=None, gdb_port=None,
+                 snapshot=None, capture=None):
+        self.binary_path = binary_path
+        self.uart_dir = uart_dir
+        self.ports = ports
+        self.host = host
+        self.ber = ber
+        self.rng = random.Random(seed)
+        self.gdb_port = gdb_port
+        self.snapshot = snapshot
+        self.capture_path = capture
+        self.capture = None
+        self.monitor_sock = None
+        self.proc = None
+        self.sers = []
+        self.fds = []
+        self.threads = []
+        self.ready = threading.Event()
+
+    def uart(self, idx):
+        """Path of the pty for UART idx."""
+        return os.path.join(self.uart_dir, f'UART{idx}')
+
+    def monitor_path(self):
+        return os.path.join(self.uart_dir, 'monitor')
+
+    def start(self, loadvm=False):
+        """
+        Launch QEMU and connect the UARTs in the background; see wait_ready().
+
+        With a snapshot image, loadvm starts from its saved state instead of
+        cold booting.
+        """
+        cmd = ['qemu-system-arm', '-M', 'lm3s6965evb', '-nographic', '-kernel', str(self.binary_path)]
+        if self.gdb_port is not None:
+            # Start GDB server and break on first instruction
+            cmd.extend(['-gdb', f'tcp::{self.gdb_port}', '-S'])
+        for port in self.ports:
+            cmd.extend(['-serial', f'tcp:{self.host}:{port},server'])
+        if self.snapshot is not None:
+            # savevm needs a writable qcow2 image to put the VM state in.
+            cmd.extend(['-drive', f'if=none,id=snapshot,format=qcow2,file={self.snapshot}',
+                        '-monitor', f'unix:{self.monitor_path()},server,nowait'])
+            if loadvm:
+                cmd.extend(['-loadvm', SNAPSHOT_NAME])
+
+        os.makedirs(self.uart_dir, exist_ok=True)
+        self.proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+        threading.Thread(target=self._connect, daemon=True).start()
+
+    def _connect(self):
+        if self.capture_path is not None:
+            self.capture = uart_capture.CaptureWriter(self.capture_path)
+        for idx, port in enumerate(self.ports):
+            master, slave = pty.openpty()
+            name = self.uart(idx)
+            try:
+                os.unlink(name)
+            except FileNotFoundError:
+                pass
+            os.symlink(os.ttyname(slave), name)
+
+            ser = SocketSerial(name, port, log=False)
+            self.sers.append(ser)
+            self.fds.extend([master, slave])
+            self.threads.append(connect_socks(ser, master, ber=self.ber if idx == 1 else 0.0, rng=self.rng,
+                                              capture=self.capture, uart=idx))
+        self.ready.set()
+
+    def wait_ready(self, timeout=READY_TIMEOUT):
+        """Wait until every UART is connected. Raises RuntimeError on timeout."""
+        if not self.ready.wait(timeout):
+            raise RuntimeError(f'Emulator in {self.uart_dir} did not come up')
+
+    def reset(self):
+        """
+        Reset through UART0. A software reset keeps the bootloader in its
+        command loop instead of autobooting the firmware.
+        """
+        self.sers[0].write(RESET_BYTE)
+        time.sleep(RESET_SETTLE_TIME)
+
+    def monitor(self, command):
+        """Run a QEMU monitor command and return its output."""
+        if self.monitor_sock is None:
+            self.monitor_sock = socket.socket(socket.AF_UNIX)
+            self.monitor_sock.connect(self.monitor_path())
+            self._monitor_read()  # banner and first prompt
+        self.monitor_sock.sendall(command.encode() + b'\n')
+        return self._monitor_read()
+
+    def _monitor_read(self):
+        out = b''
+        while not out.endswith(b'(qemu) '):
+            data = self.monitor_sock.recv(4096)
+            if not data:
+                raise RuntimeError('QEMU monitor closed')
+            out += data
+        return out.decode(errors='replace')
+
+    def boot_to_ready(self, timeout=BOOT_TIMEOUT):
+        """
+        Bring the bootloader into its command loop, as after a reset through
+        UART0, and wait until it has printed its banner.
+        """
+        from serial import Serial
+
+        with Serial(self.uart(2), baudrate=115200, timeout=1) as debug:
+            for reset in (False, True):
+                if reset:
+                    # The cold boot may have autobooted the firmware.
+                    self.sers[0].write(RESET_BYTE)
+                out = b''
+                deadline = time.time() + timeout
+                while READY_BANNER not in out:
+                    if time.time() > deadline:
+                        raise RuntimeError(f'Bootloader in {self.uart_dir} never became ready')
+                    out += debug.read(256)
 
+    def save_snapshot(self):
+        """Save the current state as the one restore() returns to."""
+        self.monitor('stop')
+        self.monitor('savevm ' + SNAPSHOT_NAME)
+        self.monitor('cont')
+
+    def restore(self):
+        """
+        Go back to the saved snapshot: the bootloader in its command loop with
+        nothing in flight. Takes milliseconds where a cold boot takes seconds.
+        """
+        self.monitor('loadvm ' + SNAPSHOT_NAME)
+
+    def stop(self):
+        if self.monitor_sock is not None:
+            self.monitor_sock.close()
+            self.monitor_sock = None
+        if self.proc is not None:
+            self.proc.kill()
+            self.proc.wait()
+            self.proc = None
+        for ser in self.sers:
+            ser.close()
+        for t in self.threads:
+            t.join()
+        if self.capture is not None:
+            self.capture.close()
+            self.capture = None
+        for fd in self.fds:
+            os.close(fd)
+        for name in [self.uart(idx) for idx in range(len(self.ports))] + [self.monitor_path()]:
+            try:
+                os.unlink(name)
+            except FileNotFoundError:
+                pass
+        self.sers, self.fds, self.threads = [], [], []
+        self.ready.clear()
+
+
+class Farm:
+    """
+    Any number of isolated devices on one machine. Each gets its own ports
+    and its own directory of UART ptys, <root_dir>/dev<n>/UART0..2.
+    """
+
+    def __init__(self, binary_path, root_dir=FARM_DIR, snapshot=False):
+        self.binary_path = binary_path
+        self.root_dir = root_dir
+        self.snapshot = snapshot
+        self.devices = []
+
+    def add(self, ber=0.0, seed=None, debug=False, capture=None):
+        uart_dir = os.path.join(self.root_dir, f'dev{len(self.devices)}')
+        ports = [free_port() for _ in range(UART_COUNT)]
+        device = Device(self.binary_path, uart_dir, ports, ber=ber, seed=seed,
+                        gdb_port=free_port() if debug else None,
+                        snapshot=os.path.join(uart_dir, 'snapshot.qcow2') if self.snapshot else None,
+                        capture=capture)
+        self.devices.append(device)
+        return device
+
+    def prepare_snapshot(self):
+        """
+        Boot one device to the bootloader's command loop and save it, then
+        give every device a copy so they all start from there.
+        """
+        base = os.path.join(self.root_dir, 'snapshot.qcow2')
+        os.makedirs(self.root_dir, exist_ok=True)
+        make_snapshot(self.binary_path, base, os.path.join(self.root_dir, 'boot'))
+        for device in self.devices:
+            os.makedirs(device.uart_dir, exist_ok=True)
+            shutil.copyfile(base, device.snapshot)
+
+    def start(self):
+        if self.snapshot:
+            self.prepare_snapshot()
+        for device in self.devices:
+            device.start(loadvm=self.snapshot)
+
+    def wait_ready(self, timeout=READY_TIMEOUT):
+        for device in self.devices:
+            device.wait_ready(timeout)
+
+    def stop(self):
+        for device in self.devices:
+            device.stop()
+
+    def __enter__(self):
+        self.start()
+        self.wait_ready()
+        return self
+
+    def __exit__(self, *exc):
+        self.stop()
+
+
+def make_snapshot(binary_path, path, uart_dir):
+    """Cold boot once on a clean device and save the ready state to path."""
+    subprocess.check_call(['qemu-img', 'create', '-q', '-f', 'qcow2', path, SNAPSHOT_SIZE])
+    device = Device(binary_path, uart_dir, [free_port() for _ in range(UART_COUNT)], snapshot=path)
+    device.start()
+    try:
+        device.wait_ready()
+        device.boot_to_ready()
+        device.save_snapshot()
+    finally:
+        device.stop()
+
+
+def emulate(binary_path, debug=False, ber=0.0, seed=None, capture=None):
+    """
+    Run the single device on the fixed ports and /embsec/UART0..2 paths that
+    the other tools default to. Kills any QEMU still holding those ports.
+    """
     subprocess.call(['pkill', 'qemu'])
-    subprocess.Popen(cmd)
+    device = Device(binary_path, LEGACY_DIR, LEGACY_PORTS, host='0.0.0.0', ber=ber, seed=seed,
+                    gdb_port=1234 if debug else None, capture=capture)
+    device.start()
+    try:
+        device.wait_ready(None)
+        for idx in range(UART_COUNT):
+            print(f'{device.uart(idx)} is open')
+        device.proc.wait()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        device.stop()
 
-    ts = []
-    for port, name in ports:
-        master, slave = pty.openpty()
-        s_name = os.ttyname(slave)
-        try:
-            os.unlink(name)
-        except FileNotFoundError:
-            pass
-        os.symlink(s_name, name)
 
-        ts.append(connect_socks(SocketSerial(name, port, log=False), master))
-        print(f'{name} is open')
+def emulate_farm(binary_path, count, root_dir, debug=False, ber=0.0, seed=None, snapshot=False):
+    farm = Farm(binary_path, root_dir, snapshot=snapshot)
+    for n in range(count):
+        farm.add(ber=ber, seed=None if seed is None else seed + n, debug=debug)
 
-    [t.join() for t in ts]
+    with farm:
+        for device in farm.devices:
+            gdb = f', gdb on port {device.gdb_port}' if device.gdb_port else ''
+            monitor = f', monitor on {device.monitor_path()}' if device.snapshot else ''
+            print(f'{device.uart_dir}/UART0..2 are open{gdb}{monitor}')
+        try:
+            for device in farm.devices:
+                device.proc.wait()
+        except KeyboardInterrupt:
+            pass
 
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Stellaris Emulator')
     parser.add_argument("--boot-path", help="Path to the the bootloader binary.", default=None)
     parser.add_argument("--debug", help="Start GDB server and break on first instruction", action='store_true')
+    parser.add_argument("--ber", help="Bit error rate to inject on UART1, in both directions", type=float, default=0.0)
+    parser.add_argument("--seed", help="Seed for the injected bit errors", type=int, default=None)
+    parser.add_argument("--capture", help="Record all UART traffic to this file (single device only)", default=None)
+    parser.add_argument("--farm", help="Run this many isolated devices instead of the one on /embsec", type=int, default=0)
+    parser.add_argument("--farm-dir", help="Directory for the farm's per-device UART ptys", default=FARM_DIR)
+    parser.add_argument("--snapshot", help="Start farm devices from a snapshot of a booted bootloader; "
+                        "'loadvm ready' on a device's monitor socket rewinds it", action='store_true')
     args = parser.parse_args()
     if args.boot_path is None:
         binary_path = pathlib.Path(__file__).parent / '..' / 'bootloader' / 'gcc' / 'main.axf'
     else:
         binary_path = pathlib.Path(args.boot_path)
 
-    emulate(binary_path.resolve(), debug=args.debug)
+    if args.snapshot and not args.farm:
+        parser.error('--snapshot needs --farm')
+    if args.capture and args.farm:
+        parser.error('--capture only works without --farm')
+
+    if args.farm:
+        emulate_farm(binary_path.resolve(), args.farm, args.farm_dir, debug=args.debug, ber=args.ber, seed=args.seed,
+                     snapshot=args.snapshot)
+    else:
+        emulate(binary_path.resolve(), debug=args.debug, ber=args.ber, seed=args.seed, capture=args.capture)
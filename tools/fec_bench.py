@@ -0,0 +1,92 @@
+#!/usr/bin/env python
+"""
+FEC Benchmark Tool
+
+Runs the same update through the emulator at several injected bit error
+rates, once with plain retransmit-only frames and once per FEC parity setting,
+and prints how long each took and what it cost on the wire.
+
+Every error rate gets its own emulator from a bl_emulate.py farm, and the
+error rates run in parallel, up to --jobs at a time. The bootloader is booted
+once and snapshotted; every update starts from that snapshot, so runs do not
+depend on each other and skip the cold boot.
+"""
+
+import argparse
+import concurrent.futures
+import os
+import pathlib
+import time
+
+from serial import Serial
+
+import bl_emulate
+import fw_update
+
+FILE_DIR = pathlib.Path(__file__).parent.absolute()
+DEFAULT_BOOT_PATH = FILE_DIR / '..' / 'bootloader' / 'gcc' / 'main.axf'
+
+
+def run_update(port, firmware, fec_parity, frame_size):
+    start = time.time()
+    with Serial(port, baudrate=115200, timeout=2) as ser:
+        try:
+            stats = fw_update.main(ser, firmware, False, fec_parity=fec_parity, frame_size=frame_size,
+                                   force=True)
+        except RuntimeError as e:
+            return None, str(e)
+    return time.time() - start, stats
+
+
+def run_ber(device, firmware, parities, frame_size):
+    """Run every mode on one device and return its (parity, elapsed, result) rows."""
+    rows = []
+    device.start(loadvm=True)
+    try:
+        device.wait_ready()
+        for parity in [0] + parities:
+            device.restore()
+            elapsed, result = run_update(device.uart(1), firmware, parity, frame_size)
+            rows.append((parity, elapsed, result))
+    finally:
+        device.stop()
+    return rows
+
+
+def main(firmware, bers, parities, frame_size, seed, boot_path, jobs):
+    farm = bl_emulate.Farm(pathlib.Path(boot_path or DEFAULT_BOOT_PATH).resolve(), snapshot=True)
+    devices = [farm.add(ber=ber, seed=seed) for ber in bers]
+    farm.prepare_snapshot()
+
+    with concurrent.futures.ThreadPoolExecutor(max_workers=jobs) as pool:
+        results = pool.map(run_ber, devices, [firmware] * len(bers), [parities] * len(bers),
+                           [frame_size] * len(bers))
+        rows = [(ber,) + row for ber, ber_rows in zip(bers, results) for row in ber_rows]
+
+    print()
+    print('{:>8}  {:>8}  {:>8}  {:>8}  {:>8}  {:>10}'.format(
+        'BER', 'Mode', 'Seconds', 'NAKs', 'Resent', 'Bytes'))
+    for ber, parity, elapsed, result in rows:
+        mode = 'RS+{}'.format(parity) if parity else 'plain'
+        if elapsed is None:
+            print('{:>8g}  {:>8}  failed: {}'.format(ber, mode, result))
+            continue
+        print('{:>8g}  {:>8}  {:>8.1f}  {:>8}  {:>8}  {:>10}'.format(
+            ber, mode, elapsed, result.crc_failures, result.retransmits, result.bytes_sent))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='FEC Benchmark Tool')
+    parser.add_argument("--firmware", help="Path to the protected firmware image to send.",
+                        required=True)
+    parser.add_argument("--ber", help="Bit error rates to test.", type=float, nargs='+',
+                        default=[0.0, 1e-5, 1e-4, 1e-3])
+    parser.add_argument("--fec", help="FEC parity byte counts to compare against plain frames.",
+                        type=int, nargs='+', default=[4, 8])
+    parser.add_argument("--frame-size", help="Data bytes per frame.", type=int, default=64)
+    parser.add_argument("--seed", help="Seed for the injected bit errors.", type=int, default=1)
+    parser.add_argument("--boot-path", help="Path to the the bootloader binary.", default=None)
+    parser.add_argument("--jobs", help="Emulators to run at once.", type=int, default=os.cpu_count())
+    args = parser.parse_args()
+
+    main(args.firmware, args.ber, args.fec, args.frame_size, args.seed, args.boot_path, args.jobs)
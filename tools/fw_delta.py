@@ -0,0 +1,370 @@
+#!/usr/bin/env python
+"""
+Firmware Delta Store
+
+Keeps every released blob (fw_protect.py output) in a content-addressed
+store, precomputes a patch from each release to every later one, and sends
+a device the patch for whatever it has installed.
+
+A patch is a sparse session (fw_protect.py --sparse): the target's
+metadata and one segment per run of flash pages where the target differs
+from the installed release. The bootloader only erases and programs those
+pages, and everything else is already right. Patches are page-granular
+because the bootloader has nothing to apply a byte-level diff with; build
+with STABLE_LAYOUT=1 (see fw_layout.py) to keep the pages that differ few.
+An encrypted release differs from every other one from its first page on,
+so patches pay off between sparse releases.
+
+Store layout:
+
+  chunks/ab/abcd...     chunk data, named by its SHA-256
+  releases/<id>.json    a release: version, kind, and its blob's chunks
+  patches/<from>-<to>.json  a patch blob's chunks, and the pages it writes
+  index.json            "<version>:<body SHA-256>" -> release id
+
+Blobs are cut into chunks with a gear rolling hash (content-defined
+chunking), so data that releases and patches share, wherever it sits in
+them, is only stored once. A release's id is the start of its blob's
+SHA-256.
+
+The index maps what a device reports for its install query (version and
+body digest, see fw_update.query_installed()) to the release it holds,
+whether it got there through the full release or a patch. A digest that
+turns up for two different releases is marked ambiguous; such devices get
+the full release.
+
+  fw_delta.py add --store S --blob B [--sparse] [--signed]
+  fw_delta.py precompute --store S [--signing-key K] [--jobs N]
+  fw_delta.py update --store S --port P --version V
+"""
+
+import argparse
+import concurrent.futures
+import hashlib
+import json
+import os
+import random
+import struct
+import tempfile
+
+import fw_protect
+
+FLASH_PAGESIZE = 1024
+SIGNATURE_LEN = 64
+CHUNK_MIN = 256
+CHUNK_MAX = 8192
+CHUNK_MASK = (1 << 11) - 1  # cut points every 2KB on average
+GEAR = [random.Random(0x6765_6172).getrandbits(32) for _ in range(256)]
+
+
+def cut_chunks(data):
+    """Split data where a gear hash over the last 32 bytes hits the mask."""
+    chunks = []
+    start = 0
+    h = 0
+    for i, byte in enumerate(data):
+        h = ((h << 1) + GEAR[byte]) & 0xFFFFFFFF
+        length = i + 1 - start
+        if (length >= CHUNK_MIN and not (h & CHUNK_MASK)) or length >= CHUNK_MAX:
+            chunks.append(data[start:i + 1])
+            start = i + 1
+            h = 0
+    if start < len(data):
+        chunks.append(data[start:])
+    return chunks
+
+
+def read_sparse_body(body):
+    """The (address, data) segments of a sparse body."""
+    header = fw_protect.SEGMENT_HEADER
+    segments = []
+    offset = 0
+    while offset < len(body):
+        if offset + header.size > len(body):
+            raise ValueError('Sparse body ends in a segment header')
+        addr, length = header.unpack_from(body, offset)
+        offset += header.size
+        segments.append((addr, body[offset:offset + length]))
+        offset += length
+    return segments
+
+
+def sparse_body(segments):
+    header = fw_protect.SEGMENT_HEADER
+    return b''.join(header.pack(addr, len(data)) + data for addr, data in segments)
+
+
+def split_blob(blob, signed):
+    """Metadata and body of a blob; the body is what the bootloader digests."""
+    end = len(blob) - SIGNATURE_LEN if signed else len(blob)
+    return blob[:4], blob[4:end]
+
+
+def release_segments(release, blob):
+    """What installing the release writes to flash, as (address, data) segments."""
+    _, body = split_blob(blob, release['signed'])
+    if release['sparse']:
+        return read_sparse_body(body)
+    return [(fw_protect.FW_BASE, body)]
+
+
+def page_images(segments):
+    """
+    The contents of every page the segments touch, with 0xFF where no
+    segment does, which is how the bootloader leaves those bytes.
+    """
+    pages = {}
+    for addr, data in segments:
+        offset = 0
+        while offset < len(data):
+            page = (addr + offset) & ~(FLASH_PAGESIZE - 1)
+            n = min(page + FLASH_PAGESIZE - (addr + offset), len(data) - offset)
+            image = pages.setdefault(page, bytearray(b'\xff' * FLASH_PAGESIZE))
+            image[addr + offset - page:addr + offset - page + n] = data[offset:offset + n]
+            offset += n
+    return pages
+
+
+def diff_segments(base, target):
+    """
+    The parts of target's segments in pages whose contents differ from
+    base's, merged into runs. Returns the segments and the pages written.
+    """
+    base_pages = page_images(base)
+    target_pages = page_images(target)
+    changed = {page for page, image in target_pages.items() if base_pages.get(page) != image}
+
+    segments = []
+    for addr, data in target:
+        offset = 0
+        while offset < len(data):
+            page = (addr + offset) & ~(FLASH_PAGESIZE - 1)
+            n = min(page + FLASH_PAGESIZE - (addr + offset), len(data) - offset)
+            if page in changed:
+                if segments and segments[-1][0] + len(segments[-1][1]) == addr + offset:
+                    segments[-1] = (segments[-1][0], segments[-1][1] + data[offset:offset + n])
+                else:
+                    segments.append((addr + offset, data[offset:offset + n]))
+            offset += n
+    return segments, len(changed)
+
+
+def make_patch(metadata, base, target, signing_key=None):
+    """A sparse blob taking a device from base's flash contents to target's."""
+    segments, pages = diff_segments(base, target)
+    blob = metadata + sparse_body(segments)
+    if signing_key is not None:
+        blob += fw_protect.sign_blob(blob, signing_key)
+    return blob, pages
+
+
+class Store:
+    """A delta store in a directory, see the module documentation."""
+
+    def __init__(self, root):
+        self.root = root
+        for sub in ('chunks', 'releases', 'patches'):
+            os.makedirs(os.path.join(root, sub), exist_ok=True)
+        self.index_path = os.path.join(root, 'index.json')
+        self.index = self._load(self.index_path) if os.path.exists(self.index_path) else {}
+
+    @staticmethod
+    def _load(path):
+        with open(path) as f:
+            return json.load(f)
+
+    @staticmethod
+    def _save(path, value):
+        # Write and rename, so an interrupted run never leaves half a file.
+        tmp = path + '.tmp'
+        with open(tmp, 'w') as f:
+            json.dump(value, f, indent=2)
+            f.write('\n')
+        os.replace(tmp, path)
+
+    def _chunk_path(self, digest):
+        return os.path.join(self.root, 'chunks', digest[:2], digest)
+
+    def put_blob(self, blob):
+        """Store blob's chunks and return its recipe, the list of chunk digests."""
+        recipe = []
+        for chunk in cut_chunks(blob):
+            digest = hashlib.sha256(chunk).hexdigest()
+            path = self._chunk_path(digest)
+            if not os.path.exists(path):
+                os.makedirs(os.path.dirname(path), exist_ok=True)
+                with open(path + '.tmp', 'wb') as f:
+                    f.write(chunk)
+                os.replace(path + '.tmp', path)
+            recipe.append(digest)
+        return recipe
+
+    def get_blob(self, recipe):
+        parts = []
+        for digest in recipe:
+            with open(self._chunk_path(digest), 'rb') as f:
+                parts.append(f.read())
+        return b''.join(parts)
+
+    def releases(self):
+        names = sorted(os.listdir(os.path.join(self.root, 'releases')))
+        return [self._load(os.path.join(self.root, 'releases', name)) for name in names if name.endswith('.json')]
+
+    def release(self, release_id):
+        return self._load(os.path.join(self.root, 'releases', release_id + '.json'))
+
+    def _patch_path(self, base_id, target_id):
+        return os.path.join(self.root, 'patches', '{}-{}.json'.format(base_id, target_id))
+
+    def patch(self, base_id, target_id):
+        path = self._patch_path(base_id, target_id)
+        return self._load(path) if os.path.exists(path) else None
+
+    def _index(self, version, body, release_id):
+        key = '{}:{}'.format(version, hashlib.sha256(body).hexdigest())
+        if key in self.index and self.index[key] != release_id:
+            self.index[key] = None  # ambiguous
+        else:
+            self.index[key] = release_id
+
+    def add_release(self, blob, sparse=False, signed=False):
+        """Store a released blob. Returns its id."""
+        release_id = hashlib.sha256(blob).hexdigest()[:16]
+        metadata, body = split_blob(blob, signed)
+        version, size = struct.unpack('<HH', metadata)
+        release = {'id': release_id, 'version': version, 'size': size, 'sparse': sparse, 'signed': signed,
+                   'blob': self.put_blob(blob)}
+        self._save(os.path.join(self.root, 'releases', release_id + '.json'), release)
+        self._index(version, body, release_id)
+        self._save(self.index_path, self.index)
+        return release_id
+
+    def add_patch(self, base, target, blob, pages, signed):
+        _, body = split_blob(blob, signed)
+        patch = {'from': base['id'], 'to': target['id'], 'pages': pages, 'signed': signed,
+                 'blob': self.put_blob(blob)}
+        self._save(self._patch_path(base['id'], target['id']), patch)
+        self._index(target['version'], body, target['id'])
+
+    def lookup(self, version, digest):
+        """The id of the release a device reporting version and digest holds, or None."""
+        return self.index.get('{}:{}'.format(version, digest.hex()))
+
+    def save_index(self):
+        self._save(self.index_path, self.index)
+
+
+def precompute(store, signing_key=None, jobs=None):
+    """
+    Compute every missing patch from a release to a later one, in parallel.
+    A release can be patched to one with the same version, since version 0
+    (debug) keeps whatever is installed.
+    """
+    releases = store.releases()
+    blobs = {r['id']: store.get_blob(r['blob']) for r in releases}
+    segments = {r['id']: release_segments(r, blobs[r['id']]) for r in releases}
+    pairs = [(base, target) for base in releases for target in releases
+             if base['id'] != target['id'] and (target['version'] == 0 or target['version'] >= base['version'])
+             and store.patch(base['id'], target['id']) is None]
+
+    with concurrent.futures.ProcessPoolExecutor(max_workers=jobs) as pool:
+        futures = {pool.submit(make_patch, blobs[target['id']][:4], segments[base['id']],
+                               segments[target['id']], signing_key): (base, target)
+                   for base, target in pairs}
+        for future in concurrent.futures.as_completed(futures):
+            base, target = futures[future]
+            blob, pages = future.result()
+            store.add_patch(base, target, blob, pages, signing_key is not None)
+            print('  PATCH      v{} {} -> v{} {}: {} pages, {} bytes'.format(
+                base['version'], base['id'], target['version'], target['id'], pages, len(blob)))
+    store.save_index()
+    print('{} patches computed'.format(len(pairs)))
+
+
+def choose(store, installed, version):
+    """
+    Pick what to send a device for the release with the given version.
+
+    installed is what fw_update.query_installed() returned. Returns (blob,
+    sparse, signed) for the patch, or for the full release if there is no
+    patch for what the device holds, or None if it holds the release already.
+    """
+    targets = [r for r in store.releases() if r['version'] == version]
+    if not targets:
+        raise RuntimeError('No release with version {} in the store'.format(version))
+    if len(targets) > 1:
+        raise RuntimeError('{} releases have version {}'.format(len(targets), version))
+    target = targets[0]
+
+    base_id = None
+    if installed is not None and installed[2]:
+        base_id = store.lookup(installed[0], installed[3])
+    if base_id == target['id']:
+        return None
+
+    patch = store.patch(base_id, target['id']) if base_id else None
+    if patch is not None:
+        print('Installed release {}, sending the {} page patch.'.format(base_id, patch['pages']))
+        return store.get_blob(patch['blob']), True, patch['signed']
+
+    print('No patch for the installed release, sending the full release.')
+    return store.get_blob(target['blob']), target['sparse'], target['signed']
+
+
+def update(store, port, version, reset_port=None, frame_size=None):
+    from serial import Serial
+
+    import fw_update
+
+    if reset_port is not None:
+        fw_update.reset_device(reset_port)
+
+    with Serial(port, baudrate=115200, timeout=2) as ser:
+        choice = choose(store, fw_update.query_installed(ser), version)
+        if choice is None:
+            print('Version {} is already installed.'.format(version))
+            return
+        blob, sparse, signed = choice
+
+        # fw_update reads the blob from a file.
+        with tempfile.NamedTemporaryFile(suffix='.bin', delete=False) as f:
+            f.write(blob)
+        try:
+            fw_update.main(ser, f.name, False, frame_size=frame_size or fw_update.FRAME_SIZE,
+                           signed=signed, sparse=sparse)
+        finally:
+            os.unlink(f.name)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Firmware Delta Store')
+    parser.add_argument("--store", help="Directory of the delta store.", required=True)
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    add_parser = commands.add_parser('add', help='Add a released blob to the store.')
+    add_parser.add_argument("--blob", help="Blob written by fw_protect.py.", required=True)
+    add_parser.add_argument("--sparse", help="The blob was protected with --sparse.", action='store_true')
+    add_parser.add_argument("--signed", help="The blob ends in a signature.", action='store_true')
+
+    pre_parser = commands.add_parser('precompute', help='Compute the missing patches between releases.')
+    pre_parser.add_argument("--signing-key", help="Release signing key to sign the patches with.", default=None)
+    pre_parser.add_argument("--jobs", help="Patches to compute at once.", type=int, default=os.cpu_count())
+
+    update_parser = commands.add_parser('update', help='Send a device the patch to a release.')
+    update_parser.add_argument("--port", help="Serial port to send update over.", required=True)
+    update_parser.add_argument("--version", help="Version of the release to install.", type=int, required=True)
+    update_parser.add_argument("--reset-port", help="Reset UART (UART0) to reset the device through first.",
+                               default=None)
+    update_parser.add_argument("--frame-size", help="Data bytes per frame, must divide 1024.", type=int,
+                               default=None)
+    args = parser.parse_args()
+
+    store = Store(args.store)
+    if args.command == 'add':
+        with open(args.blob, 'rb') as f:
+            release_id = store.add_release(f.read(), args.sparse, args.signed)
+        print('Added release {}'.format(release_id))
+    elif args.command == 'precompute':
+        precompute(store, args.signing_key, args.jobs)
+    else:
+        update(store, args.port, args.version, args.reset_port, args.frame_size)
@@ -0,0 +1,267 @@
+#!/usr/bin/env python
+"""
+Firmware Layout Tool
+
+Keeps functions at the same flash addresses from one firmware build to the
+next, so an update that changes a few functions leaves most flash pages
+byte-for-byte identical.
+
+Building the firmware with STABLE_LAYOUT=1 links it twice. The first link uses
+firmware.ld as is and writes a map file. `plan` reads every input section of
+.text from that map and places it using the placement map in layout.json:
+
+  - Each module (object file or archive member) owns a fixed slot in .text,
+    sized to its code plus some slack, so it can grow without moving anything
+    else.
+  - Inside its slot, a module's sections keep the order they were first seen
+    in. New sections go after the known ones.
+  - A module that outgrows its slot, or a new module, gets the first gap that
+    fits, or a new slot at the end. Every other module stays where it was.
+
+The result is firmware.ld with the body of .text replaced by the planned
+placement, which the second link uses. layout.json holds each module's slot as
+an offset from the start of .text; it is updated in place and belongs in
+version control next to the release it describes.
+
+`compare` reports how many flash pages two builds have in common.
+"""
+
+import argparse
+import json
+import os
+import re
+
+PINNED = ['.isr_vector', '.text.entry']  # must stay at the very start of .text
+PAGE_SIZE = 1024
+SLOT_ALIGN = 16
+MIN_HEAD = 64
+
+OUTPUT_SECTION = re.compile(r'^(\.\S+)')
+INPUT_SECTION = re.compile(r'^ (\.\S+)(?:\s+(0x[0-9a-fA-F]+)\s+(0x[0-9a-fA-F]+)\s+(\S.*))?$')
+CONTINUATION = re.compile(r'^\s+(0x[0-9a-fA-F]+)\s+(0x[0-9a-fA-F]+)\s+(\S.*)$')
+ARCHIVE_MEMBER = re.compile(r'^(.*)\((.*)\)$')
+
+
+def align(value, alignment=SLOT_ALIGN):
+    return (value + alignment - 1) // alignment * alignment
+
+
+def module_name(path):
+    """
+    Name a module by its file name, and by archive and member name for archive
+    members, so the same layout works wherever the tree is checked out.
+    """
+    member = ARCHIVE_MEMBER.match(path)
+    if member:
+        return '{}({})'.format(os.path.basename(member.group(1)), member.group(2))
+    return os.path.basename(path)
+
+
+def module_pattern(name):
+    """The linker script file pattern matching only this module."""
+    member = ARCHIVE_MEMBER.match(name)
+    if member:
+        return '*{}:{}'.format(member.group(1), member.group(2))
+    # Archive members are matched by their bare name, which never contains a
+    # slash, so this cannot pick up a library member with the same name.
+    return '*/' + name
+
+
+def read_map(path, output='.text'):
+    """
+    Return the (section, size, module) of every non-empty input section placed
+    in the output section, in link order.
+    """
+    sections = []
+    with open(path) as f:
+        lines = iter(f.read().splitlines())
+
+    for line in lines:
+        if line.startswith('Linker script and memory map'):
+            break
+
+    current = None
+    pending = None
+    for line in lines:
+        header = OUTPUT_SECTION.match(line)
+        if header:
+            current = header.group(1)
+            pending = None
+            continue
+        if current != output:
+            continue
+
+        entry = INPUT_SECTION.match(line)
+        if entry:
+            pending = entry.group(1)
+            if entry.group(2) is None:
+                continue  # name too long, the rest is on the next line
+            size, path = int(entry.group(3), 16), entry.group(4)
+        else:
+            rest = CONTINUATION.match(line)
+            if pending is None or not rest:
+                pending = None
+                continue
+            size, path = int(rest.group(2), 16), rest.group(3)
+
+        if size:
+            sections.append((pending, size, module_name(path.strip())))
+        pending = None
+    return sections
+
+
+def load_layout(path):
+    if not os.path.exists(path):
+        return {'head': 0, 'modules': []}
+    with open(path) as f:
+        return json.load(f)
+
+
+def find_gap(modules, size, head):
+    """Offset of the first unused range of at least size bytes after head."""
+    offset = head
+    for module in sorted(modules, key=lambda m: m['offset']):
+        if module['offset'] - offset >= size:
+            return offset
+        offset = max(offset, module['offset'] + module['reserved'])
+    return offset
+
+
+def plan(sections, layout, slack, min_slack):
+    """
+    Update layout for the sections of this build and return what changed as
+    (kept, moved, added) lists of module names.
+    """
+    head_size = sum(size for name, size, _ in sections if name in PINNED)
+    if head_size > layout['head']:
+        if layout['modules']:
+            raise RuntimeError('The pinned sections ({} bytes) outgrew their {} byte slot; '
+                               'delete the layout to start over'.format(head_size, layout['head']))
+        layout['head'] = align(max(MIN_HEAD, head_size + min_slack))
+
+    sizes = {}
+    order = {}
+    for name, size, module in sections:
+        if name in PINNED:
+            continue
+        sizes[module] = sizes.get(module, 0) + size
+        order.setdefault(module, [])
+        if name not in order[module]:
+            order[module].append(name)
+
+    known = {m['name']: m for m in layout['modules'] if m['name'] in sizes}
+    kept, moved, added = [], [], []
+    modules = []
+    for name, module in known.items():
+        module['sections'] = ([s for s in module['sections'] if s in order[name]] +
+                              [s for s in order[name] if s not in module['sections']])
+        if sizes[name] <= module['reserved']:
+            modules.append(module)
+            kept.append(name)
+
+    def reserve(size):
+        return align(size + max(int(size * slack), min_slack))
+
+    for name in sizes:
+        if name in kept:
+            continue
+        module = known.get(name, {'name': name, 'sections': order[name]})
+        module['reserved'] = reserve(sizes[name])
+        module['offset'] = find_gap(modules, module['reserved'], layout['head'])
+        modules.append(module)
+        (moved if name in known else added).append(name)
+
+    layout['modules'] = [{'name': m['name'], 'offset': m['offset'], 'reserved': m['reserved'],
+                          'size': sizes[m['name']], 'sections': m['sections']}
+                         for m in sorted(modules, key=lambda m: m['offset'])]
+    return kept, moved, added
+
+
+def text_body(layout, indent):
+    lines = ['KEEP(*({}))'.format(name) for name in PINNED]
+    end = layout['head']
+    for module in layout['modules']:
+        pattern = module_pattern(module['name'])
+        lines.append('')
+        lines.append('. = 0x{:05x}; /* {}: {} of {} bytes */'.format(
+            module['offset'], module['name'], module['size'], module['reserved']))
+        lines.extend('{}({})'.format(pattern, section) for section in module['sections'])
+        end = max(end, module['offset'] + module['reserved'])
+
+    # Pad to the end of the last slot, so .data does not move either, and
+    # catch anything the plan did not know about after that.
+    lines.append('')
+    lines.append('. = 0x{:05x};'.format(end))
+    lines.append('*(.text*)')
+    lines.append('*(.rodata*)')
+    return [indent + line if line else '' for line in lines]
+
+
+def write_script(template, layout, output):
+    """Write template with the body of its .text section replaced."""
+    with open(template) as f:
+        lines = f.read().splitlines()
+
+    start = next(i for i, line in enumerate(lines) if line.strip() == '_text = .;')
+    end = next(i for i, line in enumerate(lines) if line.strip() == '_etext = .;')
+    indent = lines[start][:len(lines[start]) - len(lines[start].lstrip())]
+
+    result = lines[:start + 1] + text_body(layout, indent) + lines[end:]
+    result.insert(0, '/* Generated by tools/fw_layout.py from {} - do not edit. */'.format(
+        os.path.basename(template)))
+    with open(output, 'w') as f:
+        f.write('\n'.join(result) + '\n')
+
+
+def compare(old_path, new_path, base, page_size):
+    with open(old_path, 'rb') as f:
+        old = f.read()
+    with open(new_path, 'rb') as f:
+        new = f.read()
+
+    pages = (max(len(old), len(new)) + page_size - 1) // page_size
+    changed = [i for i in range(pages)
+               if old[i * page_size:(i + 1) * page_size] != new[i * page_size:(i + 1) * page_size]]
+
+    same = pages - len(changed)
+    print('{} of {} pages identical ({:.1f}%)'.format(same, pages, 100.0 * same / pages if pages else 100.0))
+    for i in changed:
+        print('  changed 0x{:08x}'.format(base + i * page_size))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Firmware Layout Tool')
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    plan_parser = commands.add_parser('plan', help='Place .text using and updating the placement map.')
+    plan_parser.add_argument("--map", help="Map file of a link with the unmodified linker script.",
+                             required=True)
+    plan_parser.add_argument("--layout", help="Placement map to use and update.", required=True)
+    plan_parser.add_argument("--script", help="Linker script to place .text in.", required=True)
+    plan_parser.add_argument("--output", help="Where to write the generated linker script.", required=True)
+    plan_parser.add_argument("--slack", help="Room to grow, as a fraction of a module's size.",
+                             type=float, default=0.125)
+    plan_parser.add_argument("--min-slack", help="Least room to grow per module, in bytes.",
+                             type=int, default=32)
+
+    compare_parser = commands.add_parser('compare', help='Count the flash pages two builds share.')
+    compare_parser.add_argument("old", help="Binary image of the earlier build.")
+    compare_parser.add_argument("new", help="Binary image of the later build.")
+    compare_parser.add_argument("--base", help="Flash address the images start at.",
+                                type=lambda x: int(x, 0), default=0x10000)
+    compare_parser.add_argument("--page-size", help="Flash page size in bytes.", type=int, default=PAGE_SIZE)
+    args = parser.parse_args()
+
+    if args.command == 'compare':
+        compare(args.old, args.new, args.base, args.page_size)
+    else:
+        layout = load_layout(args.layout)
+        kept, moved, added = plan(read_map(args.map), layout, args.slack, args.min_slack)
+        with open(args.layout, 'w') as f:
+            json.dump(layout, f, indent=2)
+            f.write('\n')
+        write_script(args.script, layout, args.output)
+
+        print('  LAYOUT     {} modules in place, {} moved, {} new'.format(len(kept), len(moved), len(added)))
+        for name in moved:
+            print('  MOVED      {} (outgrew its slot)'.format(name))
@@ -0,0 +1,191 @@
+#!/usr/bin/env python
+"""
+Profile Tool
+
+Collects the samples taken by the on-target sampling profiler and symbolizes
+them against the main.axf they were taken from. Works the same on hardware and
+under bl_emulate.py, since QEMU models the LM3S6965's general purpose timers.
+
+Both the firmware (the PROFILE shell command) and the bootloader (built with
+PROFILE=1, dumped by sending 'P' on UART1) print their samples on UART2 as
+
+    PROFILE <count> <hz>
+    <addr>: <hex>
+    ...
+
+where the hex lines are the raw sample buffer: one little-endian (PC, LR) word
+pair per sample.
+
+The flat profile charges each sample to the function containing its PC. The
+folded stacks (for flamegraph.pl and friends) are two frames deep at most,
+using the stacked LR as the caller. LR only still points at the caller while
+the interrupted function has not made a call of its own, so treat the caller
+frame as a hint for anything but leaf functions.
+"""
+
+import argparse
+import bisect
+import collections
+import re
+import struct
+import subprocess
+import sys
+import time
+
+HEADER = re.compile(r'PROFILE (0x[0-9a-fA-F]+|\d+) (0x[0-9a-fA-F]+|\d+)\s*$')
+HEX_LINE = re.compile(r'([0-9a-fA-F]{8}): ([0-9a-fA-F]+)\s*$')
+SAMPLE = struct.Struct('<II')
+EXC_RETURN_MIN = 0xFFFFFFF0  # LR holds one of these when an ISR was interrupted
+UNKNOWN = '??'
+DUMP_TIMEOUT = 30  # seconds to wait for the dump to finish
+
+
+class SymbolTable:
+    """Function symbols of an ELF file, looked up by address."""
+
+    def __init__(self, elf, nm='arm-none-eabi-nm'):
+        out = subprocess.check_output([nm, '-n', '-S', '--defined-only', elf], text=True)
+        self.starts = []
+        self.symbols = []
+        for line in out.splitlines():
+            fields = line.split()
+            if len(fields) != 4 or fields[2] not in 'tTwW':
+                continue
+            start, size = int(fields[0], 16), int(fields[1], 16)
+            if size == 0:
+                continue
+            self.starts.append(start)
+            self.symbols.append((start + size, fields[3]))
+
+    def lookup(self, addr):
+        addr &= ~1  # Thumb bit
+        i = bisect.bisect_right(self.starts, addr) - 1
+        if i < 0 or addr >= self.symbols[i][0]:
+            return UNKNOWN
+        return self.symbols[i][1]
+
+
+def parse_dump(lines):
+    """
+    Find the last complete PROFILE dump in lines and return its
+    (hz, [(pc, lr), ...]).
+    """
+    result = None
+    count = hz = None
+    raw = b''
+    for line in lines:
+        header = HEADER.search(line)
+        if header:
+            count, hz = int(header.group(1), 0), int(header.group(2), 0)
+            raw = b''
+            continue
+        data = HEX_LINE.search(line)
+        if count is None or not data:
+            continue
+        raw += bytes.fromhex(data.group(2))
+        if len(raw) >= count * SAMPLE.size:
+            result = (hz, list(SAMPLE.iter_unpack(raw[:count * SAMPLE.size])))
+            count = None
+    if result is None:
+        raise RuntimeError('No complete PROFILE dump found')
+    return result
+
+
+def collect(port, seconds, hz, bootloader_port):
+    """
+    Take a profile over UART2 and return the lines it printed.
+
+    With bootloader_port the bootloader is already sampling and is only asked
+    to dump; otherwise the firmware shell is told to sample for seconds first.
+    """
+    from serial import Serial
+
+    with Serial(port, baudrate=115200, timeout=1) as ser:
+        ser.reset_input_buffer()
+        if bootloader_port is not None:
+            with Serial(bootloader_port, baudrate=115200, timeout=1) as host:
+                host.write(b'P')
+        else:
+            ser.write('PROFILE START {}\n'.format(hz).encode())
+            time.sleep(seconds)
+            ser.write(b'PROFILE DUMP\n')
+
+        lines = []
+        deadline = time.time() + DUMP_TIMEOUT
+        while time.time() < deadline:
+            line = ser.readline().decode(errors='replace')
+            if not line:
+                continue
+            lines.append(line)
+            try:
+                parse_dump(lines)
+                return lines
+            except RuntimeError:
+                pass
+    raise RuntimeError('Timed out waiting for the PROFILE dump')
+
+
+def frames(symbols, pc, lr):
+    func = symbols.lookup(pc)
+    if lr >= EXC_RETURN_MIN:
+        return [func]
+    caller = symbols.lookup(lr)
+    if caller in (UNKNOWN, func):
+        return [func]
+    return [caller, func]
+
+
+def main(lines, elf, nm, folded_path, top):
+    hz, samples = parse_dump(lines)
+    symbols = SymbolTable(elf, nm)
+
+    flat = collections.Counter()
+    folded = collections.Counter()
+    for pc, lr in samples:
+        stack = frames(symbols, pc, lr)
+        flat[stack[-1]] += 1
+        folded[';'.join(stack)] += 1
+
+    total = len(samples)
+    print('{} samples at {} Hz ({:.2f} s)'.format(total, hz, total / hz))
+    print()
+    print('{:>8}  {:>7}  {:>10}  {}'.format('Samples', 'Percent', 'Est. ms', 'Function'))
+    for func, count in flat.most_common(top):
+        print('{:>8}  {:>6.1f}%  {:>10.1f}  {}'.format(count, 100.0 * count / total, 1000.0 * count / hz, func))
+
+    if folded_path is not None:
+        out = sys.stdout if folded_path == '-' else open(folded_path, 'w')
+        for stack, count in sorted(folded.items()):
+            out.write('{} {}\n'.format(stack, count))
+        if out is not sys.stdout:
+            out.close()
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Profile Tool')
+    parser.add_argument("--elf", help="The main.axf the samples were taken from.",
+                        required=True)
+    parser.add_argument("--port", help="Debug UART (UART2) to take a profile over.",
+                        default=None)
+    parser.add_argument("--input", help="Symbolize a captured UART2 log instead of taking a profile.",
+                        default=None)
+    parser.add_argument("--seconds", help="How long the firmware should sample for.",
+                        type=float, default=5.0)
+    parser.add_argument("--hz", help="Firmware sampling rate.", type=int, default=997)
+    parser.add_argument("--bootloader-port", help="Host UART (UART1) of a PROFILE=1 bootloader to request the dump on.",
+                        default=None)
+    parser.add_argument("--folded", help="Write folded stacks for flamegraph.pl to this file ('-' for stdout).",
+                        default=None)
+    parser.add_argument("--top", help="Number of functions in the flat profile.", type=int, default=20)
+    parser.add_argument("--nm", help="nm to read the symbol table with.", default='arm-none-eabi-nm')
+    args = parser.parse_args()
+
+    if args.input is not None:
+        with open(args.input, errors='replace') as f:
+            lines = f.readlines()
+    elif args.port is not None:
+        lines = collect(args.port, args.seconds, args.hz, args.bootloader_port)
+    else:
+        parser.error('one of --port or --input is required')
+
+    main(lines, args.elf, args.nm, args.folded, args.top)
@@ -1,6 +1,31 @@
 """
 Firmware Bundle-and-Protect Tool
 
+With --signing-key, a 64-byte ECDSA P-256 signature (r || s) over everything
+before it is appended to the blob. fw_update.py --signed sends it ahead of
+the frames, and the bootloader checks it against the hash of the metadata
+and frames once the last frame is in.
+
+With --merkle as well, the signature instead covers the metadata and a Merkle
+manifest (tree root and body length, see merkle.py). The bootloader checks
+it before the first chunk, then each chunk against the root as it arrives.
+
+The input can be a flat .bin starting at the firmware base, the linked ELF
+file (main.axf) or an Intel HEX file. ELF and HEX input is flattened the way
+objcopy -O binary does, zero filling the gaps. With --sparse, the body is a
+list of segments instead, one per contiguous run of the image:
+
+[ 0x04 ]   [ 0x04 ]  [ variable ]
+-------------------------------
+| Address | Length | Data...  |
+-------------------------------
+
+Address and length are big-endian and the segments are in address order.
+The release message is the last segment, right after the image, and the
+metadata size is the image's span from the firmware base. The bootloader
+(fw_update.py --sparse) erases and programs only the pages some segment
+touches. CBC over the whole image can't be split along segments, so sparse
+bodies are not encrypted; sign them with --signing-key.
 """
 import argparse
 import struct
@@ -8,89 +33,210 @@ from Crypto.Cipher import AES
 from Crypto.Util.Padding import pad
 
 from Crypto.Hash import HMAC, SHA256
+from Crypto.PublicKey import ECC
+from Crypto.Signature import DSS
+
+import merkle
+
+HMAC_KEY = b'0123456789012345678901234567890123456789012345678901234567890123'
+FW_BASE = 0x10000  # where the bootloader puts the firmware
+PT_LOAD = 1
+SEGMENT_HEADER = struct.Struct('>II')
+
+
+def read_elf(raw):
+    """The (address, data) of each loadable segment, at its load address."""
+    if raw[4] != 1 or raw[5] != 1:
+        raise ValueError('Only 32-bit little-endian ELF files are supported')
+    phoff, = struct.unpack_from('<I', raw, 0x1C)
+    phentsize, phnum = struct.unpack_from('<HH', raw, 0x2A)
+
+    segments = []
+    for i in range(phnum):
+        p_type, p_offset, _, p_paddr, p_filesz = struct.unpack_from('<IIIII', raw, phoff + i * phentsize)
+        if p_type == PT_LOAD and p_filesz:
+            segments.append((p_paddr, raw[p_offset:p_offset + p_filesz]))
+    return segments
+
+
+def read_ihex(text):
+    """The (address, data) of each data record, with extended addresses applied."""
+    segments = []
+    base = 0
+    for line in text.splitlines():
+        line = line.strip()
+        if not line:
+            continue
+        if not line.startswith(':'):
+            raise ValueError('Not an Intel HEX record: {}'.format(line))
+        record = bytes.fromhex(line[1:])
+        if sum(record) & 0xFF:
+            raise ValueError('Bad Intel HEX checksum: {}'.format(line))
+        length, offset, kind = record[0], (record[1] << 8) | record[2], record[3]
+        payload = record[4:4 + length]
+        if kind == 0x00:
+            segments.append((base + offset, payload))
+        elif kind == 0x01:
+            break
+        elif kind == 0x02:
+            base = int.from_bytes(payload, 'big') << 4
+        elif kind == 0x04:
+            base = int.from_bytes(payload, 'big') << 16
+    return segments
+
+
+def load_segments(path):
+    """
+    Read a firmware image as (address, data) segments, in address order and
+    with touching pieces joined.
+    """
+    with open(path, 'rb') as fp:
+        raw = fp.read()
+
+    if raw.startswith(b'\x7fELF'):
+        segments = read_elf(raw)
+    elif raw.startswith(b':'):
+        segments = read_ihex(raw.decode('ascii'))
+    else:
+        segments = [(FW_BASE, raw)]
+
+    merged = []
+    for addr, data in sorted(segments):
+        if merged and addr < merged[-1][0] + len(merged[-1][1]):
+            raise ValueError('Overlapping data at 0x{:08x}'.format(addr))
+        if merged and addr == merged[-1][0] + len(merged[-1][1]):
+            merged[-1] = (merged[-1][0], merged[-1][1] + data)
+        else:
+            merged.append((addr, bytes(data)))
+
+    if merged and merged[0][0] < FW_BASE:
+        raise ValueError('Image starts at 0x{:08x}, below the firmware base'.format(merged[0][0]))
+    return merged
+
 
-def protect_firmware(infile, outfile, version, message):
-    # Load firmware binary from infile
-    with open(infile, 'rb') as fp:
-        firmware = fp.read()
+def flatten(segments):
+    """The image from FW_BASE on, with zeros in the gaps."""
+    image = bytearray()
+    for addr, data in segments:
+        image += bytes(addr - FW_BASE - len(image))
+        image += data
+    return bytes(image)
+
+
+def sparse_body(segments, message):
+    """
+    The segments and, right behind the image, the release message, each with
+    its segment header. Returns the body and the image's span.
+    """
+    size = segments[-1][0] + len(segments[-1][1]) - FW_BASE
+    segments = segments + [(FW_BASE + size, message.encode() + b'\00')]
+    return b''.join(SEGMENT_HEADER.pack(addr, len(data)) + data for addr, data in segments), size
+
+
+def protect_firmware(infile, outfile, version, message, signing_key=None, merkle_manifest=False, sparse=False):
+    segments = load_segments(infile)
+
+    if sparse:
+        body, size = sparse_body(segments, message)
+        if size > 0xFFFF:
+            raise ValueError('Image span of {} bytes does not fit the metadata'.format(size))
+        firmware_blob = struct.pack('<HH', version, size) + body
+        if signing_key is not None:
+            firmware_blob += sign_blob(firmware_blob, signing_key)
+        with open(outfile, 'wb+') as outfile:
+            outfile.write(firmware_blob)
+        return
+
+    firmware = flatten(segments)
 
-    #encrypts the firmware w cbc mode aes-128
-    encrypted_firmware = cbc_encryption(firmware)
-    
     # Pack version and size into two little-endian shorts
-    metadata = struct.pack('<HH', version, len(firmware))
-    
-    
-    #generates an hmac from the unencrypted metadata and the encrypted firmware
-    hmac = hmac_generation(metadata, encrypted_firmware)
-    
-    
-    # Append null-terminated message to end of firmware
-    firmware_and_message = encrypted_firmware + message.encode() + b'\00'
+    metadata = make_metadata(version, firmware)
 
-   
+    # Encrypted firmware, release message and HMAC, appended to the metadata
+    firmware_blob = metadata + b''.join(protect_stream(firmware, metadata, message))
 
-    # Append firmware and message to metadata
-    firmware_blob = metadata + firmware_and_message + hmac
+    if signing_key is not None and merkle_manifest:
+        firmware_blob += sign_blob(metadata + merkle.manifest(firmware_blob[4:]), signing_key)
+    elif signing_key is not None:
+        firmware_blob += sign_blob(firmware_blob, signing_key)
 
     # Write firmware blob to outfile
     with open(outfile, 'wb+') as outfile:
         outfile.write(firmware_blob)
 
-def cbc_encryption(firmware):
-    #Firmware format is just the firmware. The size and release message are to be added later. 
-    #mode is aes-128
-    #How do i read the key from the text file? Which key will it be?
-    #Append IVs to the end of the ciphertext
-    #128 bit IV
+def make_metadata(version, firmware):
+    return struct.pack('<HH', version, len(firmware))
+
+def protected_body_len(firmware_len, message):
+    #ciphertext padded to whole AES blocks, the IV, the message and its null, the HMAC
+    return (firmware_len // AES.block_size + 1) * AES.block_size + AES.block_size + len(message.encode()) + 1 + SHA256.digest_size
+
+def protect_stream(firmware, metadata, message, chunk_size=1024):
+    """
+    Generate the body of a flat blob (everything after the metadata) a piece
+    at a time, as it is encrypted: the firmware encrypted with AES-128 in CBC
+    mode, chunk_size bytes at a time (a multiple of the block size), then the
+    IV, the null-terminated release message, and last the HMAC over the
+    metadata and everything encrypted. fw_update.py --stream sends the pieces
+    as they come, so the first frame doesn't wait for the whole image.
+    """
+    if chunk_size % AES.block_size:
+        raise ValueError('Chunk size must be a multiple of {}'.format(AES.block_size))
+
+    cipher = AES.new(cbc_key(), AES.MODE_CBC)  #makes a cipher object with a random IV
+    h = HMAC.new(HMAC_KEY, digestmod=SHA256)
+    h.update(metadata)
+
+    #pads the firmware so its length is a multiple of 16 bytes
+    padded = pad(firmware, AES.block_size)
+    for start in range(0, len(padded), chunk_size):
+        ciphertext = cipher.encrypt(padded[start:start + chunk_size])
+        h.update(ciphertext)
+        yield ciphertext
+
+    #The IV goes after the ciphertext. The metadata has the size, so the IV will be easily distinguished
+    h.update(cipher.iv)
+    yield cipher.iv
+
+    yield message.encode() + b'\00'
+    yield h.digest()
+
+def cbc_key():
+    #The keys are generated with one line being CBC and the next line being HMAC
+    #The CBC key will be the second to last item in the list.
     with open('secret_build_output.txt','rb') as fp:
         key = fp.readlines()  #Returns a list. Each line is an index in the list.
-        key = key[-2]  #key should be 16 bytes long. 
-        #The keys are generated with one line being CBC and the next line being HMAC
-        #The CBC key will be the second to last item in the list.
-        key = key.rstrip()  #removes any possible newlines 
-        
-    cipher = AES.new(key, AES.MODE_CBC)  #makes a cipher object with a random IV
-    
-    ciphertext = cipher.encrypt(pad(firmware, AES.block_size)) 
-    #encrypts the firmware and pads it so the firmware length is a multiple of 16 bytes
-    
-    ciphertext = bytearray(ciphertext)
-    iv = bytearray(cipher.iv)
-    #makes these into bytearrays so they can be concatenated together
-    
-    final_encrypt = ciphertext + iv  
-    #The final encryption to be returned
-    #The firmware sends the metadata size, so the IV will be easily distinguished
-    
-    return final_encrypt  #returns CBC encryption
-    
-def hmac_generation(metadata, ciphertext):
-#     with open("secret_build_output.txt", "rb") as f:
-#         key_list = f.readlines()
-#     key = key_list[1].rstrip()
-
-    
-    key = b'0123456789012345678901234567890123456789012345678901234567890123'
-    
-    #generates a new hmac object
-    h = HMAC.new(key, digestmod=SHA256)
-    
-    #makes an hmac for the unencrypted metadata and the encrypted firmware
-    h.update(metadata)
-    h.update(ciphertext)
-    
-    
-    #returns that hmac
-    return h.digest()
+        key = key[-2]  #key should be 16 bytes long.
+        key = key.rstrip()  #removes any possible newlines
+    return key
 
+def sign_blob(blob, key_path):
+    #signs the metadata and everything the bootloader will receive after it
+    #the bootloader hashes exactly these bytes as the frames arrive
+    with open(key_path, 'rt') as fp:
+        key = ECC.import_key(fp.read())
+
+    #fips-186-3 gives the raw r || s encoding the bootloader expects
+    return DSS.new(key, 'fips-186-3').sign(SHA256.new(blob))
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Firmware Update Tool')
-    parser.add_argument("--infile", help="Path to the firmware image to protect.", required=True)
+    parser.add_argument("--infile", help="Path to the firmware image to protect (.bin, ELF or Intel HEX).",
+                        required=True)
     parser.add_argument("--outfile", help="Filename for the output firmware.", required=True)
     parser.add_argument("--version", help="Version number of this firmware.", required=True)
     parser.add_argument("--message", help="Release message for this firmware.", required=True)
+    parser.add_argument("--signing-key", help="Release signing key (signing_key.pem from bl_build.py) to sign the blob with.", default=None)
+    parser.add_argument("--merkle", help="Sign a Merkle manifest of the blob instead of the blob itself (needs --signing-key).",
+                        action='store_true')
+    parser.add_argument("--sparse", help="Emit the image as address/data segments, skipping the gaps.",
+                        action='store_true')
     args = parser.parse_args()
 
-    protect_firmware(infile=args.infile, outfile=args.outfile, version=int(args.version), message=args.message)
+    if args.merkle and args.signing_key is None:
+        parser.error("--merkle needs --signing-key")
+    if args.merkle and args.sparse:
+        parser.error("--merkle can not be combined with --sparse")
+
+    protect_firmware(infile=args.infile, outfile=args.outfile, version=int(args.version), message=args.message,
+                     signing_key=args.signing_key, merkle_manifest=args.merkle, sparse=args.sparse)
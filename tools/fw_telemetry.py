@@ -0,0 +1,117 @@
+#!/usr/bin/env python
+"""
+Telemetry Tool
+
+Collects the lifetime counters the bootloader keeps in flash (see
+bootloader/src/telemetry.c) from one or more devices and adds them up.
+
+Sending 'T' on the host UART (UART1) gets the echo 'T' and one record:
+
+[ 0x02 ]   [ 0x02 ]  [ 0x40 ]     [ 2 x pages ]  [ 0x04 ]
+-----------------------------------------------------------
+| Version | Pages  | Counters   | Erase counts | CRC-32  |
+-----------------------------------------------------------
+
+Everything before the CRC-32 is little-endian: sixteen 32-bit counters (the
+last four reserved) and one 16-bit erase count per 1KB flash page. The CRC-32
+is big-endian, like in the update protocol.
+
+Each device's counters are printed, then the fleet totals and the most worn
+pages across all devices. --json writes everything out for other tools.
+"""
+
+import argparse
+import json
+import struct
+import zlib
+
+DUMP_VERSION = 1
+HEADER = struct.Struct('<HH')
+COUNTERS = ['boot_count', 'updates_started', 'updates_committed', 'frames', 'bytes', 'crc_failures',
+            'retransmits', 'overruns', 'fec_corrected', 'last_update_ms', 'total_update_ms', 'max_update_ms']
+COUNTER_WORDS = 16
+MAXIMA = ('last_update_ms', 'max_update_ms')  # aggregated with max() instead of sum()
+FLASH_PAGESIZE = 1024
+
+
+def read_telemetry(ser):
+    """Request and parse one telemetry record. Returns (counters, erase_counts)."""
+    ser.reset_input_buffer()
+    ser.write(b'T')
+    if ser.read(1) != b'T':
+        raise RuntimeError('No telemetry echo; is the bootloader in its command loop?')
+
+    header = ser.read(HEADER.size)
+    if len(header) != HEADER.size:
+        raise RuntimeError('Telemetry record cut short')
+    version, pages = HEADER.unpack(header)
+    if version != DUMP_VERSION:
+        raise RuntimeError('Unknown telemetry version {}'.format(version))
+
+    body_len = COUNTER_WORDS * 4 + pages * 2
+    body = ser.read(body_len)
+    crc = ser.read(4)
+    if len(body) != body_len or len(crc) != 4:
+        raise RuntimeError('Telemetry record cut short')
+    if zlib.crc32(header + body) != struct.unpack('>I', crc)[0]:
+        raise RuntimeError('Telemetry record failed its CRC')
+
+    words = struct.unpack_from('<{}I'.format(COUNTER_WORDS), body)
+    counters = dict(zip(COUNTERS, words))
+    erase_counts = list(struct.unpack_from('<{}H'.format(pages), body, COUNTER_WORDS * 4))
+    return counters, erase_counts
+
+
+def aggregate(devices):
+    """Fleet totals, and the highest erase count of each page over all devices."""
+    totals = {}
+    for name in COUNTERS:
+        values = [d['counters'][name] for d in devices]
+        totals[name] = max(values) if name in MAXIMA else sum(values)
+    pages = max(len(d['erase_counts']) for d in devices)
+    worst = [max(d['erase_counts'][i] for d in devices if i < len(d['erase_counts'])) for i in range(pages)]
+    return totals, worst
+
+
+def print_counters(title, counters):
+    print(title)
+    for name in COUNTERS:
+        print('  {:<18} {}'.format(name, counters[name]))
+
+
+def main(ports, json_path, top):
+    from serial import Serial
+
+    devices = []
+    for port in ports:
+        with Serial(port, baudrate=115200, timeout=2) as ser:
+            counters, erase_counts = read_telemetry(ser)
+        devices.append({'port': port, 'counters': counters, 'erase_counts': erase_counts})
+        print_counters(port, counters)
+        print()
+
+    totals, worst = aggregate(devices)
+    if len(devices) > 1:
+        print_counters('Fleet ({} devices)'.format(len(devices)), totals)
+        print()
+
+    print('Most erased pages:')
+    ranked = sorted(range(len(worst)), key=lambda i: worst[i], reverse=True)
+    for page in ranked[:top]:
+        if worst[page]:
+            print('  0x{:05x}  {}'.format(page * FLASH_PAGESIZE, worst[page]))
+
+    if json_path is not None:
+        with open(json_path, 'w') as f:
+            json.dump({'devices': devices, 'totals': totals, 'worst_erase_counts': worst}, f, indent=2)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Telemetry Tool')
+    parser.add_argument("--port", help="Host UART (UART1) of each device to collect from.",
+                        nargs='+', required=True)
+    parser.add_argument("--json", help="Also write the records and totals to this file.", default=None)
+    parser.add_argument("--top", help="Number of most erased pages to list.", type=int, default=10)
+    args = parser.parse_args()
+
+    main(args.port, args.json, args.top)
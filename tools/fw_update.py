@@ -2,33 +2,312 @@
 """
 Firmware Updater Tool
 
-A frame consists of two sections:
+A frame consists of four sections:
 1. Two bytes for the length of the data section
-2. A data section of length defined in the length section
-
-[ 0x02 ]  [ variable ]
---------------------
-| Length | Data... |
---------------------
-
-In our case, the data is from one line of the Intel Hex formated .hex file
+2. Two bytes for the sequence number of the frame
+3. A data section of length defined in the length section
+4. A CRC-32 over everything before it
+
+[ 0x02 ]  [ 0x02 ]  [ variable ]  [ 0x04 ]
+------------------------------------------
+| Length | Seq    | Data...     | CRC-32 |
+------------------------------------------
+
+All fields are big-endian. The metadata is sent the same way: version and
+size, four bytes of session options (flags, FEC parity bytes, FEC frame
+size, reserved), and a CRC-32. In a signed session the 64-byte signature
+from fw_protect.py follows the metadata, again with a CRC-32.
+
+In a sparse session (fw_protect.py --sparse) the frames carry the image as
+address/length/data segments, and the bootloader only erases and programs
+the pages they touch. The framing is the same.
+
+In a Merkle session (fw_protect.py --merkle) the signature is followed by the
+manifest it covers: the Merkle root and body length, with a CRC-32. The body
+then goes over as one frame per 1KB chunk, with the chunk index as sequence
+number and the chunk's Merkle proof after its data. Chunks can be sent in any
+order; the bootloader NAKs the closing zero-length frame with the first index
+it is still missing.
+
+With --stream, --firmware is the build output instead of a protected blob.
+It is protected on the fly (fw_protect.protect_stream()), and each frame is
+made from the ciphertext as it comes out, so the first frame goes out
+without waiting for the whole image and no blob is written. The HMAC comes
+last, as in the blob. Streamed updates can't be signed, since the signature
+has to go ahead of the frames.
+
+With FEC, every frame carries the same number of data bytes (the last one is
+zero padded) and ends in Reed-Solomon parity over the whole frame, so the
+bootloader can repair a corrupted frame without asking for it again.
+
+With --bond-port, the frames are striped across two links: --port (the
+bootloader's UART1) and the bootloader's UART2, which otherwise carries its
+debug output. Each link sends a frame and waits for the answer on that link
+before taking the next one, so both are busy at once and a NAK on one does
+not hold up the other. The bootloader places each frame in its page buffer
+by sequence number, but only holds one page, so the frames of a page are
+only handed out once every frame of the pages before it is acknowledged.
+The closing frame goes over UART1. Bonded frames carry 32 to 128 bytes and
+can not be combined with FEC, Merkle chunks or segments.
+
+Before anything is sent, the bootloader is asked what it has installed ('Q'):
+version and size, the length of the body (everything the frames carry) and
+its SHA-256, with a CRC-32. If that is the body about to be sent, the update
+is skipped; if the bootloader would reject the version anyway, it fails
+before the transfer. --force sends the update regardless.
 
 We write a frame to the bootloader, then wait for it to respond with an
 OK message so we can write the next frame. The OK message in this case is
-just a zero
+just a zero. If the frame got corrupted on the way, the bootloader responds
+with a NAK (0x02) followed by the sequence number it wants next, and only
+that frame is sent again.
 """
 
 import argparse
+import hashlib
+import random
 import struct
+import threading
 import time
+import zlib
 
 from serial import Serial
 
+import fw_protect
+import merkle
+import uart_capture
+
 RESP_OK = b'\x00'
+RESP_ERROR = b'\x01'
+RESP_NAK = b'\x02'
+RESP_ERROR_CHECK = b'\xfe'  # follows a real ERROR; OK and ERROR are one bit apart
 FRAME_SIZE = 16
-
-
-def send_metadata(ser, metadata, debug=False):
+METADATA_SEQ = 0xFFFF  # sequence number the bootloader NAKs bad metadata with
+SIGNATURE_SEQ = 0xFFFE  # ... and a bad signature packet with
+MANIFEST_SEQ = 0xFFFD  # ... and a bad Merkle manifest with
+SIGNATURE_LEN = 64
+MAX_RETRIES = 10  # attempts per frame before giving up
+OPT_FEC = 0x01  # session option: frames carry Reed-Solomon parity
+OPT_SIGNED = 0x02  # session option: a signature follows the metadata
+OPT_MERKLE = 0x04  # session option: a Merkle manifest follows the signature
+OPT_SPARSE = 0x08  # session option: the body is a list of segments
+OPT_BONDED = 0x10  # session option: frames are striped across UART1 and UART2
+BOND_MIN_FRAME = 32
+BOND_MAX_FRAME = 128
+PAGE_SIZE = 1024
+RS_MAX_BLOCK = 255
+RS_MAX_PARITY = 32
+INSTALL_INFO_LEN = 40  # version, size, body length and SHA-256, before the CRC-32
+RESET_BYTE = b'\x20'
+RESET_SETTLE_TIME = 0.5  # seconds for the bootloader to come back up after a reset
+
+
+def reset_device(reset_port):
+    """
+    Reset the device through its reset UART (UART0).
+
+    A software reset keeps the bootloader in its command loop instead of
+    autobooting the installed firmware, so an update can always start after
+    this.
+    """
+    with Serial(reset_port, baudrate=115200, timeout=2) as reset_ser:
+        reset_ser.write(RESET_BYTE)
+    time.sleep(RESET_SETTLE_TIME)
+
+
+def _gf_tables():
+    exp, log = [0] * 512, [0] * 256
+    x = 1
+    for i in range(255):
+        exp[i] = x
+        log[x] = i
+        x <<= 1
+        if x & 0x100:
+            x ^= 0x11D
+    exp[255:] = exp[:257]
+    return exp, log
+
+
+GF_EXP, GF_LOG = _gf_tables()
+
+
+def gf_mul(a, b):
+    if a == 0 or b == 0:
+        return 0
+    return GF_EXP[GF_LOG[a] + GF_LOG[b]]
+
+
+def rs_generator(nparity):
+    """Generator polynomial with roots alpha^0 .. alpha^(nparity-1), highest degree first."""
+    gen = [1]
+    for j in range(nparity):
+        root = GF_EXP[j]
+        gen = [a ^ gf_mul(b, root) for a, b in zip(gen + [0], [0] + gen)]
+    return gen
+
+
+def rs_encode(msg, nparity):
+    """
+    Systematic Reed-Solomon encoding over GF(256): msg followed by nparity
+    parity bytes. The bootloader's rs_decode() corrects up to nparity // 2
+    corrupted bytes anywhere in the block.
+    """
+    gen = rs_generator(nparity)
+    rem = [0] * nparity
+    for byte in msg:
+        factor = byte ^ rem[0]
+        rem = rem[1:] + [0]
+        if factor:
+            for i in range(nparity):
+                rem[i] ^= gf_mul(gen[i + 1], factor)
+    return bytes(msg) + bytes(rem)
+
+
+class TransferStats:
+    """Counts what a noisy link cost during one update."""
+
+    def __init__(self):
+        self.crc_failures = 0  # NAKs received from the bootloader
+        self.retransmits = 0   # frames sent more than once
+        self.bytes_sent = 0
+
+    def __str__(self):
+        return 'CRC failures: {}, retransmits: {}, bytes sent: {}'.format(
+            self.crc_failures, self.retransmits, self.bytes_sent)
+
+
+def add_crc(packet):
+    return packet + struct.pack('>I', zlib.crc32(packet))
+
+
+def make_frame(seq, data, fec_parity=0, frame_size=0):
+    if not fec_parity:
+        return add_crc(struct.pack('>HH', len(data), seq) + data)
+
+    # The CRC covers the real data only; the padding is protected by the parity.
+    header = struct.pack('>HH', len(data), seq)
+    crc = struct.pack('>I', zlib.crc32(header + data))
+    return rs_encode(header + data.ljust(frame_size, b'\x00') + crc, fec_parity)
+
+
+def session_options(fec_parity, frame_size, signed=False, merkle_manifest=False, sparse=False, bonded=False):
+    flags = OPT_SIGNED if signed else 0
+    if merkle_manifest:
+        flags |= OPT_SIGNED | OPT_MERKLE
+    if sparse:
+        flags |= OPT_SPARSE
+    if bonded:
+        return struct.pack('BBBB', flags | OPT_BONDED, 0, frame_size, 0)
+    if not fec_parity:
+        return struct.pack('BBBB', flags, 0, 0, 0)
+    return struct.pack('BBBB', flags | OPT_FEC, fec_parity, frame_size, 0)
+
+
+def check_frame_size(frame_size, fec_parity, bonded=False):
+    """Frames have to tile a 1KB flash page, and an FEC frame has to fit one RS block."""
+    if frame_size <= 0 or PAGE_SIZE % frame_size:
+        raise ValueError('Frame size must divide 1024')
+    if bonded and not BOND_MIN_FRAME <= frame_size <= BOND_MAX_FRAME:
+        raise ValueError('Bonded frames must carry {} to {} bytes'.format(BOND_MIN_FRAME, BOND_MAX_FRAME))
+    if fec_parity:
+        if fec_parity % 2 or fec_parity > RS_MAX_PARITY:
+            raise ValueError('FEC parity must be even and at most {}'.format(RS_MAX_PARITY))
+        if 8 + frame_size + fec_parity > RS_MAX_BLOCK:
+            raise ValueError('FEC frame does not fit a {} byte block'.format(RS_MAX_BLOCK))
+
+
+def read_response(ser):
+    """
+    Wait for the bootloader's answer to a frame.
+
+    Returns (RESP_OK, None), (RESP_NAK, seq), or (None, None) when the answer
+    was lost or garbled. Raises on ERROR, which the bootloader only sends for
+    problems a retransmission can't fix, right before it resets.
+    """
+    resp = ser.read(1)
+    if resp == RESP_OK:
+        return RESP_OK, None
+    if resp == RESP_NAK:
+        seq = ser.read(2)
+        if len(seq) == 2:
+            return RESP_NAK, struct.unpack('>H', seq)[0]
+    elif resp == RESP_ERROR and ser.read(1) == RESP_ERROR_CHECK:
+        raise RuntimeError("ERROR: Bootloader rejected the update")
+
+    # Let whatever is left of a garbled answer arrive, then drop it.
+    time.sleep(0.1)
+    ser.reset_input_buffer()
+    return None, None
+
+
+def query_installed(ser):
+    """
+    Ask the bootloader what is installed.
+
+    Returns (version, size, body_len, digest), where body_len is 0 if the
+    bootloader does not know the installed body, or None if there was no
+    valid answer (bootloaders without the query ignore it).
+    """
+    ser.reset_input_buffer()
+    ser.write(b'Q')
+    if ser.read(1) != b'Q':
+        return None
+    reply = ser.read(INSTALL_INFO_LEN + 4)
+    if len(reply) != INSTALL_INFO_LEN + 4 or add_crc(reply[:INSTALL_INFO_LEN]) != reply:
+        return None
+
+    version, size, body_len = struct.unpack_from('<HH', reply) + struct.unpack_from('>I', reply, 4)
+    return version, size, body_len, reply[8:INSTALL_INFO_LEN]
+
+
+def already_installed(ser, metadata, body):
+    """
+    Query the bootloader and check the update against what it has installed.
+
+    Returns True if body is what is installed already; pass None to only
+    check the version. Raises if the bootloader would reject the update's
+    version.
+    """
+    installed = query_installed(ser)
+    if installed is None:
+        print('Bootloader did not answer the query, sending the update.')
+        return False
+
+    installed_version, _, body_len, digest = installed
+    version, _ = struct.unpack_from('<HH', metadata)
+    print('Installed version: {}'.format(installed_version))
+    if body is not None and body_len == len(body) and digest == hashlib.sha256(body).digest():
+        return True
+    if version != 0 and version < installed_version:
+        raise RuntimeError("ERROR: Bootloader would reject version {} over version {}".format(
+            version, installed_version))
+    return False
+
+
+def send_packet(ser, packet, stats, later_naks, name):
+    """
+    Send a control packet until the bootloader takes it.
+
+    A NAK for one of later_naks (whatever the bootloader expects next) means
+    the packet got through but the OK did not.
+    """
+    packet = add_crc(packet)
+    for attempt in range(MAX_RETRIES):
+        if attempt:
+            stats.retransmits += 1
+        ser.write(packet)
+        stats.bytes_sent += len(packet)
+
+        resp, seq = read_response(ser)
+        if resp == RESP_OK or (resp == RESP_NAK and seq in later_naks):
+            return
+        if resp == RESP_NAK:
+            stats.crc_failures += 1
+
+    raise RuntimeError("ERROR: Bootloader did not accept the {}".format(name))
+
+
+def send_metadata(ser, metadata, stats, options=bytes(4), signature=None, manifest=None, debug=False):
     version, size = struct.unpack_from('<HH', metadata)
     print(f'Version: {version}\nSize: {size} bytes\n')
 
@@ -43,62 +322,316 @@ def send_metadata(ser, metadata, debug=False):
     if debug:
         print(metadata)
 
-    ser.write(metadata)
-
     # Wait for an OK from the bootloader.
-    resp = ser.read()
-    if resp != RESP_OK:
-        raise RuntimeError("ERROR: Bootloader responded with {}".format(repr(resp)))
-
-
-def send_frame(ser, frame, debug=False):
-    ser.write(frame)  # Write the frame...
+    if signature is None:
+        send_packet(ser, metadata + options, stats, (0,), 'metadata')
+    elif manifest is None:
+        send_packet(ser, metadata + options, stats, (SIGNATURE_SEQ, 0), 'metadata')
+        send_packet(ser, signature, stats, (0,), 'signature')
+    else:
+        send_packet(ser, metadata + options, stats, (SIGNATURE_SEQ, MANIFEST_SEQ, 0), 'metadata')
+        send_packet(ser, signature, stats, (MANIFEST_SEQ, 0), 'signature')
+        send_packet(ser, manifest, stats, (0,), 'manifest')
+
+
+def send_frames(ser, frames, stats, debug=False):
+    """
+    Send frames in order, resending whichever one the bootloader asks for.
+    """
+    seq = 0
+    attempts = 0
+    while seq < len(frames):
+        frame = frames[seq]
+        ser.write(frame)  # Write the frame...
+        stats.bytes_sent += len(frame)
 
-    if debug:
-        print(frame)
+        if debug:
+            print(frame)
 
-    resp = ser.read()  # Wait for an OK from the bootloader
+        resp, nak_seq = read_response(ser)  # Wait for an OK from the bootloader
 
-    time.sleep(0.1)
+        if resp == RESP_OK:
+            if debug:
+                print("Resp: {}".format(ord(resp)))
+            seq += 1
+            attempts = 0
+            continue
 
-    if resp != RESP_OK:
-        raise RuntimeError("ERROR: Bootloader responded with {}".format(repr(resp)))
-
-    if debug:
-        print("Resp: {}".format(ord(resp)))
+        attempts += 1
+        if attempts > MAX_RETRIES:
+            raise RuntimeError("ERROR: Frame {} failed {} times".format(seq, attempts))
 
+        stats.retransmits += 1
+        if resp == RESP_NAK:
+            stats.crc_failures += 1
+            if nak_seq <= seq:
+                seq = nak_seq
 
-def main(ser, infile, debug):
+        if debug:
+            print("Resending frame {}".format(seq))
+
+
+class StreamFrames:
+    """
+    The frames for a body that is still being produced, as a sequence for
+    send_frames(). Each frame is made when it is first asked for, from the
+    pieces pulled off the stream so far, and kept in case it has to be resent.
+    The body's length has to be known up front.
+    """
+
+    def __init__(self, pieces, body_len, fec_parity, frame_size):
+        self.pieces = iter(pieces)
+        self.pending = b''
+        self.frames = []
+        self.fec_parity = fec_parity
+        self.frame_size = frame_size
+        # Plus the zero length frame that ends the transfer.
+        self.count = (body_len + frame_size - 1) // frame_size + 1
+
+    def __len__(self):
+        return self.count
+
+    def __getitem__(self, seq):
+        while len(self.frames) <= seq < self.count:
+            idx = len(self.frames)
+            for piece in self.pieces:
+                self.pending += piece
+                if len(self.pending) >= self.frame_size:
+                    break
+            data, self.pending = self.pending[:self.frame_size], self.pending[self.frame_size:]
+            if (idx == self.count - 1) != (not data):
+                raise RuntimeError('Stream length does not match the {} frames expected'.format(self.count))
+            self.frames.append(make_frame(idx, data, self.fec_parity, self.frame_size))
+        return self.frames[seq]
+
+
+def send_bonded(links, frames, stats, frames_per_page, debug=False):
+    """
+    Stripe frames across the links, then send the closing frame (the last of
+    frames) on the first link.
+
+    Every link runs in its own thread and takes the next frame as soon as
+    its last one is acknowledged, resending just its own frame on a NAK. A
+    frame is only taken once every frame of the pages before its own is
+    acknowledged, since the bootloader only buffers one page.
+    """
+    data_frames = len(frames) - 1
+    acked = [False] * data_frames
+    cond = threading.Condition()
+    state = {'next': 0, 'prefix': 0, 'error': None}
+
+    def may_take():
+        seq = state['next']
+        return (state['error'] is not None or seq >= data_frames or
+                state['prefix'] >= seq // frames_per_page * frames_per_page)
+
+    def send_one(ser, seq):
+        attempts = 0
+        while True:
+            ser.write(frames[seq])
+            with cond:
+                stats.bytes_sent += len(frames[seq])
+            resp, _ = read_response(ser)
+            if resp == RESP_OK:
+                return
+
+            attempts += 1
+            with cond:
+                if state['error'] is not None:
+                    return
+                if attempts > MAX_RETRIES:
+                    raise RuntimeError("ERROR: Frame {} failed {} times".format(seq, attempts))
+                stats.retransmits += 1
+                if resp == RESP_NAK:
+                    stats.crc_failures += 1
+            if debug:
+                print("Resending frame {} on {}".format(seq, ser.port))
+
+    def run(ser):
+        try:
+            while True:
+                with cond:
+                    cond.wait_for(may_take)
+                    if state['error'] is not None or state['next'] >= data_frames:
+                        return
+                    seq = state['next']
+                    state['next'] += 1
+                send_one(ser, seq)
+                with cond:
+                    acked[seq] = True
+                    while state['prefix'] < data_frames and acked[state['prefix']]:
+                        state['prefix'] += 1
+                    cond.notify_all()
+        except Exception as e:
+            with cond:
+                if state['error'] is None:
+                    state['error'] = e
+                cond.notify_all()
+
+    threads = [threading.Thread(target=run, args=(ser,), daemon=True) for ser in links]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    if state['error'] is not None:
+        raise state['error']
+
+    # Everything is acknowledged, so only a lost frame the bootloader NAKs
+    # the closing frame for needs to go out again.
+    ser = links[0]
+    attempts = 0
+    frame = frames[-1]
+    while True:
+        ser.write(frame)
+        stats.bytes_sent += len(frame)
+        resp, nak_seq = read_response(ser)
+        if resp == RESP_OK:
+            if frame is frames[-1]:
+                return
+            frame = frames[-1]
+            continue
+
+        attempts += 1
+        if attempts > MAX_RETRIES:
+            raise RuntimeError("ERROR: Closing frame failed {} times".format(attempts))
+        stats.retransmits += 1
+        if resp == RESP_NAK:
+            stats.crc_failures += 1
+            frame = frames[nak_seq] if nak_seq < data_frames else frames[-1]
+
+
+def send_chunks(ser, body, stats, shuffle=False, debug=False):
+    """
+    Send the body as Merkle chunks, in order or shuffled, then the closing
+    frame. Whatever the bootloader NAKs goes out next.
+    """
+    levels = merkle.build_tree(body)
+    chunks = merkle.chunks(body)
+    frames = [make_frame(idx, chunk + merkle.proof(levels, idx)) for idx, chunk in enumerate(chunks)]
+    terminator = make_frame(len(frames), b'')
+
+    pending = list(range(len(frames)))
+    if shuffle:
+        random.shuffle(pending)
+
+    attempts = 0
+    while True:
+        frame = frames[pending[0]] if pending else terminator
+        ser.write(frame)
+        stats.bytes_sent += len(frame)
+
+        resp, nak_seq = read_response(ser)
+        if resp == RESP_OK:
+            if not pending:
+                return
+            if debug:
+                print("Chunk {} accepted".format(pending[0]))
+            pending.pop(0)
+            attempts = 0
+            continue
+
+        attempts += 1
+        if attempts > MAX_RETRIES:
+            raise RuntimeError("ERROR: Chunk transfer stalled after {} attempts".format(attempts))
+
+        stats.retransmits += 1
+        if resp == RESP_NAK:
+            stats.crc_failures += 1
+            if nak_seq < len(frames):
+                # Send the chunk the bootloader is missing next.
+                if nak_seq in pending:
+                    pending.remove(nak_seq)
+                pending.insert(0, nak_seq)
+
+
+def main(ser, infile, debug, fec_parity=0, frame_size=FRAME_SIZE, signed=False, merkle_manifest=False,
+         shuffle=False, force=False, sparse=False, bond_ser=None):
     # Open serial port. Set baudrate to 115200. Set timeout to 2 seconds.
     with open(infile, 'rb') as fp:
         firmware_blob = fp.read()
 
+    bonded = bond_ser is not None
+    check_frame_size(frame_size, fec_parity, bonded)
+    if bonded and (fec_parity or merkle_manifest or sparse):
+        raise ValueError('Bonded frames can not be sent with FEC, as Merkle chunks or as segments')
+
+    # A signed blob ends in the signature, which travels ahead of the frames.
+    signature = None
+    if signed or merkle_manifest:
+        signature = firmware_blob[-SIGNATURE_LEN:]
+        firmware_blob = firmware_blob[:-SIGNATURE_LEN]
+
     metadata = firmware_blob[:4]
     firmware = firmware_blob[4:]
+    stats = TransferStats()
 
-    send_metadata(ser, metadata, debug=debug)
+    if not force and already_installed(ser, metadata, firmware):
+        print("Firmware is already installed, skipping the update.")
+        return stats
 
-    for idx, frame_start in enumerate(range(0, len(firmware), FRAME_SIZE)):
-        data = firmware[frame_start: frame_start + FRAME_SIZE]
+    options = session_options(fec_parity, frame_size, signed, merkle_manifest, sparse, bonded)
+    if merkle_manifest:
+        if fec_parity:
+            raise ValueError('Merkle chunks can not be sent with FEC')
+        if sparse:
+            raise ValueError('Merkle chunks are pieces of a flat image, not segments')
+        send_metadata(ser, metadata, stats, options, signature, merkle.manifest(firmware), debug=debug)
+        send_chunks(ser, firmware, stats, shuffle=shuffle, debug=debug)
+        print("Done writing firmware.")
+        print(stats)
+        return stats
 
-        # Get length of data.
-        length = len(data)
-        frame_fmt = '>H{}s'.format(length)
+    send_metadata(ser, metadata, stats, options, signature, debug=debug)
 
-        # Construct frame.
-        frame = struct.pack(frame_fmt, length, data)
+    frames = [make_frame(idx, firmware[frame_start: frame_start + frame_size], fec_parity, frame_size)
+              for idx, frame_start in enumerate(range(0, len(firmware), frame_size))]
 
-        if debug:
-            print("Writing frame {} ({} bytes)...".format(idx, len(frame)))
+    # Finish with a zero length payload to tell the bootlader to finish
+    # writing it's page.
+    frames.append(make_frame(len(frames), b'', fec_parity, frame_size))
 
-        send_frame(ser, frame, debug=debug)
+    if debug:
+        print("Writing {} frames...".format(len(frames)))
+
+    if bonded:
+        # Drop the debug output the metadata caused on UART2, once it is out.
+        time.sleep(0.05)
+        bond_ser.reset_input_buffer()
+        send_bonded([ser, bond_ser], frames, stats, PAGE_SIZE // frame_size, debug=debug)
+    else:
+        send_frames(ser, frames, stats, debug=debug)
 
     print("Done writing firmware.")
+    print(stats)
+
+    return stats
+
+
+def stream_update(ser, infile, version, message, debug, fec_parity=0, frame_size=FRAME_SIZE, force=False):
+    """
+    Protect the build output in infile and send it as it is encrypted.
+    """
+    check_frame_size(frame_size, fec_parity)
+
+    firmware = fw_protect.flatten(fw_protect.load_segments(infile))
+    metadata = fw_protect.make_metadata(version, firmware)
+    stats = TransferStats()
+
+    # The IV is random, so the body never matches what is installed; only
+    # the version can be checked.
+    if not force:
+        already_installed(ser, metadata, None)
+
+    send_metadata(ser, metadata, stats, session_options(fec_parity, frame_size), debug=debug)
+
+    pieces = fw_protect.protect_stream(firmware, metadata, message)
+    frames = StreamFrames(pieces, fw_protect.protected_body_len(len(firmware), message), fec_parity, frame_size)
+    send_frames(ser, frames, stats, debug=debug)
 
-    # Send a zero length payload to tell the bootlader to finish writing it's page.
-    ser.write(struct.pack('>H', 0x0000))
+    print("Done writing firmware.")
+    print(stats)
 
-    return ser
+    return stats
 
 
 if __name__ == '__main__':
@@ -110,10 +643,65 @@ if __name__ == '__main__':
                         required=True)
     parser.add_argument("--debug", help="Enable debugging messages.",
                         action='store_true')
+    parser.add_argument("--frame-size", help="Data bytes per frame, must divide 1024.",
+                        type=int, default=FRAME_SIZE)
+    parser.add_argument("--fec", help="Add this many Reed-Solomon parity bytes to each frame (even, up to 32).",
+                        type=int, default=0)
+    parser.add_argument("--signed", help="The firmware was signed by fw_protect.py --signing-key.",
+                        action='store_true')
+    parser.add_argument("--merkle", help="The firmware was signed by fw_protect.py --merkle; send it as Merkle chunks.",
+                        action='store_true')
+    parser.add_argument("--sparse", help="The firmware was protected with fw_protect.py --sparse.",
+                        action='store_true')
+    parser.add_argument("--shuffle", help="Send Merkle chunks in random order.",
+                        action='store_true')
+    parser.add_argument("--reset-port", help="Reset UART (UART0) to reset the device through before updating.",
+                        default=None)
+    parser.add_argument("--capture", help="Record the session to this file for uart_replay.py.",
+                        default=None)
+    parser.add_argument("--stream", help="--firmware is build output (.bin, ELF or Intel HEX) to protect while sending.",
+                        action='store_true')
+    parser.add_argument("--version", help="Version to protect the firmware as, with --stream.", type=int, default=None)
+    parser.add_argument("--message", help="Release message to protect the firmware with, with --stream.",
+                        default=None)
+    parser.add_argument("--force", help="Send the update even if the bootloader has it installed already.",
+                        action='store_true')
+    parser.add_argument("--bond-port", help="Serial port of the bootloader's UART2, to stripe the frames across "
+                        "both links.", default=None)
     args = parser.parse_args()
 
+    if args.stream and (args.version is None or args.message is None):
+        parser.error("--stream needs --version and --message")
+    if args.stream and (args.signed or args.merkle or args.sparse):
+        parser.error("--stream can not be combined with --signed, --merkle or --sparse")
+    if args.bond_port is not None and (args.stream or args.fec or args.merkle or args.sparse):
+        parser.error("--bond-port can not be combined with --stream, --fec, --merkle or --sparse")
+
+    if args.reset_port is not None:
+        print('Resetting device...')
+        reset_device(args.reset_port)
+
     print('Opening serial port...')
     ser = Serial(args.port, baudrate=115200, timeout=2)
-    main(ser=ser, infile=args.firmware, debug=args.debug)
+    bond_ser = None
+    if args.bond_port is not None:
+        bond_ser = Serial(args.bond_port, baudrate=115200, timeout=2)
+    capture = None
+    if args.capture is not None:
+        capture = uart_capture.CaptureWriter(args.capture)
+        ser = uart_capture.CapturingSerial(ser, capture)
+        if bond_ser is not None:
+            bond_ser = uart_capture.CapturingSerial(bond_ser, capture, uart=2)
+    try:
+        if args.stream:
+            stream_update(ser=ser, infile=args.firmware, version=args.version, message=args.message,
+                          debug=args.debug, fec_parity=args.fec, frame_size=args.frame_size, force=args.force)
+        else:
+            main(ser=ser, infile=args.firmware, debug=args.debug, fec_parity=args.fec, frame_size=args.frame_size,
+                 signed=args.signed, merkle_manifest=args.merkle, shuffle=args.shuffle, force=args.force,
+                 sparse=args.sparse, bond_ser=bond_ser)
+    finally:
+        if capture is not None:
+            capture.close()
 
 
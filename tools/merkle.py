@@ -0,0 +1,61 @@
+"""
+Merkle tree over 1KB firmware chunks
+
+Shared by fw_protect.py, which signs the root, and fw_update.py, which sends
+each chunk with the sibling hashes the bootloader needs to check it against
+that root.
+
+Leaves are SHA-256(0x00 || index (2, big-endian) || chunk) and inner nodes
+SHA-256(0x01 || left || right). A level with an odd number of nodes passes
+its last node up unchanged. This must match bootloader/src/merkle.c.
+"""
+import struct
+
+from Crypto.Hash import SHA256
+
+CHUNK_SIZE = 1024  # one flash page
+
+
+def _sha256(data):
+    return SHA256.new(data).digest()
+
+
+def leaf_hash(index, chunk):
+    return _sha256(b'\x00' + struct.pack('>H', index) + chunk)
+
+
+def node_hash(left, right):
+    return _sha256(b'\x01' + left + right)
+
+
+def chunks(body):
+    return [body[i:i + CHUNK_SIZE] for i in range(0, len(body), CHUNK_SIZE)]
+
+
+def build_tree(body):
+    """All levels of the tree, leaves first, root last."""
+    level = [leaf_hash(i, chunk) for i, chunk in enumerate(chunks(body))]
+    levels = [level]
+    while len(level) > 1:
+        parents = [node_hash(level[i], level[i + 1]) for i in range(0, len(level) - 1, 2)]
+        if len(level) % 2:
+            parents.append(level[-1])
+        level = parents
+        levels.append(level)
+    return levels
+
+
+def proof(levels, index):
+    """Sibling hashes from the leaf up, skipping levels where the node is passed up alone."""
+    path = []
+    for level in levels[:-1]:
+        sibling = index ^ 1
+        if sibling < len(level):
+            path.append(level[sibling])
+        index >>= 1
+    return b''.join(path)
+
+
+def manifest(body):
+    """Root and body length, the part of a Merkle release that gets signed."""
+    return build_tree(body)[-1][0] + struct.pack('>I', len(body))
@@ -0,0 +1,104 @@
+#!/usr/bin/env python
+"""
+UART Capture Format
+
+A capture is a 16-byte file header followed by one record per chunk of bytes
+seen on a UART, in the order they were seen.
+
+Header:
+[ 0x04 ]  [ 0x01 ]   [ 0x03 ]  [ 0x08 ]
+---------------------------------------------------
+| Magic  | Version | Unused  | Start (Unix seconds) |
+---------------------------------------------------
+
+Record:
+[ 0x04 ]         [ 0x01 ]  [ 0x02 ]  [ variable ]
+-------------------------------------------------
+| Time (us)     | Tag     | Length | Data...     |
+-------------------------------------------------
+
+All fields are little-endian. Time counts from the start in the header, so a
+capture can span a little over an hour. The tag is the UART number times two,
+plus one for bytes from the device to the host (zero for host to device).
+"""
+
+import struct
+import threading
+import time
+
+MAGIC = b'UCAP'
+VERSION = 1
+HEADER = struct.Struct('<4sB3xd')
+RECORD = struct.Struct('<IBH')
+
+TO_DEVICE = 0
+TO_HOST = 1
+
+
+class CaptureWriter:
+    """Appends records to a capture file. Safe to share between threads."""
+
+    def __init__(self, path):
+        self.f = open(path, 'wb')
+        self.start = time.time()
+        self.lock = threading.Lock()
+        self.f.write(HEADER.pack(MAGIC, VERSION, self.start))
+
+    def record(self, uart, direction, data):
+        if not data:
+            return
+        t_us = int((time.time() - self.start) * 1e6)
+        with self.lock:
+            for i in range(0, len(data), 0xFFFF):
+                chunk = data[i:i + 0xFFFF]
+                self.f.write(RECORD.pack(t_us, uart * 2 + direction, len(chunk)) + chunk)
+
+    def close(self):
+        with self.lock:
+            self.f.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+def read_capture(path):
+    """Return the (seconds, uart, direction, data) records of a capture."""
+    with open(path, 'rb') as f:
+        magic, version, _ = HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC or version != VERSION:
+            raise RuntimeError('{} is not a version {} UART capture'.format(path, VERSION))
+
+        records = []
+        while True:
+            head = f.read(RECORD.size)
+            if len(head) < RECORD.size:
+                return records
+            t_us, tag, length = RECORD.unpack(head)
+            records.append((t_us / 1e6, tag >> 1, tag & 1, f.read(length)))
+
+
+class CapturingSerial:
+    """
+    Wraps a Serial so everything written and read through it is recorded as
+    traffic on one UART. Anything else goes straight to the Serial.
+    """
+
+    def __init__(self, ser, writer, uart=1):
+        self.ser = ser
+        self.writer = writer
+        self.uart = uart
+
+    def write(self, data):
+        self.writer.record(self.uart, TO_DEVICE, bytes(data))
+        return self.ser.write(data)
+
+    def read(self, size=1):
+        data = self.ser.read(size)
+        self.writer.record(self.uart, TO_HOST, data)
+        return data
+
+    def __getattr__(self, name):
+        return getattr(self.ser, name)
@@ -0,0 +1,181 @@
+#!/usr/bin/env python
+"""
+UART Replay Tool
+
+Feeds the host side of a captured update (fw_update.py --capture or
+bl_emulate.py --capture) back into a bootloader and records the replay as a
+new capture, so the same traffic can be run against every protocol change.
+
+Only the host link (UART1) is replayed. Every host write first waits until
+the device has sent as many bytes as it had before that write in the capture,
+which keeps the replay in step with the bootloader. By default the write then
+goes out at once; with --realtime it also waits for its original offset from
+the start of the capture.
+
+Without --port, the latencies in the capture are printed instead: for each
+host write, the time until the device next sent anything. --compare prints
+them next to the latencies of a second capture, e.g. the replay.
+"""
+
+import argparse
+import statistics
+import threading
+import time
+
+import uart_capture
+
+HOST_UART = 1
+STALL_TIMEOUT = 5  # seconds to wait for the device's side before sending anyway
+
+
+def host_writes(records, uart=HOST_UART):
+    """
+    Return (seconds, data, device_bytes) for each host write, where
+    device_bytes counts what the device had sent before the write.
+    """
+    writes = []
+    device_bytes = 0
+    for t, rec_uart, direction, data in records:
+        if rec_uart != uart:
+            continue
+        if direction == uart_capture.TO_HOST:
+            device_bytes += len(data)
+        else:
+            writes.append((t, data, device_bytes))
+    return writes
+
+
+def latencies(records, uart=HOST_UART):
+    """Seconds from each host write to the device's next output, or None."""
+    result = []
+    pending = []
+    for t, rec_uart, direction, data in records:
+        if rec_uart != uart:
+            continue
+        if direction == uart_capture.TO_DEVICE:
+            pending.append(t)
+        elif pending:
+            result.extend(t - sent for sent in pending)
+            pending = []
+    return result + [None] * len(pending)
+
+
+class DeviceReader:
+    """Reads and records everything the device sends, counting the bytes."""
+
+    def __init__(self, ser, writer):
+        self.ser = ser
+        self.writer = writer
+        self.received = 0
+        self.cond = threading.Condition()
+        self.running = True
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    def _run(self):
+        while self.running:
+            data = self.ser.read(self.ser.in_waiting or 1)
+            if data:
+                self.writer.record(HOST_UART, uart_capture.TO_HOST, data)
+                with self.cond:
+                    self.received += len(data)
+                    self.cond.notify_all()
+
+    def wait_for(self, count, timeout):
+        with self.cond:
+            return self.cond.wait_for(lambda: self.received >= count, timeout)
+
+    def stop(self):
+        self.running = False
+        self.thread.join()
+
+
+def replay(ser, records, output, realtime=False):
+    """Replay the host writes in records over ser, recording to output."""
+    writes = host_writes(records)
+    device_total = sum(len(data) for _, uart, direction, data in records
+                       if uart == HOST_UART and direction == uart_capture.TO_HOST)
+    stalls = 0
+    with uart_capture.CaptureWriter(output) as writer:
+        reader = DeviceReader(ser, writer)
+        start = time.time()
+        try:
+            for t, data, device_bytes in writes:
+                if not reader.wait_for(device_bytes, STALL_TIMEOUT):
+                    stalls += 1
+                if realtime:
+                    delay = start + t - time.time()
+                    if delay > 0:
+                        time.sleep(delay)
+                writer.record(HOST_UART, uart_capture.TO_DEVICE, data)
+                ser.write(data)
+            # Give the device the same chance to answer the last write.
+            reader.wait_for(device_total, STALL_TIMEOUT)
+        finally:
+            reader.stop()
+    elapsed = time.time() - start
+
+    print('Replayed {} writes in {:.2f} s ({} stalled)'.format(len(writes), elapsed, stalls))
+
+
+def summary(values):
+    known = sorted(v for v in values if v is not None)
+    if not known:
+        return 'no responses'
+    return 'median {:.1f} ms, p95 {:.1f} ms, max {:.1f} ms, {} unanswered'.format(
+        1000 * statistics.median(known), 1000 * known[int(0.95 * (len(known) - 1))], 1000 * known[-1],
+        len(values) - len(known))
+
+
+def print_latencies(records, other=None):
+    a = latencies(records)
+    b = latencies(other) if other is not None else None
+
+    def ms(v):
+        return '-' if v is None else '{:.1f}'.format(1000 * v)
+
+    if b is None:
+        print('{:>6}  {:>10}'.format('Write', 'Latency ms'))
+        for i, v in enumerate(a):
+            print('{:>6}  {:>10}'.format(i, ms(v)))
+        print(summary(a))
+        return
+
+    print('{:>6}  {:>10}  {:>10}  {:>10}'.format('Write', 'First ms', 'Second ms', 'Delta ms'))
+    for i in range(max(len(a), len(b))):
+        va = a[i] if i < len(a) else None
+        vb = b[i] if i < len(b) else None
+        delta = ms(vb - va) if va is not None and vb is not None else '-'
+        print('{:>6}  {:>10}  {:>10}  {:>10}'.format(i, ms(va), ms(vb), delta))
+    print('First:  ' + summary(a))
+    print('Second: ' + summary(b))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='UART Replay Tool')
+    parser.add_argument("--capture", help="Capture to replay or inspect.", required=True)
+    parser.add_argument("--port", help="Host UART (UART1) of the bootloader to replay into.", default=None)
+    parser.add_argument("--reset-port", help="Reset UART (UART0) to reset the device through first.",
+                        default=None)
+    parser.add_argument("--output", help="Where to record the replay.", default='replay.ucap')
+    parser.add_argument("--realtime", help="Keep the original timing instead of replaying as fast as possible.",
+                        action='store_true')
+    parser.add_argument("--compare", help="Second capture to compare per-write latencies against.",
+                        default=None)
+    args = parser.parse_args()
+
+    records = uart_capture.read_capture(args.capture)
+    if args.port is None:
+        other = uart_capture.read_capture(args.compare) if args.compare else None
+        print_latencies(records, other)
+    else:
+        from serial import Serial
+
+        import fw_update
+
+        if args.reset_port is not None:
+            fw_update.reset_device(args.reset_port)
+        with Serial(args.port, baudrate=115200, timeout=0.1) as ser:
+            ser.reset_input_buffer()
+            replay(ser, records, args.output, args.realtime)
+        print_latencies(records, uart_capture.read_capture(args.output))